@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: MIT
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+// metadata checksums shared by the module and the tools, crc32c seeded with ~0 and without a final xor,
+// the kernel crc32c() uses the CPU crc32 instructions where there are any
+
+#ifdef __KERNEL__
+#include <linux/crc32c.h>
+#include <linux/stddef.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+// table driven crc32c (Castagnoli, reflected) giving the same results as the kernel crc32c()
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    static uint32_t table[256];
+    const unsigned char *p = buf;
+
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c >> 1) ^ (0x82F63B78 & -(c & 1));
+            table[i] = c;
+        }
+    }
+
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+    return crc;
+}
+#endif
+
+#include "file_table.h"
+
+#define YUKIFS_CSUM_SEED 0xFFFFFFFF
+
+// crc32c of len bytes at buf, the checksum field at csum_offset counts as zero
+static inline uint32_t yukifs_csum(const void *buf, size_t len, size_t csum_offset)
+{
+    const uint32_t zero = 0;
+    uint32_t crc = crc32c(YUKIFS_CSUM_SEED, buf, csum_offset);
+
+    crc = crc32c(crc, &zero, sizeof(zero));
+    return crc32c(crc, (const char *)buf + csum_offset + sizeof(zero), len - csum_offset - sizeof(zero));
+}
+
+static inline uint32_t yukifs_super_csum(const struct superblock_info *sbi)
+{
+    return yukifs_csum(sbi, sizeof(*sbi), offsetof(struct superblock_info, checksum));
+}
+
+static inline uint32_t yukifs_inode_csum(const struct file_object *fo)
+{
+    return yukifs_csum(fo, sizeof(*fo), offsetof(struct file_object, checksum));
+}
+
+// covers loc->size bytes, so fields added by later versions are checked as well
+static inline uint32_t yukifs_locator_csum(const struct yukifs_locator *loc)
+{
+    return yukifs_csum(loc, loc->size, offsetof(struct yukifs_locator, checksum));
+}
+
+// a locator is only used when it is one we know how to read and its checksum holds
+static inline int yukifs_locator_valid(const struct yukifs_locator *loc)
+{
+    if (loc->magic != YUKIFS_LOCATOR_MAGIC || loc->version < 1 || loc->size < sizeof(*loc) || loc->size > YUKIFS_LOCATOR_SIZE)
+        return 0;
+    return loc->checksum == yukifs_locator_csum(loc);
+}
+
+#ifndef __KERNEL__
+// read the locator at byte offset of an open image into loc, 0 when it is a usable one
+static inline int yukifs_read_locator(int fd, int64_t offset, struct yukifs_locator *loc)
+{
+    uint64_t buffer[YUKIFS_LOCATOR_SIZE / sizeof(uint64_t)];
+
+    if (lseek(fd, offset, SEEK_SET) == -1 || read(fd, buffer, sizeof(buffer)) != sizeof(buffer))
+        return -1;
+    if (!yukifs_locator_valid((struct yukifs_locator *)buffer))
+        return -1;
+
+    memcpy(loc, buffer, sizeof(*loc));
+    return 0;
+}
+#endif
+
+// directory index and leaf blocks keep the checksum of the whole block at the same place
+static inline uint32_t yukifs_dir_block_csum(const void *block, uint32_t block_size)
+{
+    return yukifs_csum(block, block_size, offsetof(struct yukifs_dir_leaf, checksum));
+}
+
+#endif /* CHECKSUM_H */
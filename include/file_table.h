@@ -3,12 +3,13 @@
 #ifndef FILE_TABLE_H
 #define FILE_TABLE_H
 
-#define FS_MAX_LEN 12
+#define FS_MAX_LEN 12 // name bytes kept in the inode record, the directory entry holds the full name
+#define YUKIFS_NAME_LEN 255 // longest name a directory entry can hold
 
 #define FILESYSTEM_MAGIC_NUMBER 0x59554B49 // FILESYSTEM MAGIC "YUKI"
 #define FILESYSTEM_MAGIC_BYTES {0x59,0x55,0x4B,0x49,0x00,0x00,0x00,0x00} // FILESYSTEM MAGIC "YUKI" FOR SUPERBLOCK INFO STRUCT
 #define FILE_DEFAULT_PERMISSION 0755
-#define FILE_OBJECT_ALIGN_SIZE 32
+#define FILE_OBJECT_ALIGN_SIZE 128
 #define SUPER_BLOCK_ALIGN_SIZE 512
 #define MINIMAL_BLOCK_SIZE 1024
 #define MAXIMUM_BLOCK_SIZE 8192
@@ -44,6 +45,142 @@ struct superblock_info {
     uint32_t data_blocks_total_size;
     uint32_t data_blocks_end_offset;
     uint32_t unallocated_space_size;
+    uint32_t inode_bitmap_offset; // one bit per inode table record, set when in use
+    uint32_t inode_bitmap_clusters;
+    uint32_t block_bitmap_offset; // one bit per data block, set when in use, always right after the inode bitmap
+    uint32_t block_bitmap_clusters;
+    uint32_t journal_offset; // metadata journal, always right after the block bitmap
+    uint32_t journal_clusters;
+    uint32_t group_blocks; // data blocks per allocation group, a whole number of bitmap blocks, the last group may be shorter
+    uint32_t group_inodes; // inode table records per allocation group, a whole number of bitmap blocks as well
+    uint32_t group_count; // 0 on images made before allocation groups, which are then one group
+    uint32_t orphan_head; // inode table index of the first record on the orphan list, 0 when it is empty
+    uint32_t checksum; // crc32c of this struct, see include/checksum.h
+};
+
+#define YUKIFS_JOURNAL_DESC_MAGIC 0x594A4453 // JOURNAL DESCRIPTOR BLOCK MAGIC "YJDS"
+#define YUKIFS_JOURNAL_COMMIT_MAGIC 0x594A434D // JOURNAL COMMIT BLOCK MAGIC "YJCM"
+#define YUKIFS_JOURNAL_MIN_BLOCKS 34 // descriptor, commit block and room for the largest operation, see YUKIFS_JOURNAL_HANDLE_BLOCKS
+#define YUKIFS_JOURNAL_MAX_BLOCKS 1024 // largest journal mkfs.yukifs lays out
+
+// a transaction is one descriptor block at the start of the journal, a copy of every block it lists
+// right behind it and a commit block after the copies, it only counts once the commit block is there
+struct yukifs_journal_header
+{
+    uint32_t magic; // YUKIFS_JOURNAL_DESC_MAGIC or YUKIFS_JOURNAL_COMMIT_MAGIC
+    uint32_t count; // blocks in the transaction
+    uint64_t sequence; // same in the descriptor and the commit block of one transaction
+};
+
+// the descriptor block is the header followed by the device block number of every copy
+struct yukifs_journal_descriptor
+{
+    struct yukifs_journal_header header;
+    uint32_t blocks[];
+};
+
+#define YUKIFS_INLINE_EXTENTS 6 // extents kept in the inode record before spilling into extent tree blocks
+#define YUKIFS_EXTENT_MAX_LEN 0xFFFF // blocks covered by a single extent
+#define YUKIFS_EXTENT_MAX_DEPTH 3 // levels of extent tree blocks below the record
+#define YUKIFS_EXTENT_MAGIC 0x59455854 // EXTENT TREE BLOCK MAGIC "YEXT"
+#define YUKIFS_EXTENT_UNWRITTEN 0x0001 // extent flag, blocks are allocated but never written and read back as zeros
+#define YUKIFS_EXTENT_COMPRESSED 0x0002 // extent flag, blocks hold a compressed cluster, see struct yukifs_compress_header
+
+#define YUKIFS_INLINE_DATA_SIZE (YUKIFS_INLINE_EXTENTS * sizeof(struct yukifs_extent)) // bytes a file may hold in its record instead of extents
+#define YUKIFS_INODE_INLINE_DATA 0x0001 // file_object flag, the data lives in inline_data and there are no extents,
+                                        // new files start this way and move to blocks for good once they outgrow it
+#define YUKIFS_INODE_COMPRESSED 0x0002 // file_object flag, the data is kept cluster by cluster and writeback
+                                       // compresses each cluster it writes
+#define YUKIFS_INODE_ORPHAN 0x0004 // file_object flag, the record is on the orphan list, unlinked but still open
+                                   // when links is 0 or in the middle of a truncate, mount finishes either
+
+// a run of data blocks, block numbers count from data_blocks_offset like first_block does
+struct yukifs_extent
+{
+    uint32_t logical_block; // first block of the file covered by this extent
+    uint32_t physical_block; // first data block of the run
+    uint16_t length; // number of blocks in the run
+    uint16_t flags;
+};
+
+// header of an extent tree block, the rest of the block is an array of struct yukifs_extent sorted by logical_block,
+// blocks on the lowest level of the tree hold extents, the ones above hold index entries like the record does
+struct yukifs_extent_block
+{
+    uint32_t magic; // always YUKIFS_EXTENT_MAGIC
+    uint16_t count; // extents in use
+    uint16_t max; // extents fitting in this block
+    struct yukifs_extent extents[];
+};
+
+#define YUKIFS_COMPRESS_MAGIC 0x59435A32 // COMPRESSED CLUSTER MAGIC "YCZ2"
+#define YUKIFS_COMPRESS_LZ4 1
+#define YUKIFS_COMPRESS_ZSTD 2
+#define YUKIFS_COMPRESS_CLUSTER_SHIFT 16 // log2 of the file bytes in a cluster, the same for every block and page size
+#define YUKIFS_MAX_FILE_BLOCKS 0x80000000 // most logical blocks a file may span, rounding up to a cluster never wraps
+
+// a compressed file is cut into clusters at fixed offsets, each written back on its own, a cluster is either plain
+// blocks or this header and the compressed data in the first blocks of its own logical range, mapped by extents
+// with YUKIFS_EXTENT_COMPRESSED, with the rest of the range left unmapped
+struct yukifs_compress_header
+{
+    uint32_t magic; // always YUKIFS_COMPRESS_MAGIC
+    uint8_t algorithm; // YUKIFS_COMPRESS_*
+    uint8_t reserved[3];
+    uint32_t length; // bytes of compressed data after the header
+    uint32_t raw_length; // file bytes the cluster held when written, the rest of it reads back as zeros
+};
+
+#define YUKIFS_DIR_INDEX_MAGIC 0x59444933 // DIRECTORY INDEX BLOCK MAGIC "YDI3", checksummed, with index levels
+#define YUKIFS_DIR_NODE_MAGIC 0x5944494E // DIRECTORY INDEX NODE MAGIC "YDIN", an index block below block 0
+#define YUKIFS_DIR_LEAF_MAGIC 0x59444533 // DIRECTORY LEAF BLOCK MAGIC "YDE3", variable length entries, checksummed
+#define YUKIFS_DIR_INDEX_BLOCK 0 // logical block of a directory holding its index
+#define YUKIFS_DIR_FIRST_LEAF 1 // logical block of the leaf mkfs sets up with every new directory
+#define YUKIFS_DIR_MAX_LEVELS 1 // node levels the index may grow below block 0, max squared leaves with one
+
+// points at the leaf, or the node one level down, holding the names whose hash is at least hash and below
+// the hash of the next entry
+struct yukifs_dir_index_entry
+{
+    uint32_t hash;
+    uint32_t block; // logical block of the directory
+};
+
+// logical block 0 of every directory and the nodes below it, entries are sorted by hash and the first one
+// of block 0 always has hash 0, once block 0 fills up its entries move to a node it then points at
+struct yukifs_dir_index
+{
+    uint32_t magic; // YUKIFS_DIR_INDEX_MAGIC in block 0, YUKIFS_DIR_NODE_MAGIC in the nodes
+    uint32_t checksum; // crc32c of the whole block, see include/checksum.h
+    uint16_t count; // entries in use
+    uint16_t max; // entries fitting in this block
+    uint8_t levels; // node levels below block 0, 0 when its entries point at leaves, only set in block 0
+    uint8_t reserved[3];
+    struct yukifs_dir_index_entry entries[];
+};
+
+// one name of a directory, readdir and lookup are served from these alone without touching the inode table
+struct yukifs_dirent
+{
+    uint32_t inode; // index in the inode table
+    uint32_t hash; // hash of the name
+    uint16_t rec_len; // bytes this entry takes, the header and the name rounded up to YUKIFS_DIRENT_ALIGN
+    uint8_t name_len;
+    uint8_t file_type; // DT_* value readdir reports
+    char name[]; // not NUL terminated
+};
+
+#define YUKIFS_DIRENT_ALIGN 4
+#define YUKIFS_DIRENT_LEN(name_len) (((uint32_t)sizeof(struct yukifs_dirent) + (name_len) + YUKIFS_DIRENT_ALIGN - 1) & ~(uint32_t)(YUKIFS_DIRENT_ALIGN - 1))
+
+// every other block of a directory, entries are packed back to back and sorted by hash
+struct yukifs_dir_leaf
+{
+    uint32_t magic; // always YUKIFS_DIR_LEAF_MAGIC
+    uint32_t checksum; // crc32c of the whole block, see include/checksum.h
+    uint16_t count; // entries in use
+    uint16_t used; // bytes of entries taken by them
+    unsigned char entries[];
 };
 
 struct file_object
@@ -53,10 +190,44 @@ struct file_object
     uint32_t size; //file size
     int inner_file;// determine the file is a builtin file.
     int descriptor; // the drwxrwxrwx thing, permissions & descriptors
-    unsigned int first_block;
+    unsigned int first_block; // preferred first data block, also makes the inode number
+    uint16_t extent_count; // entries used in extents
+    uint16_t extent_depth; // 0: extents map data directly, otherwise the levels of extent tree blocks below the record,
+                           // each index entry has the first block its tree block maps as logical_block and the tree
+                           // block as physical_block
+    union {
+        struct yukifs_extent extents[YUKIFS_INLINE_EXTENTS];
+        unsigned char inline_data[YUKIFS_INLINE_DATA_SIZE]; // the file itself when YUKIFS_INODE_INLINE_DATA is set
+    };
+    uint32_t flags; // YUKIFS_INODE_* flags
+    uint32_t links; // 1 for files, 2 plus one per subdirectory for directories
+    uint32_t checksum; // crc32c of the record, see include/checksum.h
+    uint32_t next_orphan; // index of the next record on the orphan list when YUKIFS_INODE_ORPHAN is set, 0 at its end
+    uint32_t reserved[1]; // keeps the record at FILE_OBJECT_ALIGN_SIZE bytes
 };
 
 
+#define YUKIFS_LOCATOR_MAGIC 0x59534C43 // SUPERBLOCK LOCATOR MAGIC "YSLC"
+#define YUKIFS_LOCATOR_VERSION 1
+#define YUKIFS_LOCATOR_SIZE 64 // bytes kept for the locator at the end of the first FS_PADDING_SIZE, the built-in ELF has to stop before them
+#define YUKIFS_LOCATOR_OFFSET (FS_PADDING_SIZE - YUKIFS_LOCATOR_SIZE) // byte offset of the primary locator
+#define YUKIFS_LOCATOR_BACKUP_AREA MINIMAL_BLOCK_SIZE // the last whole 1 KiB of the device, kept out of the filesystem for the backup locator
+#define YUKIFS_LOCATOR_BACKUP_OFFSET(device_size) (((device_size) / YUKIFS_LOCATOR_BACKUP_AREA - 1) * YUKIFS_LOCATOR_BACKUP_AREA)
+
+// written by mkfs.yukifs at YUKIFS_LOCATOR_OFFSET and again at YUKIFS_LOCATOR_BACKUP_OFFSET, so a mount finds
+// the superblock with one read instead of searching the hidden data for its markers
+struct yukifs_locator
+{
+    uint32_t magic; // always YUKIFS_LOCATOR_MAGIC
+    uint16_t version; // YUKIFS_LOCATOR_VERSION of the mkfs.yukifs that wrote it
+    uint16_t size; // sizeof(struct yukifs_locator) of that version, later versions only append fields
+    uint64_t superblock_offset; // byte offset of superblock_info, same as hidden_data_struct.superblock_offset
+    uint64_t hidden_data_offset; // byte offset of hidden_data_struct
+    uint64_t device_size; // bytes mkfs.yukifs laid the filesystem out on
+    uint32_t block_size; // superblock_info.block_size
+    uint32_t checksum; // crc32c of the first size bytes, see include/checksum.h
+};
+
 //this struct is write to device/image directly begin from the end of the built-in-data of the device/image
 struct hidden_data_struct
 {
@@ -16,6 +16,7 @@
 
 #include "../../include/version.h"
 #include "../../include/file_table.h"
+#include "../../include/checksum.h"
 #include "../../tools/built-in.h"
 
 void print_usage(const char *program_name) {
@@ -108,47 +109,58 @@ int extract_info(const char *device_path, bool no_info)
         return 1;
     }
 
-    // Allocate a buffer to read the file content
-    unsigned char *buffer = (unsigned char *)malloc(16*1024);
-    if (buffer == NULL) {
-        fprintf(stderr, "Error: Cannot allocate memory for file content\n");
-        close(fd);
-        return 1;
+    // the locator at the end of the first 1 KiB points at the superblock, the backup in the last 1 KiB is only read when it is damaged
+    struct yukifs_locator locator;
+    int64_t locator_offset = YUKIFS_LOCATOR_OFFSET;
+    int located = yukifs_read_locator(fd, locator_offset, &locator);
+    if (located != 0 && file_size >= 2 * YUKIFS_LOCATOR_BACKUP_AREA) {
+        locator_offset = YUKIFS_LOCATOR_BACKUP_OFFSET(file_size);
+        located = yukifs_read_locator(fd, locator_offset, &locator);
+        if (located == 0 && !no_info) printf("Superblock locator at offset %d is damaged, using the backup\n", YUKIFS_LOCATOR_OFFSET);
     }
 
-    // Read first 16KB of file into the buffer
-    ssize_t bytes_read = read(fd, buffer, 16*1024);
-    if (bytes_read == -1) {
-        fprintf(stderr, "Error: Cannot read from '%s': %s\n", device_path, strerror(errno));
-        free(buffer);
+    if (located != 0)
+    {
+        // failed to find the superblock
+        printf("Failed to find a superblock locator\n");
         close(fd);
         return 1;
     }
 
-    // found where 0x55AA and 0xAA55 is to locate hidden data  
-    int64_t hidden_data_offset = -1;
-    int64_t hidden_data_offset_end = -1;
+    if(!no_info)
+    {
+        printf("Superblock Locator Info:\n");
+        printf("  Offset: %ld\n", locator_offset);
+        printf("  Version: %u\n", locator.version);
+        printf("  Size: %u\n", locator.size);
+        printf("  Superblock Offset: %lu\n", locator.superblock_offset);
+        printf("  Hidden Data Offset: %lu\n", locator.hidden_data_offset);
+        printf("  Device Size: %lu\n", locator.device_size);
+        printf("  Block Size: %u\n", locator.block_size);
+        printf("  Checksum: %08X\n", locator.checksum);
+    }
 
-    for (off_t i = 0; i < bytes_read - 1; ++i) {
-        if (buffer[i] == 0x55 && buffer[i + 1] == 0xAA) {
-            if(!no_info) printf("Found sequence 0x55AA at offset %ld\n", i);
-            hidden_data_offset = i;
-        }
-        if (buffer[i] == 0xAA && buffer[i + 1] == 0x55) {
-            if(!no_info) printf("Found sequence 0xAA55 at offset %ld\n", i);
-            hidden_data_offset_end = i;
-        }
+    // Allocate a buffer to read the hidden data
+    unsigned char *buffer = (unsigned char *)malloc(sizeof(struct hidden_data_struct));
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Cannot allocate memory for file content\n");
+        close(fd);
+        return 1;
     }
 
-    if (hidden_data_offset == -1 && hidden_data_offset_end == -1)
-    {
-        // failed to find hidden data
-        printf("Failed to find hidden data\n");
+    // Read hidden data from the offset the locator gives
+    ssize_t bytes_read = -1;
+    if (lseek(fd, locator.hidden_data_offset, SEEK_SET) != -1) {
+        bytes_read = read(fd, buffer, sizeof(struct hidden_data_struct));
+    }
+    if (bytes_read != sizeof(struct hidden_data_struct)) {
+        fprintf(stderr, "Error: Cannot read hidden data from '%s': %s\n", device_path, strerror(errno));
+        free(buffer);
+        close(fd);
         return 1;
     }
 
-    // read hidden data from offset
-    struct hidden_data_struct *hidden_data = (struct hidden_data_struct *)(buffer + hidden_data_offset);
+    struct hidden_data_struct *hidden_data = (struct hidden_data_struct *)buffer;
 
     // print hidden data
     if(!no_info)
@@ -176,12 +188,12 @@ int extract_info(const char *device_path, bool no_info)
         printf("  End Magic Number: %02X%02X\n", hidden_data->hidden_end_magic_number[0], hidden_data->hidden_end_magic_number[1]);
     }
 
-    uint64_t superblock_offset = hidden_data->superblock_offset;
+    uint64_t superblock_offset = locator.superblock_offset;
 
     free(buffer);
 
     // seek to superblock offset
-    if (lseek(fd, hidden_data->superblock_offset, SEEK_SET) == -1) {
+    if (lseek(fd, superblock_offset, SEEK_SET) == -1) {
         fprintf(stderr, "Error: Cannot seek to the beginning of '%s': %s\n", device_path, strerror(errno));
         free(buffer);
         close(fd);
@@ -220,10 +232,22 @@ int extract_info(const char *device_path, bool no_info)
         printf("  Inode Table Storage Size: %u\n", superblock->inode_table_storage_size);
         printf("  Inode Table Clusters: %u\n", superblock->inode_table_clusters);    
         printf("  Inode Table Offset: %u\n", superblock->inode_table_offset);
+        printf("  Inode Bitmap Offset: %u\n", superblock->inode_bitmap_offset);
+        printf("  Inode Bitmap Clusters: %u\n", superblock->inode_bitmap_clusters);
+        printf("  Block Bitmap Offset: %u\n", superblock->block_bitmap_offset);
+        printf("  Block Bitmap Clusters: %u\n", superblock->block_bitmap_clusters);
+        printf("  Journal Offset: %u\n", superblock->journal_offset);
+        printf("  Journal Clusters: %u\n", superblock->journal_clusters);
+        printf("  Allocation Groups: %u\n", superblock->group_count);
+        printf("  Blocks Per Group: %u\n", superblock->group_blocks);
+        printf("  Inodes Per Group: %u\n", superblock->group_inodes);
+        printf("  Orphan List Head: %u\n", superblock->orphan_head);
         printf("  Data Blocks Offset: %u\n", superblock->data_blocks_offset);
         printf("  Data Blocks Total Size: %u\n", superblock->data_blocks_total_size);
         printf("  Data Blocks End Offset: %u\n", superblock->data_blocks_end_offset);
         printf("  Unallocated Space Size: %u\n", superblock->unallocated_space_size);
+        printf("  Checksum: %08X (%s)\n", superblock->checksum,
+            superblock->checksum == yukifs_super_csum(superblock) ? "ok" : "MISMATCH");
 
         // print image info
         printf("Image Info:\n");
@@ -249,11 +273,12 @@ int extract_info(const char *device_path, bool no_info)
         printf("  Inode Table Storage Size: %u\n", superblock->block_size * inode_table_clusters);
         printf("  Inode Table Clusters: %u\n", inode_table_clusters);
         printf("  Inode Table Offset: %lu\n", superblock_offset + superblock->block_size);    
-        uint64_t data_blocks_offset = superblock_offset + superblock->block_size + superblock->block_size * inode_table_clusters;
-        printf("  Data Blocks Offset: %lu\n",data_blocks_offset);
-        printf("  Data Blocks Total Size: %u\n", superblock->block_count * superblock->block_size);
-        printf("  Data Blocks End Offset: %lu\n", data_blocks_offset + superblock->block_free * superblock->block_size);
-        printf("  Unallocated Space Size: %lu\n", file_size - data_blocks_offset - superblock->block_count * superblock->block_size);
+        // the bitmaps are laid out per allocation group, so the data area is placed by what the superblock records
+        uint64_t data_blocks_end_offset = (uint64_t)superblock->data_blocks_offset + (uint64_t)superblock->block_count * superblock->block_size;
+        printf("  Data Blocks Offset: %u\n", superblock->data_blocks_offset);
+        printf("  Data Blocks Total Size: %lu\n", (uint64_t)superblock->block_count * superblock->block_size);
+        printf("  Data Blocks End Offset: %lu\n", data_blocks_end_offset);
+        printf("  Unallocated Space Size: %ld\n", file_size - (int64_t)data_blocks_end_offset);
     }
   
     // seek to inode table offset
@@ -282,10 +307,31 @@ int extract_info(const char *device_path, bool no_info)
             struct file_object *inode = (struct file_object *)(buffer + i * FILE_OBJECT_ALIGN_SIZE);
             if(inode->in_use)
             {
-                printf("  Inode %d: Name: %s, Size: %u, Descriptor: %o, First Block: %u, Inner: %u\n", i, 
-                    strlen(inode->name) > 0?inode->name:"<root>", inode->size, inode->descriptor, inode->first_block,
-                    inode->inner_file
+                // the record keeps at most FS_MAX_LEN bytes of the name and no terminator when it is that long
+                printf("  Inode %d: Name: %.*s, Size: %u, Descriptor: %o, First Block: %u, Inner: %u, Links: %u\n", i, 
+                    FS_MAX_LEN, strnlen(inode->name, FS_MAX_LEN) > 0?inode->name:"<root>", inode->size, inode->descriptor, inode->first_block,
+                    inode->inner_file, inode->links
                 );         
+                if (inode->checksum != yukifs_inode_csum(inode)) {
+                    printf("    Checksum: %08X (MISMATCH, expected %08X)\n", inode->checksum, yukifs_inode_csum(inode));
+                }
+                if (inode->flags & YUKIFS_INODE_INLINE_DATA) {
+                    printf("    Inline Data: %u bytes in the inode record\n", inode->size);
+                }
+                if (inode->flags & YUKIFS_INODE_COMPRESSED) {
+                    printf("    Compressed: %u byte clusters\n", 1U << YUKIFS_COMPRESS_CLUSTER_SHIFT);
+                }
+                for (int j = 0; !(inode->flags & YUKIFS_INODE_INLINE_DATA) && j < inode->extent_count && j < YUKIFS_INLINE_EXTENTS; j++) {
+                    if (inode->extent_depth == 0) {
+                        printf("    Extent %d: Logical Block: %u, Physical Block: %u, Length: %u%s\n", j,
+                            inode->extents[j].logical_block, inode->extents[j].physical_block, inode->extents[j].length,
+                            (inode->extents[j].flags & YUKIFS_EXTENT_UNWRITTEN) ? ", Unwritten" :
+                            (inode->extents[j].flags & YUKIFS_EXTENT_COMPRESSED) ? ", Compressed" : "");
+                    } else {
+                        printf("    Extent Tree Block %d: Logical Block: %u, Physical Block: %u, Depth: %u\n", j,
+                            inode->extents[j].logical_block, inode->extents[j].physical_block, inode->extent_depth);
+                    }
+                }
             }
             else
             {
@@ -16,6 +16,7 @@
 
 #include "../../include/version.h"
 #include "../../include/file_table.h"
+#include "../../include/checksum.h"
 #include "../../tools/built-in.h"
 
 #define DEFAULT_COUNT -1 // Indicate that count should default to block size
@@ -209,62 +210,36 @@ int do_stuff(struct viewfs_args *args) {
         return 1;
     }
 
-    // Allocate a buffer to read the file content
-    unsigned char *buffer = (unsigned char *)malloc(16*1024);
-    if (buffer == NULL) {
-        fprintf(stderr, "Error: Cannot allocate memory for file content\n");
-        close(fd);
-        return 1;
-    }
-
-    // Read first 16KB of file into the buffer
-    ssize_t bytes_read = read(fd, buffer, 16*1024);
-    if (bytes_read == -1) {
-        fprintf(stderr, "Error: Cannot read from '%s': %s\n", device_path, strerror(errno));
-        free(buffer);
-        close(fd);
-        return 1;
+    // the locator at the end of the first 1 KiB points at the superblock, the backup in the last 1 KiB is only read when it is damaged
+    struct yukifs_locator locator;
+    int64_t locator_offset = YUKIFS_LOCATOR_OFFSET;
+    int located = yukifs_read_locator(fd, locator_offset, &locator);
+    if (located != 0 && file_size >= 2 * YUKIFS_LOCATOR_BACKUP_AREA) {
+        locator_offset = YUKIFS_LOCATOR_BACKUP_OFFSET(file_size);
+        located = yukifs_read_locator(fd, locator_offset, &locator);
     }
 
-    // found where 0x55AA and 0xAA55 is to locate hidden data  
-    int64_t hidden_data_offset = -1;
-    int64_t hidden_data_offset_end = -1;
-
-    for (off_t i = 0; i < bytes_read - 1; ++i) {
-        if (buffer[i] == 0x55 && buffer[i + 1] == 0xAA) {
-            hidden_data_offset = i;
-        }
-        if (buffer[i] == 0xAA && buffer[i + 1] == 0x55) {
-            hidden_data_offset_end = i;
-        }
-    }
-
-    if (hidden_data_offset == -1 && hidden_data_offset_end == -1)
+    if (located != 0)
     {
-        // failed to find hidden data
-        printf("Failed to find hidden data\n");
+        // failed to find the superblock
+        printf("Failed to find a superblock locator\n");
+        close(fd);
         return 1;
     }
 
-    // read hidden data from offset
-    struct hidden_data_struct *hidden_data = (struct hidden_data_struct *)(buffer + hidden_data_offset);
-
-    uint64_t superblock_offset = hidden_data->superblock_offset;
-
-    free(buffer);
+    uint64_t superblock_offset = locator.superblock_offset;
 
     // seek to superblock offset
-    if (lseek(fd, hidden_data->superblock_offset, SEEK_SET) == -1) {
+    if (lseek(fd, superblock_offset, SEEK_SET) == -1) {
         fprintf(stderr, "Error: Cannot seek to the beginning of '%s': %s\n", device_path, strerror(errno));
-        free(buffer);
         close(fd);
         return 1;
     }
 
     // read superblock to buffer
-    buffer = (unsigned char *)malloc(8*1024);
+    unsigned char *buffer = (unsigned char *)malloc(8*1024);
     struct superblock_info *superblock=(struct superblock_info *)(buffer);
-    bytes_read = read(fd, buffer, 8*1024);
+    ssize_t bytes_read = read(fd, buffer, 8*1024);
     if (bytes_read == -1) {
         fprintf(stderr, "Error: Cannot read from '%s': %s\n", device_path, strerror(errno));
         free(buffer);
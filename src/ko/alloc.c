@@ -0,0 +1,551 @@
+// SPDX-License-Identifier: MIT
+#include "alloc.h"
+#include "journal.h"
+
+// the volume is cut into allocation groups, group g owns inodes g * group_inodes on and data blocks
+// g * group_blocks on, along with their bits in both bitmaps, its free counts and its lock
+
+#pragma region Bitmap Blocks
+
+static inline uint32_t yukifs_bitmaps_clusters(struct superblock_info *sbi)
+{
+    return sbi->inode_bitmap_clusters + sbi->block_bitmap_clusters;
+}
+
+// remember the bitmap block holding bit nr of bitmap so the next sync writes it back, the dirty bits are
+// shared by all groups so they only change atomically
+static void yukifs_bitmap_mark_dirty(struct super_block *sb, char *bitmap, uint32_t nr)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    uint32_t block = (bitmap - fsi->bitmaps + nr / 8) / fsi->sbi->block_size;
+
+    set_bit(block, fsi->bitmaps_dirty);
+}
+
+// set bits first..end of bitmap, first is a multiple of 8 * block_size or 0 so it starts a long
+static uint32_t yukifs_bitmap_weight(char *bitmap, uint32_t first, uint32_t end)
+{
+    if (end <= first)
+        return 0;
+
+    return bitmap_weight((unsigned long *)(bitmap + first / 8), end - first);
+}
+
+// check the group geometry in the superblock, images without it are one group spanning everything
+static int yukifs_groups_load(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+    uint32_t bitmap_bits = sbi->block_size * 8;
+
+    if (sbi->group_count == 0) {
+        fsi->group_count = 1;
+        fsi->group_blocks = sbi->block_count;
+        fsi->group_inodes = sbi->total_inodes;
+    } else {
+        // a group owns whole bitmap blocks, so neither its bits nor its dirty blocks are shared with another group
+        if (sbi->group_blocks == 0 || sbi->group_inodes == 0 ||
+            sbi->group_blocks % bitmap_bits || sbi->group_inodes % bitmap_bits ||
+            sbi->group_count != DIV_ROUND_UP(sbi->block_count, sbi->group_blocks) ||
+            DIV_ROUND_UP(sbi->total_inodes, sbi->group_inodes) > sbi->group_count) {
+            printk(KERN_ERR "YukiFS: bad allocation group geometry, %u groups of %u blocks and %u inodes\n",
+                sbi->group_count, sbi->group_blocks, sbi->group_inodes);
+            return -EINVAL;
+        }
+
+        fsi->group_count = sbi->group_count;
+        fsi->group_blocks = sbi->group_blocks;
+        fsi->group_inodes = sbi->group_inodes;
+    }
+
+    fsi->groups = kvcalloc(fsi->group_count, sizeof(struct yukifs_group), GFP_KERNEL);
+    if (!fsi->groups)
+        return -ENOMEM;
+
+    for (uint32_t g = 0; g < fsi->group_count; g++) {
+        struct yukifs_group *grp = &fsi->groups[g];
+        uint32_t first_inode = min(g * fsi->group_inodes, sbi->total_inodes);
+        uint32_t end_inode = min_t(uint64_t, (uint64_t)first_inode + fsi->group_inodes, sbi->total_inodes);
+        uint32_t first_block = g * fsi->group_blocks;
+        uint32_t end_block = min_t(uint64_t, (uint64_t)first_block + fsi->group_blocks, sbi->block_count);
+
+        spin_lock_init(&grp->lock);
+        grp->free_inodes = end_inode - first_inode - yukifs_bitmap_weight(fsi->inode_bitmap, first_inode, end_inode);
+        grp->free_blocks = end_block - first_block - yukifs_bitmap_weight(fsi->block_bitmap, first_block, end_block);
+        grp->inode_hint = first_inode;
+        grp->block_hint = first_block;
+    }
+
+    return 0;
+}
+
+int yukifs_bitmaps_load(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+    uint32_t clusters = yukifs_bitmaps_clusters(sbi);
+
+    // images made before the bitmaps existed have no room reserved for them
+    if (sbi->inode_bitmap_offset == 0 || sbi->block_bitmap_offset != sbi->inode_bitmap_offset + sbi->inode_bitmap_clusters * sbi->block_size) {
+        printk(KERN_ERR "YukiFS: image has no usable inode and block bitmaps, recreate it with a newer mkfs\n");
+        return -EINVAL;
+    }
+
+    fsi->bitmaps = kvzalloc(clusters * sbi->block_size, GFP_KERNEL);
+    if (!fsi->bitmaps) {
+        printk(KERN_ERR "YukiFS: Error allocating bitmaps\n");
+        return -ENOMEM;
+    }
+
+    fsi->bitmaps_dirty = bitmap_zalloc(clusters, GFP_KERNEL);
+    fsi->block_pinned = kvzalloc(sbi->block_bitmap_clusters * sbi->block_size, GFP_KERNEL);
+    if (!fsi->bitmaps_dirty || !fsi->block_pinned) {
+        yukifs_bitmaps_release(sb);
+        return -ENOMEM;
+    }
+
+    if (yukifs_blocks_read(sb, sbi->inode_bitmap_offset / sbi->block_size, clusters, fsi->bitmaps) < 0) {
+        printk(KERN_ERR "YukiFS: Error reading bitmaps\n");
+        yukifs_bitmaps_release(sb);
+        return -EIO;
+    }
+
+    fsi->inode_bitmap = fsi->bitmaps;
+    fsi->block_bitmap = fsi->bitmaps + sbi->inode_bitmap_clusters * sbi->block_size;
+
+    int ret = yukifs_groups_load(sb);
+    if (ret) {
+        yukifs_bitmaps_release(sb);
+        return ret;
+    }
+
+    // the bitmaps are the authority, the counters in the superblock only mirror them
+    if (percpu_counter_init(&fsi->free_inodes, sbi->total_inodes - bitmap_weight((unsigned long *)fsi->inode_bitmap, sbi->total_inodes), GFP_KERNEL) ||
+        percpu_counter_init(&fsi->free_blocks, sbi->block_count - bitmap_weight((unsigned long *)fsi->block_bitmap, sbi->block_count), GFP_KERNEL)) {
+        yukifs_bitmaps_release(sb);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void yukifs_bitmaps_release(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+
+    percpu_counter_destroy(&fsi->free_blocks);
+    percpu_counter_destroy(&fsi->free_inodes);
+    kvfree(fsi->groups);
+    kvfree(fsi->block_pinned);
+    bitmap_free(fsi->bitmaps_dirty);
+    kvfree(fsi->bitmaps);
+    fsi->groups = NULL;
+    fsi->block_pinned = NULL;
+    fsi->bitmaps_dirty = NULL;
+    fsi->bitmaps = NULL;
+    fsi->inode_bitmap = NULL;
+    fsi->block_bitmap = NULL;
+}
+
+// log block i of the block bitmap with the pinned bits cleared, which is what it says once the running
+// transaction is on the disk, the group lock keeps the bits from being released halfway through the copy
+static int yukifs_block_bitmap_write(struct super_block *sb, uint32_t i)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+    uint32_t bitmap_bits = sbi->block_size * 8;
+    uint32_t first = i * bitmap_bits;
+    struct yukifs_group *grp = &fsi->groups[first / fsi->group_blocks];
+    struct buffer_head *bh;
+
+    bh = sb_getblk(sb, sbi->block_bitmap_offset / sbi->block_size + i);
+    if (!bh)
+        return -EIO;
+
+    lock_buffer(bh);
+    spin_lock(&grp->lock);
+    bitmap_andnot((unsigned long *)bh->b_data, (unsigned long *)(fsi->block_bitmap + first / 8),
+        (unsigned long *)(fsi->block_pinned + first / 8), bitmap_bits);
+    spin_unlock(&grp->lock);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    yukifs_journal_dirty(sb, bh);
+    brelse(bh);
+
+    return 0;
+}
+
+// write back only the bitmap blocks touched since the last sync, neighbouring dirty inode bitmap blocks go out
+// as one batch
+int yukifs_bitmaps_sync(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+    uint32_t bitmap_block_nr = sbi->inode_bitmap_offset / sbi->block_size;
+    uint32_t clusters = yukifs_bitmaps_clusters(sbi);
+    unsigned int start, end;
+
+    for_each_set_bitrange(start, end, fsi->bitmaps_dirty, clusters) {
+        unsigned int split = clamp(sbi->inode_bitmap_clusters, start, end);
+        int ret = 0;
+
+        // a bit set again while the blocks are copied just gets them logged once more
+        for (unsigned int i = start; i < end; i++)
+            clear_bit(i, fsi->bitmaps_dirty);
+
+        if (split > start && yukifs_blocks_write(sb, bitmap_block_nr + start, split - start, fsi->bitmaps + start * sbi->block_size) < 0)
+            ret = -EIO;
+        for (unsigned int i = split; !ret && i < end; i++)
+            ret = yukifs_block_bitmap_write(sb, i - sbi->inode_bitmap_clusters);
+
+        if (ret) {
+            printk(KERN_ERR "YukiFS: Error writing bitmap blocks %u-%u\n", start, end - 1);
+            for (unsigned int i = start; i < end; i++)
+                set_bit(i, fsi->bitmaps_dirty);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+#pragma endregion
+
+#pragma region Allocation Groups
+
+// first zero bit of bitmap in first..end, searching from start on and then wrapping around to first, end when there is none
+static unsigned long yukifs_group_find(char *bitmap, unsigned long first, unsigned long end, unsigned long start)
+{
+    unsigned long bit;
+
+    if (start < first || start >= end)
+        start = first;
+
+    bit = find_next_zero_bit_le(bitmap, end, start);
+    if (bit < end)
+        return bit;
+
+    bit = find_next_zero_bit_le(bitmap, start, first);
+    return bit < start ? bit : end;
+}
+
+// first run of count zero bits of bitmap in first..end that lies within one bitmap block, searching from start on
+// and then wrapping around to first, end when there is none
+static unsigned long yukifs_group_find_whole(char *bitmap, unsigned long first, unsigned long end, unsigned long start,
+    uint32_t count, uint32_t bitmap_bits)
+{
+    if (start < first || start >= end)
+        start = first;
+
+    for (int pass = 0; pass < 2; pass++) {
+        unsigned long limit = pass ? start : end;
+        unsigned long bit = pass ? first : start;
+
+        while ((bit = find_next_zero_bit_le(bitmap, limit, bit)) < limit) {
+            unsigned long stop = min(end, round_down(bit, bitmap_bits) + bitmap_bits);
+            unsigned long run_end = find_next_bit_le(bitmap, min_t(unsigned long, stop, bit + count), bit);
+
+            if (run_end - bit == count)
+                return bit;
+            bit = run_end;
+        }
+    }
+
+    return end;
+}
+
+// the group new directories and goal-less writes start in, spreading them by CPU keeps parallel
+// creators and writers out of each other's groups
+static inline uint32_t yukifs_group_spread(struct yukifs_fs_info *fsi)
+{
+    return raw_smp_processor_id() % fsi->group_count;
+}
+
+// where the data of inode table record index should go, the same share of its group as the record has of its own
+uint32_t yukifs_inode_block_goal(struct super_block *sb, uint32_t index)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    uint32_t group = index / fsi->group_inodes;
+    uint32_t block = group * fsi->group_blocks + (uint64_t)(index % fsi->group_inodes) * fsi->group_blocks / fsi->group_inodes;
+
+    return block < fsi->sbi->block_count ? block : 0;
+}
+
+#pragma endregion
+
+#pragma region Inode Allocation
+
+// the cheap per-CPU estimate may read 0 while other CPUs still hold a few, only trust it after a full sum
+static inline bool yukifs_counter_empty(struct percpu_counter *counter)
+{
+    return percpu_counter_read_positive(counter) == 0 && percpu_counter_sum(counter) <= 0;
+}
+
+// claim a free inode table record, goal is a record whose group is tried first, files pass their parent
+// so they stay near it, goal past the end picks a group by CPU, the search in a group resumes where it last stopped
+int yukifs_new_inode_nr(struct super_block *sb, uint32_t goal, uint32_t *index)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+    uint32_t start;
+
+    if (yukifs_counter_empty(&fsi->free_inodes))
+        return -ENOSPC;
+
+    start = goal < sbi->total_inodes ? goal / fsi->group_inodes : yukifs_group_spread(fsi);
+
+    for (uint32_t i = 0; i < fsi->group_count; i++) {
+        uint32_t g = (start + i) % fsi->group_count;
+        struct yukifs_group *grp = &fsi->groups[g];
+        uint32_t first = g * fsi->group_inodes;
+        uint32_t end = min_t(uint64_t, (uint64_t)first + fsi->group_inodes, sbi->total_inodes);
+        unsigned long bit;
+
+        // full groups are skipped without touching their lock
+        if (!READ_ONCE(grp->free_inodes))
+            continue;
+
+        spin_lock(&grp->lock);
+
+        bit = yukifs_group_find(fsi->inode_bitmap, first, end, grp->inode_hint);
+        if (bit >= end) {
+            spin_unlock(&grp->lock);
+            continue;
+        }
+
+        __set_bit_le(bit, fsi->inode_bitmap);
+        yukifs_bitmap_mark_dirty(sb, fsi->inode_bitmap, bit);
+        grp->free_inodes--;
+        grp->inode_hint = bit + 1;
+
+        spin_unlock(&grp->lock);
+
+        percpu_counter_dec(&fsi->free_inodes);
+
+        *index = bit;
+        return 0;
+    }
+
+    printk(KERN_ERR "YukiFS: free inode count is %lld but the inode bitmap is full\n", percpu_counter_sum(&fsi->free_inodes));
+    return -ENOSPC;
+}
+
+void yukifs_free_inode_nr(struct super_block *sb, uint32_t index)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+
+    if (index == 0 || index >= sbi->total_inodes) {
+        printk(KERN_ERR "YukiFS: freeing invalid inode %u\n", index);
+        return;
+    }
+
+    struct yukifs_group *grp = &fsi->groups[index / fsi->group_inodes];
+
+    spin_lock(&grp->lock);
+
+    if (!test_bit_le(index, fsi->inode_bitmap)) {
+        spin_unlock(&grp->lock);
+        printk(KERN_ERR "YukiFS: inode %u is already free\n", index);
+        return;
+    }
+
+    __clear_bit_le(index, fsi->inode_bitmap);
+    yukifs_bitmap_mark_dirty(sb, fsi->inode_bitmap, index);
+    grp->free_inodes++;
+    if (index < grp->inode_hint)
+        grp->inode_hint = index;
+
+    spin_unlock(&grp->lock);
+
+    percpu_counter_inc(&fsi->free_inodes);
+}
+
+#pragma endregion
+
+#pragma region Block Allocation
+
+// take a run of up to *count data blocks as close to goal as possible, or only all of them when whole is set,
+// goal past the end means no preference, the run never leaves its group or its bitmap block, so a handle
+// pays one bitmap block for it
+static int yukifs_take_blocks(struct super_block *sb, uint32_t goal, uint32_t *block, uint32_t *count, bool whole)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+    uint32_t bitmap_bits = sbi->block_size * 8;
+    uint32_t start;
+
+    if (yukifs_counter_empty(&fsi->free_blocks))
+        return -ENOSPC;
+
+    start = goal < sbi->block_count ? goal / fsi->group_blocks : yukifs_group_spread(fsi);
+
+    for (uint32_t i = 0; i < fsi->group_count; i++) {
+        uint32_t g = (start + i) % fsi->group_count;
+        struct yukifs_group *grp = &fsi->groups[g];
+        uint32_t first = g * fsi->group_blocks;
+        uint32_t end = min_t(uint64_t, (uint64_t)first + fsi->group_blocks, sbi->block_count);
+        unsigned long from;
+        unsigned long bit;
+        unsigned long run_end;
+
+        if (READ_ONCE(grp->free_blocks) < (whole ? *count : 1))
+            continue;
+
+        spin_lock(&grp->lock);
+
+        // the goal only means something in its own group, other groups carry on from their hint
+        from = i == 0 && goal < sbi->block_count ? goal : grp->block_hint;
+        if (whole)
+            bit = yukifs_group_find_whole(fsi->block_bitmap, first, end, from, *count, bitmap_bits);
+        else
+            bit = yukifs_group_find(fsi->block_bitmap, first, end, from);
+        if (bit >= end) {
+            spin_unlock(&grp->lock);
+            continue;
+        }
+
+        // the run ends at the next block in use or the end of the bitmap block
+        run_end = min_t(unsigned long, end, round_down(bit, bitmap_bits) + bitmap_bits);
+        run_end = find_next_bit_le(fsi->block_bitmap, min_t(unsigned long, run_end, bit + max(*count, 1U)), bit);
+        for (unsigned long b = bit; b < run_end; b++) {
+            __set_bit_le(b, fsi->block_bitmap);
+            yukifs_bitmap_mark_dirty(sb, fsi->block_bitmap, b);
+        }
+        grp->free_blocks -= run_end - bit;
+        grp->block_hint = run_end;
+
+        spin_unlock(&grp->lock);
+
+        percpu_counter_sub(&fsi->free_blocks, run_end - bit);
+
+        *block = bit;
+        *count = run_end - bit;
+        return 0;
+    }
+
+    // free blocks too scattered for a whole run are no inconsistency
+    if (!whole)
+        printk(KERN_ERR "YukiFS: free block count is %lld but the block bitmap is full\n", percpu_counter_sum(&fsi->free_blocks));
+    return -ENOSPC;
+}
+
+// allocate a run of up to *count data blocks starting as close to goal as possible, goal past the end
+// means no preference, *count comes back as the length of the run actually taken, which never leaves its group
+// or the bitmap block it starts in
+int yukifs_new_blocks(struct super_block *sb, uint32_t goal, uint32_t *block, uint32_t *count)
+{
+    return yukifs_take_blocks(sb, goal, block, count, false);
+}
+
+// allocate count data blocks in one run as close to goal as possible, -ENOSPC when the free space has no such run
+int yukifs_new_blocks_whole(struct super_block *sb, uint32_t goal, uint32_t *block, uint32_t count)
+{
+    return yukifs_take_blocks(sb, goal, block, &count, true);
+}
+
+// allocate one data block as close to goal as possible, goal past the end means no preference
+int yukifs_new_block(struct super_block *sb, uint32_t goal, uint32_t *block)
+{
+    uint32_t count = 1;
+
+    return yukifs_new_blocks(sb, goal, block, &count);
+}
+
+// give blocks back to the allocator, callers hold a journal handle, the blocks stay allocated until the
+// transaction freeing them is on the disk, a crash before that still finds them mapped by whatever had them and
+// whoever gets them next must not have written over them, see yukifs_release_blocks
+void yukifs_free_blocks(struct super_block *sb, uint32_t block, uint32_t count)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+    bool pin = fsi->journal != NULL;
+    uint32_t freed = 0;
+
+    if (block >= sbi->block_count || count > sbi->block_count - block) {
+        printk(KERN_ERR "YukiFS: freeing blocks %u+%u outside the data area\n", block, count);
+        return;
+    }
+
+    // directory, extent tree and compressed cluster blocks live in the buffer cache, whoever gets a block next
+    // must not have a stale copy logged or written over it
+    for (uint32_t i = 0; i < count; i++) {
+        struct buffer_head *bh = sb_find_get_block(sb, yukifs_data_block_nr(sb, block + i));
+        if (bh)
+            yukifs_journal_forget(sb, bh);
+    }
+
+    // a run from before the volume had groups may straddle a group boundary, free it group by group
+    while (count > 0) {
+        uint32_t g = block / fsi->group_blocks;
+        struct yukifs_group *grp = &fsi->groups[g];
+        uint32_t n = min_t(uint64_t, count, (uint64_t)(g + 1) * fsi->group_blocks - block);
+        uint32_t group_freed = 0;
+
+        spin_lock(&grp->lock);
+
+        for (uint32_t i = block; i < block + n; i++) {
+            if (!test_bit_le(i, fsi->block_bitmap) || test_bit_le(i, fsi->block_pinned)) {
+                printk(KERN_ERR "YukiFS: block %u is already free\n", i);
+                continue;
+            }
+
+            // the bitmap block is logged with pinned bits cleared, see yukifs_block_bitmap_write
+            if (pin) {
+                __set_bit_le(i, fsi->block_pinned);
+            } else {
+                __clear_bit_le(i, fsi->block_bitmap);
+                group_freed++;
+            }
+            yukifs_bitmap_mark_dirty(sb, fsi->block_bitmap, i);
+        }
+        grp->free_blocks += group_freed;
+
+        spin_unlock(&grp->lock);
+
+        if (pin)
+            yukifs_journal_defer_free(sb, block, n);
+
+        freed += group_freed;
+        block += n;
+        count -= n;
+    }
+
+    percpu_counter_add(&fsi->free_blocks, freed);
+}
+
+// hand the pinned blocks of count blocks from block to the allocator, the journal calls this once the transaction
+// that freed them is on the disk, the bitmap blocks it logged already have them free
+void yukifs_release_blocks(struct super_block *sb, uint32_t block, uint32_t count)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    uint32_t released = 0;
+
+    while (count > 0) {
+        uint32_t g = block / fsi->group_blocks;
+        struct yukifs_group *grp = &fsi->groups[g];
+        uint32_t n = min_t(uint64_t, count, (uint64_t)(g + 1) * fsi->group_blocks - block);
+        uint32_t group_released = 0;
+
+        spin_lock(&grp->lock);
+
+        for (uint32_t i = block; i < block + n; i++) {
+            if (!__test_and_clear_bit_le(i, fsi->block_pinned))
+                continue;
+
+            __clear_bit_le(i, fsi->block_bitmap);
+            group_released++;
+        }
+        grp->free_blocks += group_released;
+
+        spin_unlock(&grp->lock);
+
+        released += group_released;
+        block += n;
+        count -= n;
+    }
+
+    percpu_counter_add(&fsi->free_blocks, released);
+}
+
+#pragma endregion
@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: MIT
+#ifndef KO_ALLOC_H
+#define KO_ALLOC_H
+
+#include "misc.h"
+
+extern int yukifs_bitmaps_load(struct super_block *sb);
+extern void yukifs_bitmaps_release(struct super_block *sb);
+extern int yukifs_bitmaps_sync(struct super_block *sb);
+
+extern uint32_t yukifs_inode_block_goal(struct super_block *sb, uint32_t index);
+
+extern int yukifs_new_inode_nr(struct super_block *sb, uint32_t goal, uint32_t *index);
+extern void yukifs_free_inode_nr(struct super_block *sb, uint32_t index);
+
+extern int yukifs_new_block(struct super_block *sb, uint32_t goal, uint32_t *block);
+extern int yukifs_new_blocks(struct super_block *sb, uint32_t goal, uint32_t *block, uint32_t *count);
+extern int yukifs_new_blocks_whole(struct super_block *sb, uint32_t goal, uint32_t *block, uint32_t count);
+extern void yukifs_free_blocks(struct super_block *sb, uint32_t block, uint32_t count);
+extern void yukifs_release_blocks(struct super_block *sb, uint32_t block, uint32_t count);
+
+#endif
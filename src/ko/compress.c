@@ -0,0 +1,943 @@
+// SPDX-License-Identifier: MIT
+#include <linux/lz4.h>
+#include <linux/zstd.h>
+
+#include "file.h"
+#include "compress.h"
+
+// a compressed file is cut into clusters of YUKIFS_COMPRESS_CLUSTER_SIZE bytes at fixed offsets, writeback goes
+// a cluster at a time and writes it to new blocks, compressed when that saves a block and as it is otherwise,
+// so a write only ever costs the clusters it touched, reads decompress the clusters behind the folios they fill
+
+#pragma region Codecs
+
+// a codec workspace, ctx is what the codec runs on and lies somewhere in mem
+struct yukifs_workspace
+{
+    struct list_head list;
+    void *ctx;
+    char mem[];
+};
+
+// YUKIFS_COMPRESS_* for a compress= mount option value, 0 for none
+int yukifs_compress_algorithm(const char *name)
+{
+    if (!strcmp(name, "lz4"))
+        return YUKIFS_COMPRESS_LZ4;
+    if (!strcmp(name, "zstd"))
+        return YUKIFS_COMPRESS_ZSTD;
+    if (!strcmp(name, "none"))
+        return 0;
+
+    return -EINVAL;
+}
+
+const char *yukifs_compress_name(uint8_t algorithm)
+{
+    switch (algorithm) {
+    case YUKIFS_COMPRESS_LZ4:
+        return "lz4";
+    case YUKIFS_COMPRESS_ZSTD:
+        return "zstd";
+    default:
+        return "none";
+    }
+}
+
+static zstd_parameters yukifs_zstd_params(void)
+{
+    return zstd_get_params(YUKIFS_ZSTD_LEVEL, YUKIFS_COMPRESS_CLUSTER_SIZE);
+}
+
+static struct yukifs_workspace *yukifs_workspace_alloc(enum yukifs_workspace_kind kind)
+{
+    zstd_parameters params = yukifs_zstd_params();
+    struct yukifs_workspace *ws;
+    size_t size = LZ4_MEM_COMPRESS;
+
+    if (kind == YUKIFS_WORKSPACE_ZSTD)
+        size = zstd_cctx_workspace_bound(&params.cParams);
+    else if (kind == YUKIFS_WORKSPACE_UNZSTD)
+        size = zstd_dctx_workspace_bound();
+
+    ws = kvmalloc(struct_size(ws, mem, size), GFP_NOFS);
+    if (!ws)
+        return NULL;
+
+    ws->ctx = ws->mem;
+    if (kind == YUKIFS_WORKSPACE_ZSTD)
+        ws->ctx = zstd_init_cctx(ws->mem, size);
+    else if (kind == YUKIFS_WORKSPACE_UNZSTD)
+        ws->ctx = zstd_init_dctx(ws->mem, size);
+
+    if (!ws->ctx) {
+        kvfree(ws);
+        return NULL;
+    }
+
+    return ws;
+}
+
+// an idle workspace of kind, a new one while there are fewer than CPUs, otherwise wait for one to come back,
+// so readers and writeback run their codecs side by side instead of one at a time
+static struct yukifs_workspace *yukifs_workspace_get(struct super_block *sb, enum yukifs_workspace_kind kind)
+{
+    struct yukifs_workspace_pool *pool = &YUKIFS_FS(sb)->workspaces[kind];
+    struct yukifs_workspace *ws;
+
+    for (;;) {
+        spin_lock(&pool->lock);
+        ws = list_first_entry_or_null(&pool->idle, struct yukifs_workspace, list);
+        if (ws) {
+            list_del(&ws->list);
+            spin_unlock(&pool->lock);
+            return ws;
+        }
+
+        bool grow = pool->count < num_online_cpus();
+        if (grow)
+            pool->count++;
+        spin_unlock(&pool->lock);
+
+        if (grow) {
+            ws = yukifs_workspace_alloc(kind);
+            if (ws)
+                return ws;
+
+            // short on memory, make do with the ones there are unless nobody holds any
+            spin_lock(&pool->lock);
+            bool none = --pool->count == 0;
+            spin_unlock(&pool->lock);
+            if (none)
+                return NULL;
+        }
+
+        wait_event(pool->wait, !list_empty_careful(&pool->idle));
+    }
+}
+
+static void yukifs_workspace_put(struct super_block *sb, enum yukifs_workspace_kind kind, struct yukifs_workspace *ws)
+{
+    struct yukifs_workspace_pool *pool = &YUKIFS_FS(sb)->workspaces[kind];
+
+    spin_lock(&pool->lock);
+    list_add(&ws->list, &pool->idle);
+    spin_unlock(&pool->lock);
+
+    wake_up(&pool->wait);
+}
+
+// compress len bytes of src into dst, the compressed length or 0 when it does not fit in cap or there is no
+// workspace to spare, the caller stores the data as it is then
+static size_t yukifs_compress_run(struct super_block *sb, uint8_t algorithm, const void *src, size_t len,
+    void *dst, size_t cap)
+{
+    enum yukifs_workspace_kind kind = algorithm == YUKIFS_COMPRESS_ZSTD ? YUKIFS_WORKSPACE_ZSTD : YUKIFS_WORKSPACE_LZ4;
+    struct yukifs_workspace *ws = yukifs_workspace_get(sb, kind);
+    size_t done;
+
+    if (!ws)
+        return 0;
+
+    if (kind == YUKIFS_WORKSPACE_LZ4) {
+        int ret = LZ4_compress_default(src, dst, len, cap, ws->ctx);
+        done = ret > 0 ? ret : 0;
+    } else {
+        zstd_parameters params = yukifs_zstd_params();
+        size_t ret = zstd_compress_cctx(ws->ctx, dst, cap, src, len, &params);
+        done = zstd_is_error(ret) ? 0 : ret;
+    }
+
+    yukifs_workspace_put(sb, kind, ws);
+    return done;
+}
+
+// decompress len bytes of src into exactly raw_len bytes at dst, callers may hold the extent map,
+// so nothing here may recurse into the filesystem
+static int yukifs_decompress(struct super_block *sb, uint8_t algorithm, const void *src, size_t len,
+    void *dst, size_t raw_len)
+{
+    struct yukifs_workspace *ws;
+
+    if (algorithm == YUKIFS_COMPRESS_LZ4)
+        return LZ4_decompress_safe(src, dst, len, raw_len) == raw_len ? 0 : -EUCLEAN;
+
+    ws = yukifs_workspace_get(sb, YUKIFS_WORKSPACE_UNZSTD);
+    if (!ws)
+        return -ENOMEM;
+
+    size_t done = zstd_decompress_dctx(ws->ctx, dst, raw_len, src, len);
+    yukifs_workspace_put(sb, YUKIFS_WORKSPACE_UNZSTD, ws);
+
+    return zstd_is_error(done) || done != raw_len ? -EUCLEAN : 0;
+}
+
+void yukifs_compress_init(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+
+    // a folio never spans two clusters, so each one is filled from a single cluster
+    BUILD_BUG_ON(PAGE_SIZE > YUKIFS_COMPRESS_CLUSTER_SIZE);
+
+    for (int kind = 0; kind < YUKIFS_WORKSPACE_KINDS; kind++) {
+        spin_lock_init(&fsi->workspaces[kind].lock);
+        INIT_LIST_HEAD(&fsi->workspaces[kind].idle);
+        fsi->workspaces[kind].count = 0;
+        init_waitqueue_head(&fsi->workspaces[kind].wait);
+    }
+}
+
+// drop the pooled workspaces on put_super, every one of them is idle by then
+void yukifs_compress_release(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct yukifs_workspace *ws, *next;
+
+    for (int kind = 0; kind < YUKIFS_WORKSPACE_KINDS; kind++) {
+        list_for_each_entry_safe(ws, next, &fsi->workspaces[kind].idle, list) {
+            list_del(&ws->list);
+            kvfree(ws);
+        }
+        fsi->workspaces[kind].count = 0;
+    }
+}
+
+#pragma endregion
+
+#pragma region Cluster Reads
+
+// a cluster worth of buffers, kept across the clusters one call goes through
+struct yukifs_cluster_buf
+{
+    uint32_t cluster; // the cluster data holds decompressed, U32_MAX for none
+    char *data; // YUKIFS_COMPRESS_CLUSTER_SIZE bytes of file data
+    char *packed; // the cluster as it is on the disk
+    struct yukifs_extent *runs; // writeback only, the new runs of the cluster being written
+    struct buffer_head **bhs; // writeback only, one per block of the cluster
+};
+
+static void yukifs_cluster_buf_free(struct yukifs_cluster_buf *buf)
+{
+    kvfree(buf->data);
+    kvfree(buf->packed);
+    kfree(buf->runs);
+    kfree(buf->bhs);
+    memset(buf, 0, sizeof(*buf));
+    buf->cluster = U32_MAX;
+}
+
+static int yukifs_cluster_buf_alloc(struct super_block *sb, struct yukifs_cluster_buf *buf, bool write)
+{
+    uint32_t blocks = yukifs_cluster_blocks(sb);
+
+    buf->data = kvmalloc(YUKIFS_COMPRESS_CLUSTER_SIZE, GFP_NOFS);
+    buf->packed = kvmalloc(YUKIFS_COMPRESS_CLUSTER_SIZE, GFP_NOFS);
+    if (write) {
+        buf->runs = kmalloc_array(blocks, sizeof(struct yukifs_extent), GFP_NOFS);
+        buf->bhs = kmalloc_array(blocks, sizeof(struct buffer_head *), GFP_NOFS);
+    }
+
+    if (!buf->data || !buf->packed || (write && (!buf->runs || !buf->bhs))) {
+        yukifs_cluster_buf_free(buf);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+// device block behind lblk of a compressed cluster, ext keeps the extent last found
+static int yukifs_cluster_block(struct inode *inode, uint32_t lblk, struct yukifs_extent *ext, sector_t *block)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+
+    if (lblk < ext->logical_block || lblk >= ext->logical_block + ext->length) {
+        int ret = yukifs_extent_lookup(sb, fo, lblk, ext);
+        if (ret == -ENOENT || (!ret && !(ext->flags & YUKIFS_EXTENT_COMPRESSED))) {
+            printk(KERN_ERR "YukiFS: Compressed cluster of %s is not mapped at block %u\n", fo->name, lblk);
+            ret = -EUCLEAN;
+        }
+        if (ret) {
+            ext->length = 0;
+            return ret;
+        }
+    }
+
+    *block = yukifs_data_block_nr(sb, ext->physical_block + (lblk - ext->logical_block));
+    return 0;
+}
+
+// decompress cluster into buf->data, 1 when the cluster is not compressed and its blocks are read as they are,
+// callers hold the extent map
+static int yukifs_cluster_read(struct inode *inode, uint32_t cluster, struct yukifs_cluster_buf *buf)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    uint32_t blocks = yukifs_cluster_blocks(sb);
+    uint32_t lblk = cluster * blocks;
+    struct yukifs_compress_header *hdr;
+    struct yukifs_extent ext;
+    struct buffer_head *bh;
+    sector_t block;
+    int ret;
+
+    if (buf->cluster == cluster)
+        return 0;
+
+    ret = yukifs_extent_lookup(sb, fo, lblk, &ext);
+    if (ret == -ENOENT || (!ret && !(ext.flags & YUKIFS_EXTENT_COMPRESSED)))
+        return 1;
+    if (ret)
+        return ret;
+
+    if (!buf->data) {
+        ret = yukifs_cluster_buf_alloc(sb, buf, false);
+        if (ret)
+            return ret;
+    }
+    buf->cluster = U32_MAX;
+
+    // the header says how many blocks follow
+    yukifs_cluster_block(inode, lblk, &ext, &block);
+    bh = sb_bread(sb, block);
+    if (!bh)
+        return -EIO;
+
+    hdr = (struct yukifs_compress_header *)bh->b_data;
+    uint32_t count = DIV_ROUND_UP(sizeof(*hdr) + (size_t)hdr->length, sb->s_blocksize);
+    if (hdr->magic != YUKIFS_COMPRESS_MAGIC ||
+        (hdr->algorithm != YUKIFS_COMPRESS_LZ4 && hdr->algorithm != YUKIFS_COMPRESS_ZSTD) ||
+        hdr->raw_length > YUKIFS_COMPRESS_CLUSTER_SIZE || count >= blocks) {
+        printk(KERN_ERR "YukiFS: Bad compressed cluster %u in %s\n", cluster, fo->name);
+        brelse(bh);
+        return -EUCLEAN;
+    }
+    memcpy(buf->packed, bh->b_data, sb->s_blocksize);
+    brelse(bh);
+
+    // start the rest before waiting on any of it
+    for (uint32_t i = 1; i < count; i++) {
+        ret = yukifs_cluster_block(inode, lblk + i, &ext, &block);
+        if (ret)
+            return ret;
+        sb_breadahead(sb, block);
+    }
+
+    for (uint32_t i = 1; i < count; i++) {
+        ret = yukifs_cluster_block(inode, lblk + i, &ext, &block);
+        if (ret)
+            return ret;
+
+        bh = sb_bread(sb, block);
+        if (!bh)
+            return -EIO;
+        memcpy(buf->packed + i * sb->s_blocksize, bh->b_data, sb->s_blocksize);
+        brelse(bh);
+    }
+
+    hdr = (struct yukifs_compress_header *)buf->packed;
+    ret = yukifs_decompress(sb, hdr->algorithm, hdr + 1, hdr->length, buf->data, hdr->raw_length);
+    if (ret) {
+        printk(KERN_ERR "YukiFS: Error decompressing cluster %u of %s: %d\n", cluster, fo->name, ret);
+        return ret;
+    }
+    memset(buf->data + hdr->raw_length, 0, YUKIFS_COMPRESS_CLUSTER_SIZE - hdr->raw_length);
+
+    buf->cluster = cluster;
+    return 0;
+}
+
+// fill folio from the cluster holding it, 1 when that cluster is not compressed, callers hold the extent map
+static int yukifs_cluster_fill_folio(struct inode *inode, struct folio *folio, struct yukifs_cluster_buf *buf)
+{
+    loff_t size = i_size_read(inode);
+    loff_t pos = folio_pos(folio);
+    size_t len = folio_size(folio);
+    int ret;
+
+    if (pos >= size) {
+        folio_zero_segment(folio, 0, len);
+        return 0;
+    }
+
+    ret = yukifs_cluster_read(inode, pos >> YUKIFS_COMPRESS_CLUSTER_SHIFT, buf);
+    if (ret)
+        return ret;
+
+    char *kaddr = kmap_local_folio(folio, 0);
+    memcpy(kaddr, buf->data + (pos & (YUKIFS_COMPRESS_CLUSTER_SIZE - 1)), len);
+    kunmap_local(kaddr);
+
+    // a truncate may not have rewritten the cluster yet
+    if (size - pos < len)
+        folio_zero_segment(folio, size - pos, len);
+
+    return 0;
+}
+
+// read one folio, clusters stored as they are go through mpage like any other file
+static int yukifs_compress_read_one(struct inode *inode, struct folio *folio, struct yukifs_cluster_buf *buf)
+{
+    struct rw_semaphore *extent_sem = &YUKIFS_I(inode)->extent_sem;
+    int ret;
+
+    down_read(extent_sem);
+    ret = yukifs_cluster_fill_folio(inode, folio, buf);
+    up_read(extent_sem);
+
+    if (ret > 0)
+        return mpage_read_folio(folio, yukifs_get_block);
+
+    if (!ret)
+        folio_mark_uptodate(folio);
+    folio_unlock(folio);
+
+    return ret;
+}
+
+// read_folio of a compressed file
+int yukifs_compress_read_folio(struct inode *inode, struct folio *folio)
+{
+    struct yukifs_cluster_buf buf = { .cluster = U32_MAX };
+
+    int ret = yukifs_compress_read_one(inode, folio, &buf);
+    yukifs_cluster_buf_free(&buf);
+
+    return ret;
+}
+
+// the folios of a cluster come one after the other, so it is decompressed once for all of them
+void yukifs_compress_readahead(struct readahead_control *rac)
+{
+    struct inode *inode = rac->mapping->host;
+    struct yukifs_cluster_buf buf = { .cluster = U32_MAX };
+    struct folio *folio;
+
+    // a folio that fails is left to read_folio to retry and report
+    while ((folio = readahead_folio(rac)))
+        yukifs_compress_read_one(inode, folio, &buf);
+
+    yukifs_cluster_buf_free(&buf);
+}
+
+#pragma endregion
+
+#pragma region Cluster Writes
+
+// what writeback compresses clusters with, the compress= mount option or LZ4 for files made compressed by chattr
+static inline uint8_t yukifs_compress_writeback_algorithm(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+
+    return fsi->compress ? fsi->compress : YUKIFS_COMPRESS_LZ4;
+}
+
+// put count blocks of src on new blocks near goal, into buf->runs, each written through the buffer cache
+// and waited on, so they are on the disk before the handle mapping them stops, callers hold a handle with
+// credits for YUKIFS_JOURNAL_CLUSTER_RUNS runs
+static int yukifs_cluster_put(struct super_block *sb, struct yukifs_cluster_buf *buf, const char *src,
+    uint32_t lblk, uint32_t count, uint16_t flags, uint32_t goal, uint32_t *runs)
+{
+    uint32_t written = 0;
+    int ret = 0;
+
+    *runs = 0;
+    for (uint32_t done = 0; done < count; ) {
+        uint32_t n = count - done;
+        uint32_t block;
+
+        // the last run the handle has credits for takes the rest in one piece
+        if (*runs == YUKIFS_JOURNAL_CLUSTER_RUNS - 1)
+            ret = yukifs_new_blocks_whole(sb, goal, &block, n);
+        else
+            ret = yukifs_new_blocks(sb, goal, &block, &n);
+        if (ret)
+            break;
+
+        buf->runs[*runs].logical_block = lblk + done;
+        buf->runs[*runs].physical_block = block;
+        buf->runs[*runs].length = n;
+        buf->runs[*runs].flags = flags;
+        (*runs)++;
+
+        for (uint32_t i = 0; i < n; i++) {
+            struct buffer_head *bh = sb_getblk(sb, yukifs_data_block_nr(sb, block + i));
+            if (!bh) {
+                ret = -ENOMEM;
+                break;
+            }
+
+            lock_buffer(bh);
+            memcpy(bh->b_data, src + (size_t)(done + i) * sb->s_blocksize, sb->s_blocksize);
+            set_buffer_uptodate(bh);
+            unlock_buffer(bh);
+            mark_buffer_dirty(bh);
+            write_dirty_buffer(bh, REQ_SYNC);
+            buf->bhs[written++] = bh;
+        }
+        if (ret)
+            break;
+
+        done += n;
+        goal = block + n;
+    }
+
+    for (uint32_t i = 0; i < written; i++) {
+        wait_on_buffer(buf->bhs[i]);
+        if (!ret && !buffer_uptodate(buf->bhs[i]))
+            ret = -EIO;
+        brelse(buf->bhs[i]);
+    }
+
+    if (ret) {
+        for (uint32_t r = 0; r < *runs; r++)
+            yukifs_free_blocks(sb, buf->runs[r].physical_block, buf->runs[r].length);
+        *runs = 0;
+    }
+
+    return ret;
+}
+
+// write cluster back from the page cache, compressed with algorithm when that saves a block and as it is
+// otherwise or when algorithm is 0, the folios not cached are read in from the old cluster, the new blocks
+// are written before the handle that maps them stops and the old ones go in that same handle, nobody gets
+// them before it is committed, so a crash finds one cluster or the other, callers hold compress_mutex
+static int yukifs_cluster_write(struct inode *inode, uint32_t cluster, uint8_t algorithm,
+    struct yukifs_cluster_buf *buf, struct writeback_control *wbc)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    struct address_space *mapping = inode->i_mapping;
+    struct folio *folios[YUKIFS_COMPRESS_CLUSTER_SIZE / PAGE_SIZE];
+    bool writeback[YUKIFS_COMPRESS_CLUSTER_SIZE / PAGE_SIZE];
+    uint32_t blocks = yukifs_cluster_blocks(sb);
+    uint32_t lblk = cluster * blocks;
+    loff_t start = (loff_t)cluster << YUKIFS_COMPRESS_CLUSTER_SHIFT;
+    loff_t size = i_size_read(inode);
+    unsigned int nr = 0;
+    uint32_t runs = 0;
+    int ret = 0;
+
+    if (start >= size)
+        return 0;
+
+    size_t raw_len = min_t(loff_t, size - start, YUKIFS_COMPRESS_CLUSTER_SIZE);
+    buf->cluster = U32_MAX;
+
+    while (nr < DIV_ROUND_UP(raw_len, PAGE_SIZE)) {
+        struct folio *folio = read_mapping_folio(mapping, (start >> PAGE_SHIFT) + nr, NULL);
+        if (IS_ERR(folio)) {
+            ret = PTR_ERR(folio);
+            goto out;
+        }
+
+        folio_lock(folio);
+        // truncated under us, whatever is read back in place of it holds zeros
+        if (folio->mapping != mapping) {
+            folio_unlock(folio);
+            folio_put(folio);
+            continue;
+        }
+
+        folio_wait_writeback(folio);
+        writeback[nr] = folio_clear_dirty_for_io(folio);
+        if (writeback[nr]) {
+            folio_start_writeback(folio);
+            if (wbc)
+                wbc->nr_to_write -= folio_nr_pages(folio);
+        }
+
+        // a later write redirties the folio and has the cluster written again
+        char *kaddr = kmap_local_folio(folio, 0);
+        memcpy(buf->data + nr * PAGE_SIZE, kaddr, min_t(size_t, PAGE_SIZE, raw_len - nr * PAGE_SIZE));
+        kunmap_local(kaddr);
+
+        folio_unlock(folio);
+        folios[nr++] = folio;
+    }
+
+    struct yukifs_compress_header *hdr = (struct yukifs_compress_header *)buf->packed;
+    uint32_t count = DIV_ROUND_UP(raw_len, sb->s_blocksize);
+    uint16_t flags = 0;
+    size_t used = raw_len;
+    char *src = buf->data;
+
+    // a cluster has to save at least a block to be stored compressed
+    if (algorithm && count > 1) {
+        size_t cap = (count - 1) * sb->s_blocksize - sizeof(*hdr);
+        size_t len = yukifs_compress_run(sb, algorithm, buf->data, raw_len, hdr + 1, cap);
+
+        if (len) {
+            memset(hdr, 0, sizeof(*hdr));
+            hdr->magic = YUKIFS_COMPRESS_MAGIC;
+            hdr->algorithm = algorithm;
+            hdr->length = len;
+            hdr->raw_length = raw_len;
+
+            used = sizeof(*hdr) + len;
+            count = DIV_ROUND_UP(used, sb->s_blocksize);
+            flags = YUKIFS_EXTENT_COMPRESSED;
+            src = buf->packed;
+        }
+    }
+    memset(src + used, 0, (size_t)count * sb->s_blocksize - used);
+
+    // the handle pays for the new runs and for whatever the old cluster gives back, only writers holding
+    // compress_mutex map blocks in the cluster, so the old one stays as it is counted until it goes
+    uint32_t credits;
+    down_read(&YUKIFS_I(inode)->extent_sem);
+    ret = yukifs_extent_punch_credits(sb, fo, lblk, lblk + blocks, &credits);
+    up_read(&YUKIFS_I(inode)->extent_sem);
+    if (ret)
+        goto out;
+
+    credits += YUKIFS_JOURNAL_CLUSTER_CREDITS;
+    if (credits > yukifs_journal_max_credits(sb)) {
+        printk(KERN_ERR "YukiFS: cluster %u of %s is spread over too many blocks to replace in one transaction\n",
+            cluster, fo->name);
+        ret = -ENOSPC;
+        goto out;
+    }
+
+    // whatever is left of the old cluster goes below, none of it is left to convert
+    yukifs_unwritten_forget(inode, lblk, lblk + blocks - 1);
+
+    struct yukifs_handle handle = yukifs_journal_start(sb, credits);
+    struct yukifs_extent ext;
+
+    // the old cluster or the run before it is where the new one should go
+    down_read(&YUKIFS_I(inode)->extent_sem);
+    ret = yukifs_extent_lookup(sb, fo, lblk, &ext);
+    up_read(&YUKIFS_I(inode)->extent_sem);
+    if (!ret || ret == -ENOENT)
+        ret = yukifs_cluster_put(sb, buf, src, lblk, count, flags, ext.physical_block, &runs);
+
+    if (!ret) {
+        uint32_t mapped = 0;
+
+        down_write(&YUKIFS_I(inode)->extent_sem);
+        ret = yukifs_extent_prepare(sb, fo, lblk, 1);
+        if (!ret)
+            ret = yukifs_extent_punch(sb, fo, lblk, lblk + blocks);
+        for (; !ret && mapped < runs; mapped++) {
+            ret = yukifs_extent_prepare(sb, fo, buf->runs[mapped].logical_block, 1);
+            if (!ret)
+                ret = yukifs_extent_insert(sb, fo, &buf->runs[mapped]);
+            if (ret)
+                break;
+        }
+        if (ret) {
+            printk(KERN_ERR "YukiFS: Error mapping cluster %u of %s: %d\n", cluster, fo->name, ret);
+            for (; mapped < runs; mapped++)
+                yukifs_free_blocks(sb, buf->runs[mapped].physical_block, buf->runs[mapped].length);
+        }
+        up_write(&YUKIFS_I(inode)->extent_sem);
+    }
+
+    // the bitmap bits go with the record whether the cluster made it or not
+    int err = yukifs_update_statfs(sb, fo);
+    if (!ret)
+        ret = err;
+    yukifs_journal_stop(sb, handle);
+
+out:
+    if (ret)
+        mapping_set_error(mapping, ret);
+
+    for (unsigned int i = 0; i < nr; i++) {
+        if (writeback[i])
+            folio_end_writeback(folios[i]);
+        folio_put(folios[i]);
+    }
+
+    return ret;
+}
+
+// rewrite clusters first..last - 1 with algorithm, only the compressed ones when compressed_only is set,
+// callers hold the invalidate lock
+static int yukifs_cluster_rewrite(struct inode *inode, uint32_t first, uint32_t last, uint8_t algorithm,
+    bool compressed_only)
+{
+    struct super_block *sb = inode->i_sb;
+    struct yukifs_inode_info *ei = YUKIFS_I(inode);
+    struct yukifs_cluster_buf buf = { .cluster = U32_MAX };
+    int ret;
+
+    mutex_lock(&ei->compress_mutex);
+
+    ret = yukifs_cluster_buf_alloc(sb, &buf, true);
+    for (uint32_t cluster = first; !ret && cluster < last; cluster++) {
+        if (compressed_only) {
+            struct yukifs_extent ext;
+
+            down_read(&ei->extent_sem);
+            ret = yukifs_extent_lookup(sb, (struct file_object *)inode->i_private, cluster * yukifs_cluster_blocks(sb), &ext);
+            up_read(&ei->extent_sem);
+
+            bool compressed = !ret && (ext.flags & YUKIFS_EXTENT_COMPRESSED);
+            if (ret == -ENOENT)
+                ret = 0;
+            if (ret || !compressed)
+                continue;
+        }
+
+        ret = yukifs_cluster_write(inode, cluster, algorithm, &buf, NULL);
+        cond_resched();
+    }
+
+    mutex_unlock(&ei->compress_mutex);
+    yukifs_cluster_buf_free(&buf);
+
+    return ret;
+}
+
+// writepages of a compressed file, each cluster with a dirty folio in it is written back as a whole
+int yukifs_compress_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    struct inode *inode = mapping->host;
+    struct yukifs_inode_info *ei = YUKIFS_I(inode);
+    struct yukifs_cluster_buf buf = { .cluster = U32_MAX };
+    uint8_t algorithm = yukifs_compress_writeback_algorithm(inode->i_sb);
+    xa_mark_t tag = PAGECACHE_TAG_DIRTY;
+    struct folio_batch fbatch;
+    pgoff_t index = 0;
+    pgoff_t end = (pgoff_t)-1;
+    uint32_t last = U32_MAX;
+    bool done = false;
+    int ret;
+
+    if (!wbc->range_cyclic) {
+        index = wbc->range_start >> PAGE_SHIFT;
+        end = wbc->range_end >> PAGE_SHIFT;
+    }
+
+    // integrity writeback only goes after what was dirty when it started
+    if (wbc->sync_mode == WB_SYNC_ALL || wbc->tagged_writepages) {
+        tag = PAGECACHE_TAG_TOWRITE;
+        tag_pages_for_writeback(mapping, index, end);
+    }
+
+    // background writeback comes back later instead of waiting on a rewrite
+    if (wbc->sync_mode == WB_SYNC_NONE) {
+        if (!mutex_trylock(&ei->compress_mutex))
+            return 0;
+    } else {
+        mutex_lock(&ei->compress_mutex);
+    }
+
+    ret = yukifs_cluster_buf_alloc(inode->i_sb, &buf, true);
+
+    folio_batch_init(&fbatch);
+    while (!ret && !done && filemap_get_folios_tag(mapping, &index, end, tag, &fbatch)) {
+        for (unsigned int i = 0; !ret && !done && i < folio_batch_count(&fbatch); i++) {
+            struct folio *folio = fbatch.folios[i];
+            uint32_t cluster = folio_pos(folio) >> YUKIFS_COMPRESS_CLUSTER_SHIFT;
+
+            // nothing past the end of the file is written, the truncate that put it there drops it
+            if (folio_pos(folio) >= i_size_read(inode)) {
+                folio_lock(folio);
+                if (folio->mapping == mapping)
+                    folio_clear_dirty_for_io(folio);
+                folio_unlock(folio);
+                continue;
+            }
+
+            if (cluster == last)
+                continue;
+            last = cluster;
+
+            ret = yukifs_cluster_write(inode, cluster, algorithm, &buf, wbc);
+            done = wbc->sync_mode == WB_SYNC_NONE && wbc->nr_to_write <= 0;
+        }
+
+        folio_batch_release(&fbatch);
+        cond_resched();
+    }
+
+    mutex_unlock(&ei->compress_mutex);
+    yukifs_cluster_buf_free(&buf);
+
+    return ret;
+}
+
+// write_begin of a compressed file, no blocks are mapped here since writeback allocates whole clusters,
+// the folio is read in through its cluster unless the write covers all of it
+int yukifs_compress_write_begin(struct inode *inode, loff_t pos, unsigned len, struct folio **foliop)
+{
+    struct address_space *mapping = inode->i_mapping;
+
+    for (;;) {
+        struct folio *folio = __filemap_get_folio(mapping, pos >> PAGE_SHIFT, FGP_WRITEBEGIN, mapping_gfp_mask(mapping));
+        if (IS_ERR(folio))
+            return PTR_ERR(folio);
+
+        if (folio_test_uptodate(folio) || (offset_in_folio(folio, pos) == 0 && len >= folio_size(folio))) {
+            *foliop = folio;
+            return 0;
+        }
+
+        if (folio_pos(folio) >= i_size_read(inode)) {
+            folio_zero_segment(folio, 0, folio_size(folio));
+            folio_mark_uptodate(folio);
+            *foliop = folio;
+            return 0;
+        }
+
+        // read_folio unlocks it, mpage only once the I/O is done
+        int ret = yukifs_compress_read_folio(inode, folio);
+        if (!ret) {
+            folio_lock(folio);
+            if (folio->mapping != mapping) {
+                folio_unlock(folio);
+                folio_put(folio);
+                continue;
+            }
+            if (folio_test_uptodate(folio)) {
+                *foliop = folio;
+                return 0;
+            }
+            folio_unlock(folio);
+            ret = -EIO;
+        }
+
+        folio_put(folio);
+        return ret;
+    }
+}
+
+// write_end of a compressed file, the folio only has to be dirtied
+int yukifs_compress_write_end(struct inode *inode, struct folio *folio, loff_t pos, unsigned len, unsigned copied)
+{
+    // only a write covering the whole folio gets here with it not uptodate, a short one is retried
+    if (!folio_test_uptodate(folio)) {
+        if (copied < len)
+            copied = 0;
+        else
+            folio_mark_uptodate(folio);
+    }
+
+    if (copied) {
+        if (pos + copied > i_size_read(inode))
+            i_size_write(inode, pos + copied);
+        folio_mark_dirty(folio);
+    }
+
+    folio_unlock(folio);
+    folio_put(folio);
+
+    return copied;
+}
+
+// page_mkwrite of a compressed file, like write_begin nothing is allocated until writeback,
+// callers hold the invalidate lock shared
+vm_fault_t yukifs_compress_page_mkwrite(struct vm_fault *vmf)
+{
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    struct folio *folio = page_folio(vmf->page);
+
+    folio_lock(folio);
+    if (folio->mapping != inode->i_mapping || folio_pos(folio) >= i_size_read(inode)) {
+        folio_unlock(folio);
+        return VM_FAULT_NOPAGE;
+    }
+
+    folio_mark_dirty(folio);
+    folio_wait_stable(folio);
+
+    return VM_FAULT_LOCKED;
+}
+
+// rewrite the cluster a file that shrank to size now ends in, after truncate_setsize, so no data past the end
+// of the file is left in it for a later extension to read back, callers hold the invalidate lock
+int yukifs_compress_truncate(struct inode *inode, loff_t size)
+{
+    if (!(size & (YUKIFS_COMPRESS_CLUSTER_SIZE - 1)))
+        return 0;
+
+    uint32_t cluster = size >> YUKIFS_COMPRESS_CLUSTER_SHIFT;
+    return yukifs_cluster_rewrite(inode, cluster, cluster + 1, yukifs_compress_writeback_algorithm(inode->i_sb), false);
+}
+
+#pragma endregion
+
+#pragma region Compress and Expand
+
+// chattr +c, the file is written back and cut into clusters, each compressed on its own,
+// callers hold the inode lock and the invalidate lock
+int yukifs_compress_inode(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    struct address_space *mapping = inode->i_mapping;
+    int ret;
+
+    if (!S_ISREG(inode->i_mode))
+        return -EINVAL;
+
+    if (yukifs_has_compressed_data(fo))
+        return 0;
+
+    // a write fault would dirty a page behind our back before it is dropped
+    if (mapping_writably_mapped(mapping))
+        return -EBUSY;
+
+    ret = filemap_write_and_wait(mapping);
+    if (!ret)
+        ret = yukifs_unwritten_convert(inode, true);
+    if (ret)
+        return ret;
+
+    // the cached folios carry buffers on the blocks the clusters are about to replace
+    truncate_pagecache(inode, 0);
+
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_INODE_CREDITS);
+    fo->flags |= YUKIFS_INODE_COMPRESSED;
+    ret = yukifs_update_statfs(sb, fo);
+    yukifs_journal_stop(sb, handle);
+    if (ret)
+        return ret;
+
+    // an inline file has no blocks yet, its clusters are compressed once it outgrows the record
+    if (yukifs_has_inline_data(fo))
+        return 0;
+
+    uint32_t clusters = DIV_ROUND_UP(i_size_read(inode), YUKIFS_COMPRESS_CLUSTER_SIZE);
+    return yukifs_cluster_rewrite(inode, 0, clusters, yukifs_compress_writeback_algorithm(sb), false);
+}
+
+// chattr -c, the compressed clusters are rewritten as they are before the file goes back to the block paths,
+// callers hold the inode lock and the invalidate lock
+int yukifs_compress_expand_inode(struct inode *inode)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    struct address_space *mapping = inode->i_mapping;
+    int ret;
+
+    if (!yukifs_has_compressed_data(fo))
+        return 0;
+
+    if (mapping_writably_mapped(mapping))
+        return -EBUSY;
+
+    // nothing dirty may be left for the block paths to find
+    ret = filemap_write_and_wait(mapping);
+    if (!ret && !yukifs_has_inline_data(fo)) {
+        uint32_t clusters = DIV_ROUND_UP(i_size_read(inode), YUKIFS_COMPRESS_CLUSTER_SIZE);
+        ret = yukifs_cluster_rewrite(inode, 0, clusters, 0, true);
+    }
+    if (ret)
+        return ret;
+
+    // reads through mpage may have left buffers on blocks the clusters have since replaced
+    truncate_pagecache(inode, 0);
+
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_INODE_CREDITS);
+    fo->flags &= ~YUKIFS_INODE_COMPRESSED;
+    ret = yukifs_update_statfs(sb, fo);
+    yukifs_journal_stop(sb, handle);
+
+    return ret;
+}
+
+#pragma endregion
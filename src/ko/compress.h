@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: MIT
+#ifndef KO_COMPRESS_H
+#define KO_COMPRESS_H
+
+#include "misc.h"
+#include "extent.h"
+
+#define YUKIFS_COMPRESS_CLUSTER_SIZE (1U << YUKIFS_COMPRESS_CLUSTER_SHIFT)
+#define YUKIFS_ZSTD_LEVEL 3
+
+static inline bool yukifs_has_compressed_data(struct file_object *fo)
+{
+    return fo->flags & YUKIFS_INODE_COMPRESSED;
+}
+
+// blocks of file data in a cluster, mkfs keeps blocks smaller than a cluster
+static inline uint32_t yukifs_cluster_blocks(struct super_block *sb)
+{
+    return YUKIFS_COMPRESS_CLUSTER_SIZE >> sb->s_blocksize_bits;
+}
+
+extern int yukifs_compress_algorithm(const char *name);
+extern const char *yukifs_compress_name(uint8_t algorithm);
+extern void yukifs_compress_init(struct super_block *sb);
+extern void yukifs_compress_release(struct super_block *sb);
+
+extern int yukifs_compress_read_folio(struct inode *inode, struct folio *folio);
+extern void yukifs_compress_readahead(struct readahead_control *rac);
+extern int yukifs_compress_writepages(struct address_space *mapping, struct writeback_control *wbc);
+extern int yukifs_compress_write_begin(struct inode *inode, loff_t pos, unsigned len, struct folio **foliop);
+extern int yukifs_compress_write_end(struct inode *inode, struct folio *folio, loff_t pos, unsigned len, unsigned copied);
+extern vm_fault_t yukifs_compress_page_mkwrite(struct vm_fault *vmf);
+extern int yukifs_compress_truncate(struct inode *inode, loff_t size);
+extern int yukifs_compress_inode(struct inode *inode);
+extern int yukifs_compress_expand_inode(struct inode *inode);
+
+#endif
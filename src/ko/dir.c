@@ -0,0 +1,845 @@
+// SPDX-License-Identifier: MIT
+#include "dir.h"
+
+// a directory has no lock of its own, the VFS holds its i_rwsem exclusively around every change to its
+// entries and blocks and shared around lookup and readdir, which only read them
+
+#pragma region Name Hashing
+
+// FNV-1a, the result is stored on disk so it must not depend on the kernel or the architecture
+static uint32_t yukifs_name_hash(const unsigned char *name, unsigned int len)
+{
+    uint32_t hash = 2166136261u;
+
+    for (unsigned int i = 0; i < len; i++) {
+        hash ^= name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static bool yukifs_name_match(struct yukifs_dirent *de, const struct qstr *name)
+{
+    return de->name_len == name->len && memcmp(de->name, name->name, name->len) == 0;
+}
+
+// index entry whose hash range holds hash, block 0 starts at hash 0 and every node at the hash that leads to it,
+// so there always is one
+static int yukifs_dir_index_search(struct yukifs_dir_index *di, uint32_t hash)
+{
+    int lo = 0;
+    int hi = (int)di->count - 1;
+    int found = 0;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (di->entries[mid].hash <= hash) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+static inline struct yukifs_dirent *yukifs_dirent_first(struct yukifs_dir_leaf *dl)
+{
+    return (struct yukifs_dirent *)dl->entries;
+}
+
+static inline struct yukifs_dirent *yukifs_dirent_next(struct yukifs_dirent *de)
+{
+    return (struct yukifs_dirent *)((unsigned char *)de + de->rec_len);
+}
+
+static inline uint16_t yukifs_dirent_offset(struct yukifs_dir_leaf *dl, struct yukifs_dirent *de)
+{
+    return (unsigned char *)de - dl->entries;
+}
+
+// first dirent of a leaf whose hash is not below hash, *pos comes back as its position in the leaf
+static struct yukifs_dirent *yukifs_dir_leaf_search(struct yukifs_dir_leaf *dl, uint32_t hash, int *pos)
+{
+    struct yukifs_dirent *de = yukifs_dirent_first(dl);
+    int i;
+
+    for (i = 0; i < dl->count && de->hash < hash; i++)
+        de = yukifs_dirent_next(de);
+
+    if (pos)
+        *pos = i;
+    return de;
+}
+
+#pragma endregion
+
+#pragma region Directory Blocks
+
+static inline uint16_t yukifs_dir_leaf_space(struct super_block *sb)
+{
+    return sb->s_blocksize - sizeof(struct yukifs_dir_leaf);
+}
+
+// check the entries of a leaf add up before walking them
+static bool yukifs_dir_leaf_valid(struct super_block *sb, struct yukifs_dir_leaf *dl)
+{
+    struct yukifs_dirent *de = yukifs_dirent_first(dl);
+    uint32_t used = 0;
+
+    if (dl->used > yukifs_dir_leaf_space(sb))
+        return false;
+
+    for (int i = 0; i < dl->count; i++) {
+        if (used + sizeof(struct yukifs_dirent) > dl->used ||
+            de->rec_len < YUKIFS_DIRENT_LEN(de->name_len) || used + de->rec_len > dl->used)
+            return false;
+        used += de->rec_len;
+        de = yukifs_dirent_next(de);
+    }
+
+    return used == dl->used;
+}
+
+static inline uint16_t yukifs_dir_index_max(struct super_block *sb)
+{
+    return (sb->s_blocksize - sizeof(struct yukifs_dir_index)) / sizeof(struct yukifs_dir_index_entry);
+}
+
+// an index block always points somewhere, and never past its own end
+static bool yukifs_dir_index_valid(struct super_block *sb, struct yukifs_dir_index *di)
+{
+    return di->count && di->count <= di->max && di->max <= yukifs_dir_index_max(sb) &&
+        di->levels <= YUKIFS_DIR_MAX_LEVELS;
+}
+
+static struct buffer_head *yukifs_dir_block_read(struct super_block *sb, struct file_object *dir_fo, uint32_t lblk, uint32_t magic)
+{
+    struct yukifs_extent ext;
+    struct buffer_head *bh;
+    int ret;
+
+    ret = yukifs_extent_lookup(sb, dir_fo, lblk, &ext);
+    if (ret == -ENOENT) {
+        printk(KERN_ERR "YukiFS: directory %s has no block %u\n", dir_fo->name, lblk);
+        return ERR_PTR(-EUCLEAN);
+    }
+    if (ret)
+        return ERR_PTR(ret);
+
+    bh = sb_bread(sb, yukifs_data_block_nr(sb, ext.physical_block + (lblk - ext.logical_block)));
+    if (!bh) {
+        printk(KERN_ERR "YukiFS: Error reading block %u of directory %s\n", lblk, dir_fo->name);
+        return ERR_PTR(-EIO);
+    }
+
+    // both the index and the leaves start with their magic
+    if (*(uint32_t *)bh->b_data != magic) {
+        printk(KERN_ERR "YukiFS: bad magic in block %u of directory %s\n", lblk, dir_fo->name);
+        brelse(bh);
+        return ERR_PTR(-EUCLEAN);
+    }
+
+    // once per read from the disk, blocks we changed since carry a checksum we computed ourselves
+    if (!buffer_yuki_verified(bh)) {
+        if (((struct yukifs_dir_leaf *)bh->b_data)->checksum != yukifs_dir_block_csum(bh->b_data, sb->s_blocksize)) {
+            printk(KERN_ERR "YukiFS: checksum mismatch in block %u of directory %s\n", lblk, dir_fo->name);
+            brelse(bh);
+            return ERR_PTR(-EUCLEAN);
+        }
+        set_buffer_yuki_verified(bh);
+    }
+
+    if (magic != YUKIFS_DIR_LEAF_MAGIC && !yukifs_dir_index_valid(sb, (struct yukifs_dir_index *)bh->b_data)) {
+        printk(KERN_ERR "YukiFS: corrupt index in block %u of directory %s\n", lblk, dir_fo->name);
+        brelse(bh);
+        return ERR_PTR(-EUCLEAN);
+    }
+
+    if (magic == YUKIFS_DIR_LEAF_MAGIC && !yukifs_dir_leaf_valid(sb, (struct yukifs_dir_leaf *)bh->b_data)) {
+        printk(KERN_ERR "YukiFS: corrupt entries in block %u of directory %s\n", lblk, dir_fo->name);
+        brelse(bh);
+        return ERR_PTR(-EUCLEAN);
+    }
+
+    return bh;
+}
+
+// queue reads for leaves first..first+count of the index in one plug, the walk finds them in the buffer cache
+// by the time it gets there, a leaf that cannot be mapped is left for yukifs_dir_block_read to report
+static void yukifs_dir_readahead(struct super_block *sb, struct file_object *dir_fo, struct yukifs_dir_index *di,
+    uint32_t first, uint32_t count)
+{
+    uint32_t end = min_t(uint32_t, di->count, first + count);
+    struct yukifs_extent ext;
+    struct blk_plug plug;
+
+    blk_start_plug(&plug);
+    for (uint32_t i = first; i < end; i++) {
+        uint32_t lblk = di->entries[i].block;
+
+        if (yukifs_extent_lookup(sb, dir_fo, lblk, &ext))
+            break;
+        sb_breadahead(sb, yukifs_data_block_nr(sb, ext.physical_block + (lblk - ext.logical_block)));
+    }
+    blk_finish_plug(&plug);
+}
+
+// callers are done changing the block, the journal logs it with the checksum taken here
+static void yukifs_dir_block_write(struct super_block *sb, struct buffer_head *bh)
+{
+    ((struct yukifs_dir_leaf *)bh->b_data)->checksum = yukifs_dir_block_csum(bh->b_data, sb->s_blocksize);
+    set_buffer_yuki_verified(bh);
+    yukifs_journal_dirty(sb, bh);
+}
+
+// grow the directory by one zeroed block, the caller persists the directory record
+static int yukifs_dir_block_new(struct inode *dir, uint32_t *lblk, struct buffer_head **bhp)
+{
+    struct super_block *sb = dir->i_sb;
+    struct file_object *dir_fo = (struct file_object *)dir->i_private;
+    struct yukifs_extent ext;
+    struct buffer_head *bh;
+    uint32_t block;
+    int ret;
+
+    *lblk = dir_fo->size / sb->s_blocksize;
+
+    ret = yukifs_extent_lookup(sb, dir_fo, *lblk, &ext);
+    if (ret != -ENOENT)
+        return ret ? ret : -EUCLEAN;
+
+    ret = yukifs_extent_prepare(sb, dir_fo, *lblk, 1);
+    if (ret)
+        return ret;
+
+    ret = yukifs_new_block(sb, ext.physical_block, &block);
+    if (ret)
+        return ret;
+
+    bh = sb_getblk(sb, yukifs_data_block_nr(sb, block));
+    if (!bh) {
+        printk(KERN_ERR "YukiFS: Error getting directory block %u\n", block);
+        yukifs_free_blocks(sb, block, 1);
+        return -EIO;
+    }
+
+    ext.logical_block = *lblk;
+    ext.physical_block = block;
+    ext.length = 1;
+    ext.flags = 0;
+    ret = yukifs_extent_insert(sb, dir_fo, &ext);
+    if (ret) {
+        bforget(bh);
+        yukifs_free_blocks(sb, block, 1);
+        return ret;
+    }
+
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    dir_fo->size += sb->s_blocksize;
+    i_size_write(dir, dir_fo->size);
+    yukifs_inode_mark_dirty(sb, dir_fo);
+
+    *bhp = bh;
+    return 0;
+}
+
+// grow the directory by one empty leaf, the caller persists the directory record
+static int yukifs_dir_leaf_new(struct inode *dir, uint32_t *lblk, struct buffer_head **bhp)
+{
+    int ret = yukifs_dir_block_new(dir, lblk, bhp);
+    if (ret)
+        return ret;
+
+    ((struct yukifs_dir_leaf *)(*bhp)->b_data)->magic = YUKIFS_DIR_LEAF_MAGIC;
+    return 0;
+}
+
+// grow the directory by one empty index block, block 0 or a node below it
+static int yukifs_dir_index_new(struct inode *dir, uint32_t magic, uint32_t *lblk, struct buffer_head **bhp)
+{
+    int ret = yukifs_dir_block_new(dir, lblk, bhp);
+    if (ret)
+        return ret;
+
+    struct yukifs_dir_index *di = (struct yukifs_dir_index *)(*bhp)->b_data;
+    di->magic = magic;
+    di->max = yukifs_dir_index_max(dir->i_sb);
+    return 0;
+}
+
+// the index blocks from block 0 down to the one pointing at a leaf, and the entry taken in each of them
+struct yukifs_dir_path
+{
+    int levels; // nodes below block 0
+    struct buffer_head *bh[YUKIFS_DIR_MAX_LEVELS + 1];
+    int index[YUKIFS_DIR_MAX_LEVELS + 1];
+};
+
+static void yukifs_dir_path_release(struct yukifs_dir_path *path)
+{
+    for (int l = 0; l <= path->levels; l++)
+        brelse(path->bh[l]);
+}
+
+static inline struct yukifs_dir_index *yukifs_dir_path_index(struct yukifs_dir_path *path, int level)
+{
+    return (struct yukifs_dir_index *)path->bh[level]->b_data;
+}
+
+// logical block of the leaf the path ends at
+static inline uint32_t yukifs_dir_path_leaf(struct yukifs_dir_path *path)
+{
+    return yukifs_dir_path_index(path, path->levels)->entries[path->index[path->levels]].block;
+}
+
+// read the index blocks down to the leaf whose hash range holds hash
+static int yukifs_dir_path_get(struct inode *dir, uint32_t hash, struct yukifs_dir_path *path)
+{
+    struct super_block *sb = dir->i_sb;
+    struct file_object *dir_fo = (struct file_object *)dir->i_private;
+    struct buffer_head *bh;
+
+    memset(path, 0, sizeof(*path));
+
+    bh = yukifs_dir_block_read(sb, dir_fo, YUKIFS_DIR_INDEX_BLOCK, YUKIFS_DIR_INDEX_MAGIC);
+    if (IS_ERR(bh))
+        return PTR_ERR(bh);
+    path->bh[0] = bh;
+    path->levels = ((struct yukifs_dir_index *)bh->b_data)->levels;
+
+    for (int l = 0; ; l++) {
+        struct yukifs_dir_index *di = yukifs_dir_path_index(path, l);
+
+        path->index[l] = yukifs_dir_index_search(di, hash);
+        if (l == path->levels)
+            return 0;
+
+        bh = yukifs_dir_block_read(sb, dir_fo, di->entries[path->index[l]].block, YUKIFS_DIR_NODE_MAGIC);
+        if (IS_ERR(bh)) {
+            yukifs_dir_path_release(path);
+            return PTR_ERR(bh);
+        }
+        path->bh[l + 1] = bh;
+    }
+}
+
+// move the path on to the next leaf in hash order, 1 when it already was at the last one
+static int yukifs_dir_path_next(struct inode *dir, struct yukifs_dir_path *path)
+{
+    struct super_block *sb = dir->i_sb;
+    struct file_object *dir_fo = (struct file_object *)dir->i_private;
+    int l = path->levels;
+
+    // climb to the lowest block with an entry right of the path, and come down the left edge below it
+    while (l >= 0 && path->index[l] + 1 >= yukifs_dir_path_index(path, l)->count)
+        l--;
+    if (l < 0)
+        return 1;
+
+    path->index[l]++;
+    for (; l < path->levels; l++) {
+        struct yukifs_dir_index *di = yukifs_dir_path_index(path, l);
+        struct buffer_head *bh = yukifs_dir_block_read(sb, dir_fo, di->entries[path->index[l]].block, YUKIFS_DIR_NODE_MAGIC);
+        if (IS_ERR(bh))
+            return PTR_ERR(bh);
+
+        brelse(path->bh[l + 1]);
+        path->bh[l + 1] = bh;
+        path->index[l + 1] = 0;
+    }
+
+    return 0;
+}
+
+// 1 when inserting one more entry at the end of the path would need more levels than the index may have
+static bool yukifs_dir_path_full(struct yukifs_dir_path *path)
+{
+    for (int l = path->levels; l >= 0; l--) {
+        if (yukifs_dir_path_index(path, l)->count < yukifs_dir_path_index(path, l)->max)
+            return false;
+    }
+
+    return path->levels >= YUKIFS_DIR_MAX_LEVELS;
+}
+
+// put hash and block right after the entry the path takes at level, a full node is split in half and the
+// upper half goes up a level as a new entry, a full block 0 moves its entries to a new node and points at it,
+// the path is left pointing at the new entry
+static int yukifs_dir_index_insert(struct inode *dir, struct yukifs_dir_path *path, int level, uint32_t hash, uint32_t block)
+{
+    struct super_block *sb = dir->i_sb;
+    struct yukifs_dir_index *di = yukifs_dir_path_index(path, level);
+    struct buffer_head *nbh;
+    uint32_t lblk;
+    int ret;
+
+    if (di->count >= di->max && level == 0) {
+        ret = yukifs_dir_index_new(dir, YUKIFS_DIR_NODE_MAGIC, &lblk, &nbh);
+        if (ret)
+            return ret;
+
+        struct yukifs_dir_index *ndi = (struct yukifs_dir_index *)nbh->b_data;
+        memcpy(ndi->entries, di->entries, di->count * sizeof(struct yukifs_dir_index_entry));
+        ndi->count = di->count;
+        yukifs_dir_block_write(sb, nbh);
+
+        memset(di->entries, 0, di->count * sizeof(struct yukifs_dir_index_entry));
+        di->entries[0].hash = 0;
+        di->entries[0].block = lblk;
+        di->count = 1;
+        di->levels++;
+        yukifs_dir_block_write(sb, path->bh[0]);
+
+        // the new node takes the place of block 0 in the path and is split below
+        memmove(&path->bh[2], &path->bh[1], path->levels * sizeof(path->bh[0]));
+        memmove(&path->index[2], &path->index[1], path->levels * sizeof(path->index[0]));
+        path->bh[1] = nbh;
+        path->index[1] = path->index[0];
+        path->index[0] = 0;
+        path->levels++;
+        level = 1;
+        di = ndi;
+    }
+
+    if (di->count >= di->max) {
+        uint16_t half = di->count / 2;
+
+        ret = yukifs_dir_index_new(dir, YUKIFS_DIR_NODE_MAGIC, &lblk, &nbh);
+        if (ret)
+            return ret;
+
+        struct yukifs_dir_index *ndi = (struct yukifs_dir_index *)nbh->b_data;
+        ndi->count = di->count - half;
+        memcpy(ndi->entries, &di->entries[half], ndi->count * sizeof(struct yukifs_dir_index_entry));
+        memset(&di->entries[half], 0, ndi->count * sizeof(struct yukifs_dir_index_entry));
+        di->count = half;
+
+        int levels = path->levels;
+        ret = yukifs_dir_index_insert(dir, path, level - 1, ndi->entries[0].hash, lblk);
+        if (ret) {
+            // put the node back the way it was, the new one is left empty
+            memcpy(&di->entries[half], ndi->entries, ndi->count * sizeof(struct yukifs_dir_index_entry));
+            di->count += ndi->count;
+            yukifs_dir_block_write(sb, nbh);
+            brelse(nbh);
+            return ret;
+        }
+        // block 0 may have moved its entries down a level in the meantime
+        level += path->levels - levels;
+        yukifs_dir_block_write(sb, path->bh[level]);
+        yukifs_dir_block_write(sb, nbh);
+
+        // an entry right after the last one of the lower half stays in it, the upper half keeps its first hash
+        if (path->index[level] >= half) {
+            brelse(path->bh[level]);
+            path->bh[level] = nbh;
+            path->index[level] -= half;
+            di = ndi;
+        } else {
+            brelse(nbh);
+        }
+    }
+
+    int at = path->index[level] + 1;
+    memmove(&di->entries[at + 1], &di->entries[at], (di->count - at) * sizeof(struct yukifs_dir_index_entry));
+    di->entries[at].hash = hash;
+    di->entries[at].block = block;
+    di->count++;
+    path->index[level] = at;
+    yukifs_dir_block_write(sb, path->bh[level]);
+
+    return 0;
+}
+
+// move the upper half of the full leaf the path ends at into a new leaf, names sharing a hash always stay in
+// the same leaf so a lookup only ever reads one, the path is stale afterwards
+static int yukifs_dir_leaf_split(struct inode *dir, struct yukifs_dir_path *path, struct buffer_head *leaf_bh, uint32_t hash)
+{
+    struct yukifs_dir_leaf *dl = (struct yukifs_dir_leaf *)leaf_bh->b_data;
+    struct yukifs_dir_leaf *ndl;
+    struct yukifs_dirent *de;
+    struct yukifs_dirent *split = NULL;
+    struct buffer_head *nbh;
+    uint32_t lblk;
+    int split_pos = 0;
+    int ret;
+
+    if (yukifs_dir_path_full(path)) {
+        printk(KERN_ERR "YukiFS: directory index of %s is full\n", ((struct file_object *)dir->i_private)->name);
+        return -ENOSPC;
+    }
+
+    // split at the first change of hash past the middle byte, or the last one before it
+    de = yukifs_dirent_first(dl);
+    for (int i = 1; i < dl->count; i++) {
+        struct yukifs_dirent *next = yukifs_dirent_next(de);
+
+        if (next->hash != de->hash) {
+            split = next;
+            split_pos = i;
+            if (yukifs_dirent_offset(dl, next) >= dl->used / 2)
+                break;
+        }
+        de = next;
+    }
+    if (!split) {
+        printk(KERN_ERR "YukiFS: too many names in %s share hash %08x\n", ((struct file_object *)dir->i_private)->name, hash);
+        return -ENOSPC;
+    }
+
+    ret = yukifs_dir_leaf_new(dir, &lblk, &nbh);
+    if (ret)
+        return ret;
+
+    // the index points at the new leaf before any name moves, a failure leaves it empty and unreferenced
+    ret = yukifs_dir_index_insert(dir, path, path->levels, split->hash, lblk);
+    if (ret) {
+        yukifs_dir_block_write(dir->i_sb, nbh);
+        brelse(nbh);
+        return ret;
+    }
+
+    uint16_t offset = yukifs_dirent_offset(dl, split);
+    ndl = (struct yukifs_dir_leaf *)nbh->b_data;
+    ndl->count = dl->count - split_pos;
+    ndl->used = dl->used - offset;
+    memcpy(ndl->entries, split, ndl->used);
+    yukifs_dir_block_write(dir->i_sb, nbh);
+
+    memset(split, 0, ndl->used);
+    dl->count = split_pos;
+    dl->used = offset;
+    yukifs_dir_block_write(dir->i_sb, leaf_bh);
+
+    brelse(nbh);
+    return 0;
+}
+
+// read the index blocks and the leaf whose hash range holds hash
+static int yukifs_dir_leaf_get(struct inode *dir, uint32_t hash, struct yukifs_dir_path *path,
+    struct buffer_head **leaf_bhp)
+{
+    struct buffer_head *leaf_bh;
+    int ret;
+
+    ret = yukifs_dir_path_get(dir, hash, path);
+    if (ret)
+        return ret;
+
+    leaf_bh = yukifs_dir_block_read(dir->i_sb, (struct file_object *)dir->i_private, yukifs_dir_path_leaf(path),
+        YUKIFS_DIR_LEAF_MAGIC);
+    if (IS_ERR(leaf_bh)) {
+        yukifs_dir_path_release(path);
+        return PTR_ERR(leaf_bh);
+    }
+
+    *leaf_bhp = leaf_bh;
+    return 0;
+}
+
+#pragma endregion
+
+#pragma region Directory Operations
+
+// lay out the index and the first leaf of a directory that has no blocks yet, the way mkfs.yukifs sets up the root,
+// the caller persists the directory record
+int yukifs_dir_init(struct inode *dir)
+{
+    struct super_block *sb = dir->i_sb;
+    struct yukifs_dir_index *di;
+    struct buffer_head *index_bh;
+    struct buffer_head *leaf_bh;
+    uint32_t lblk;
+    int ret;
+
+    ret = yukifs_dir_index_new(dir, YUKIFS_DIR_INDEX_MAGIC, &lblk, &index_bh);
+    if (ret)
+        return ret;
+
+    ret = yukifs_dir_leaf_new(dir, &lblk, &leaf_bh);
+    if (ret) {
+        bforget(index_bh);
+        return ret;
+    }
+
+    di = (struct yukifs_dir_index *)index_bh->b_data;
+    di->count = 1;
+    di->entries[0].hash = 0;
+    di->entries[0].block = lblk;
+    yukifs_dir_block_write(sb, index_bh);
+    yukifs_dir_block_write(sb, leaf_bh);
+
+    brelse(leaf_bh);
+    brelse(index_bh);
+    return 0;
+}
+
+// 1 when no leaf of dir holds a name, rmdir refuses anything else
+int yukifs_dir_empty(struct inode *dir)
+{
+    struct super_block *sb = dir->i_sb;
+    struct file_object *dir_fo = (struct file_object *)dir->i_private;
+    struct yukifs_dir_path path;
+    int ret;
+
+    ret = yukifs_dir_path_get(dir, 0, &path);
+    if (ret)
+        return ret;
+
+    for (;;) {
+        struct buffer_head *leaf_bh = yukifs_dir_block_read(sb, dir_fo, yukifs_dir_path_leaf(&path), YUKIFS_DIR_LEAF_MAGIC);
+        if (IS_ERR(leaf_bh)) {
+            ret = PTR_ERR(leaf_bh);
+            break;
+        }
+
+        uint16_t count = ((struct yukifs_dir_leaf *)leaf_bh->b_data)->count;
+        brelse(leaf_bh);
+        if (count) {
+            ret = 0;
+            break;
+        }
+
+        // 1 once the last leaf turned out empty as well
+        ret = yukifs_dir_path_next(dir, &path);
+        if (ret)
+            break;
+    }
+
+    yukifs_dir_path_release(&path);
+    return ret;
+}
+
+// look name up in dir, -ENOENT when it is not there
+int yukifs_dir_find(struct inode *dir, const struct qstr *name, uint32_t *ino)
+{
+    uint32_t hash = yukifs_name_hash(name->name, name->len);
+    struct yukifs_dir_path path;
+    struct buffer_head *leaf_bh;
+    struct yukifs_dir_leaf *dl;
+    struct yukifs_dirent *de;
+    int ret;
+    int i;
+
+    lockdep_assert_held(&dir->i_rwsem);
+
+    ret = yukifs_dir_leaf_get(dir, hash, &path, &leaf_bh);
+    if (ret)
+        return ret;
+    yukifs_dir_path_release(&path);
+
+    ret = -ENOENT;
+    dl = (struct yukifs_dir_leaf *)leaf_bh->b_data;
+    for (de = yukifs_dir_leaf_search(dl, hash, &i); i < dl->count && de->hash == hash; i++, de = yukifs_dirent_next(de)) {
+        if (yukifs_name_match(de, name)) {
+            *ino = de->inode;
+            ret = 0;
+            break;
+        }
+    }
+
+    brelse(leaf_bh);
+    return ret;
+}
+
+int yukifs_dir_add(struct inode *dir, const struct qstr *name, uint32_t ino, umode_t mode)
+{
+    uint32_t hash = yukifs_name_hash(name->name, name->len);
+    uint16_t rec_len = YUKIFS_DIRENT_LEN(name->len);
+    struct yukifs_dir_path path;
+    struct buffer_head *leaf_bh;
+    struct yukifs_dir_leaf *dl;
+    struct yukifs_dirent *de;
+    int ret;
+
+    lockdep_assert_held_write(&dir->i_rwsem);
+
+    if (name->len > YUKIFS_NAME_LEN)
+        return -ENAMETOOLONG;
+
+    // one split may not free enough room next to long names, each one starts over from block 0, a second one
+    // always does unless the names left share a hash, YUKIFS_JOURNAL_DIR_CREDITS pays for no more than two
+    for (int splits = 0; ; splits++) {
+        ret = yukifs_dir_leaf_get(dir, hash, &path, &leaf_bh);
+        if (ret)
+            return ret;
+
+        dl = (struct yukifs_dir_leaf *)leaf_bh->b_data;
+        if (dl->used + rec_len <= yukifs_dir_leaf_space(dir->i_sb))
+            break;
+
+        if (splits == 2) {
+            printk(KERN_ERR "YukiFS: too many names in %s share hash %08x\n", ((struct file_object *)dir->i_private)->name, hash);
+            ret = -ENOSPC;
+        } else {
+            ret = yukifs_dir_leaf_split(dir, &path, leaf_bh, hash);
+        }
+        brelse(leaf_bh);
+        yukifs_dir_path_release(&path);
+        if (ret)
+            return ret;
+    }
+
+    // after the names already sharing its hash, so their readdir positions stay what they were
+    int i;
+    de = yukifs_dir_leaf_search(dl, hash, &i);
+    for (; i < dl->count && de->hash == hash; i++)
+        de = yukifs_dirent_next(de);
+    uint16_t offset = yukifs_dirent_offset(dl, de);
+    memmove((unsigned char *)de + rec_len, de, dl->used - offset);
+    memset(de, 0, rec_len);
+    de->inode = ino;
+    de->hash = hash;
+    de->rec_len = rec_len;
+    de->name_len = name->len;
+    de->file_type = fs_umode_to_dtype(mode);
+    memcpy(de->name, name->name, name->len);
+    dl->count++;
+    dl->used += rec_len;
+    yukifs_dir_block_write(dir->i_sb, leaf_bh);
+
+    brelse(leaf_bh);
+    yukifs_dir_path_release(&path);
+    return 0;
+}
+
+// drop the entry of name pointing at ino, leaves emptied this way are kept for later names
+int yukifs_dir_remove(struct inode *dir, const struct qstr *name, uint32_t ino)
+{
+    uint32_t hash = yukifs_name_hash(name->name, name->len);
+    struct yukifs_dir_path path;
+    struct buffer_head *leaf_bh;
+    struct yukifs_dir_leaf *dl;
+    struct yukifs_dirent *de;
+    int ret;
+    int i;
+
+    lockdep_assert_held_write(&dir->i_rwsem);
+
+    ret = yukifs_dir_leaf_get(dir, hash, &path, &leaf_bh);
+    if (ret)
+        return ret;
+    yukifs_dir_path_release(&path);
+
+    ret = -ENOENT;
+    dl = (struct yukifs_dir_leaf *)leaf_bh->b_data;
+    for (de = yukifs_dir_leaf_search(dl, hash, &i); i < dl->count && de->hash == hash; i++, de = yukifs_dirent_next(de)) {
+        if (de->inode != ino || !yukifs_name_match(de, name))
+            continue;
+
+        uint16_t rec_len = de->rec_len;
+        uint16_t end = yukifs_dirent_offset(dl, de) + rec_len;
+        memmove(de, (unsigned char *)de + rec_len, dl->used - end);
+        dl->count--;
+        dl->used -= rec_len;
+        memset(dl->entries + dl->used, 0, rec_len);
+        yukifs_dir_block_write(dir->i_sb, leaf_bh);
+        ret = 0;
+        break;
+    }
+
+    brelse(leaf_bh);
+    return ret;
+}
+
+// readdir position of the seq-th name with hash
+static inline loff_t yukifs_dir_pos(uint32_t hash, uint32_t seq)
+{
+    return YUKIFS_DIR_POS_FIRST + (((loff_t)hash << YUKIFS_DIR_POS_SEQ_BITS) | seq);
+}
+
+// walk the names in hash order from ctx->pos on, the position of a name is its hash and its order among the
+// names sharing that hash, so it stays put while other names come and go, names added with a hash already
+// there go after the others, see yukifs_dir_add
+int yukifs_dir_emit(struct inode *dir, struct dir_context *ctx)
+{
+    struct super_block *sb = dir->i_sb;
+    struct file_object *dir_fo = (struct file_object *)dir->i_private;
+    struct yukifs_dir_path path;
+    int ret;
+
+    // a leaf of the largest blocks holds no more names than the position has room to tell apart
+    BUILD_BUG_ON((MAXIMUM_BLOCK_SIZE - sizeof(struct yukifs_dir_leaf)) / YUKIFS_DIRENT_LEN(1) >
+        (1 << YUKIFS_DIR_POS_SEQ_BITS));
+
+    if (ctx->pos >= YUKIFS_DIR_POS_END)
+        return 0;
+
+    uint32_t hash = (ctx->pos - YUKIFS_DIR_POS_FIRST) >> YUKIFS_DIR_POS_SEQ_BITS;
+    uint32_t skip = (ctx->pos - YUKIFS_DIR_POS_FIRST) & ((1 << YUKIFS_DIR_POS_SEQ_BITS) - 1);
+
+    ret = yukifs_dir_path_get(dir, hash, &path);
+    if (ret)
+        return ret;
+
+    sector_t ra_block = 0;
+    uint32_t ra_next = 0;
+    uint32_t ra_window = YUKIFS_DIR_RA_MIN;
+
+    while (!ret) {
+        struct yukifs_dir_index *di = yukifs_dir_path_index(&path, path.levels);
+        uint32_t i = path.index[path.levels];
+        struct buffer_head *leaf_bh;
+        struct yukifs_dir_leaf *dl;
+
+        // keep the next window of leaves in flight once the walk is halfway through the current one,
+        // windows end with the index block they come from
+        if (path.bh[path.levels]->b_blocknr != ra_block) {
+            ra_block = path.bh[path.levels]->b_blocknr;
+            ra_next = i;
+        }
+        if (ra_next < di->count && i + ra_window / 2 >= ra_next) {
+            yukifs_dir_readahead(sb, dir_fo, di, ra_next, ra_window);
+            ra_next += ra_window;
+            ra_window = min_t(uint32_t, ra_window * 2, YUKIFS_DIR_RA_MAX);
+        }
+
+        leaf_bh = yukifs_dir_block_read(sb, dir_fo, di->entries[i].block, YUKIFS_DIR_LEAF_MAGIC);
+        if (IS_ERR(leaf_bh)) {
+            ret = PTR_ERR(leaf_bh);
+            break;
+        }
+
+        // names and types come from the entries, the inode table is never read,
+        // a name removed before the one the last call stopped at has the rest of its hash move up by one
+        dl = (struct yukifs_dir_leaf *)leaf_bh->b_data;
+        int j;
+        struct yukifs_dirent *de = yukifs_dir_leaf_search(dl, hash, &j);
+        uint32_t seq = 0;
+        for (; j < dl->count && de->hash == hash && seq < skip; j++, seq++)
+            de = yukifs_dirent_next(de);
+
+        for (; j < dl->count; j++, de = yukifs_dirent_next(de)) {
+            seq = de->hash == hash ? seq : 0;
+            hash = de->hash;
+            ctx->pos = yukifs_dir_pos(hash, seq++);
+            if (!dir_emit(ctx, de->name, de->name_len, yukifs_ino(de->inode), de->file_type)) {
+                brelse(leaf_bh);
+                yukifs_dir_path_release(&path);
+                return 0;
+            }
+        }
+        brelse(leaf_bh);
+
+        // the next leaf starts at a hash no name here has
+        hash = 0;
+        skip = 0;
+        ret = yukifs_dir_path_next(dir, &path);
+    }
+
+    yukifs_dir_path_release(&path);
+    if (ret < 0)
+        return ret;
+
+    ctx->pos = YUKIFS_DIR_POS_END;
+    return 0;
+}
+
+#pragma endregion
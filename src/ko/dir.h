@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: MIT
+#ifndef KO_DIR_H
+#define KO_DIR_H
+
+#include "misc.h"
+#include "extent.h"
+
+#define YUKIFS_DIR_POS_FIRST 2 // readdir positions start here, dir_emit_dots takes 0 and 1
+#define YUKIFS_DIR_POS_SEQ_BITS 9 // low bits of a readdir position, the order of a name among those sharing its hash,
+                                  // which all sit in one leaf of at most 511 names
+#define YUKIFS_DIR_POS_END (YUKIFS_DIR_POS_FIRST + (1LL << (32 + YUKIFS_DIR_POS_SEQ_BITS))) // readdir position past the last name
+#define YUKIFS_DIR_RA_MIN 4 // leaves readdir reads ahead at first
+#define YUKIFS_DIR_RA_MAX 32 // the window doubles up to this many leaves while the walk goes on
+
+extern int yukifs_dir_init(struct inode *dir);
+extern int yukifs_dir_empty(struct inode *dir);
+extern int yukifs_dir_find(struct inode *dir, const struct qstr *name, uint32_t *ino);
+extern int yukifs_dir_add(struct inode *dir, const struct qstr *name, uint32_t ino, umode_t mode);
+extern int yukifs_dir_remove(struct inode *dir, const struct qstr *name, uint32_t ino);
+extern int yukifs_dir_emit(struct inode *dir, struct dir_context *ctx);
+
+#endif
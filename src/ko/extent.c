@@ -0,0 +1,816 @@
+// SPDX-License-Identifier: MIT
+#include "extent.h"
+
+#pragma region Extent Array Helpers
+
+static inline uint32_t yukifs_extent_end(const struct yukifs_extent *ext)
+{
+    return ext->logical_block + ext->length;
+}
+
+static inline uint16_t yukifs_extents_per_block(struct super_block *sb)
+{
+    return (sb->s_blocksize - sizeof(struct yukifs_extent_block)) / sizeof(struct yukifs_extent);
+}
+
+static bool yukifs_extent_mergeable(const struct yukifs_extent *a, const struct yukifs_extent *b)
+{
+    return a->flags == b->flags &&
+        yukifs_extent_end(a) == b->logical_block &&
+        a->physical_block + a->length == b->physical_block &&
+        a->length + b->length <= YUKIFS_EXTENT_MAX_LEN;
+}
+
+// find the extent that covers or precedes lblk in a sorted array, -1 when lblk comes before all of them
+static int yukifs_extent_search(const struct yukifs_extent *exts, uint16_t count, uint32_t lblk)
+{
+    int lo = 0;
+    int hi = (int)count - 1;
+    int found = -1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (exts[mid].logical_block <= lblk) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+// resolve lblk against a sorted array, when it is a hole describe the hole instead:
+// physical_block is where an allocation should aim and length runs up to the next mapped block
+static int yukifs_extent_resolve(const struct yukifs_extent *exts, uint16_t count, uint32_t lblk,
+    uint32_t limit, uint32_t goal, struct yukifs_extent *ext)
+{
+    int i = yukifs_extent_search(exts, count, lblk);
+
+    if (i >= 0 && lblk < yukifs_extent_end(&exts[i])) {
+        *ext = exts[i];
+        return 0;
+    }
+
+    if (i + 1 < count)
+        limit = exts[i + 1].logical_block;
+
+    ext->logical_block = lblk;
+    ext->physical_block = i >= 0 ? exts[i].physical_block + (lblk - exts[i].logical_block) : goal;
+    ext->length = min_t(uint32_t, limit - lblk, YUKIFS_EXTENT_MAX_LEN);
+    ext->flags = 0;
+
+    return -ENOENT;
+}
+
+static int yukifs_extent_array_insert(struct yukifs_extent *exts, uint16_t *count, uint16_t max,
+    const struct yukifs_extent *ext)
+{
+    int i = yukifs_extent_search(exts, *count, ext->logical_block);
+
+    // appending to the previous run is the common case for sequential writes
+    if (i >= 0 && yukifs_extent_mergeable(&exts[i], ext)) {
+        exts[i].length += ext->length;
+
+        // the grown run may now touch the next one
+        if (i + 1 < *count && yukifs_extent_mergeable(&exts[i], &exts[i + 1])) {
+            exts[i].length += exts[i + 1].length;
+            memmove(&exts[i + 1], &exts[i + 2], (*count - i - 2) * sizeof(struct yukifs_extent));
+            (*count)--;
+            memset(&exts[*count], 0, sizeof(struct yukifs_extent));
+        }
+        return 0;
+    }
+
+    if (i + 1 < *count && yukifs_extent_mergeable(ext, &exts[i + 1])) {
+        exts[i + 1].logical_block = ext->logical_block;
+        exts[i + 1].physical_block = ext->physical_block;
+        exts[i + 1].length += ext->length;
+        return 0;
+    }
+
+    if (*count >= max)
+        return -ENOSPC;
+
+    memmove(&exts[i + 2], &exts[i + 1], (*count - i - 1) * sizeof(struct yukifs_extent));
+    exts[i + 1] = *ext;
+    (*count)++;
+
+    return 0;
+}
+
+// fold exts[i + 1] into exts[i] when they continue each other
+static void yukifs_extent_array_merge_next(struct yukifs_extent *exts, uint16_t *count, int i)
+{
+    if (i < 0 || i + 1 >= *count || !yukifs_extent_mergeable(&exts[i], &exts[i + 1]))
+        return;
+
+    exts[i].length += exts[i + 1].length;
+    memmove(&exts[i + 1], &exts[i + 2], (*count - i - 2) * sizeof(struct yukifs_extent));
+    (*count)--;
+    memset(&exts[*count], 0, sizeof(struct yukifs_extent));
+}
+
+// give lblk..lblk+*len the flags, splitting the extent holding lblk around the range,
+// *len is clipped to that extent, at most two more entries are needed
+static int yukifs_extent_array_set_flags(struct yukifs_extent *exts, uint16_t *count, uint16_t max,
+    uint32_t lblk, uint32_t *len, uint16_t flags)
+{
+    struct yukifs_extent pieces[3];
+    struct yukifs_extent old;
+    int n = 0;
+    int i = yukifs_extent_search(exts, *count, lblk);
+
+    if (i < 0 || lblk >= yukifs_extent_end(&exts[i]))
+        return -ENOENT;
+
+    old = exts[i];
+    *len = min_t(uint32_t, *len, yukifs_extent_end(&old) - lblk);
+    if (old.flags == flags)
+        return 0;
+
+    uint32_t end = lblk + *len;
+    if (lblk > old.logical_block) {
+        pieces[n] = old;
+        pieces[n++].length = lblk - old.logical_block;
+    }
+    int mid = i + n;
+    pieces[n].logical_block = lblk;
+    pieces[n].physical_block = old.physical_block + (lblk - old.logical_block);
+    pieces[n].length = *len;
+    pieces[n++].flags = flags;
+    if (end < yukifs_extent_end(&old)) {
+        pieces[n].logical_block = end;
+        pieces[n].physical_block = old.physical_block + (end - old.logical_block);
+        pieces[n].length = yukifs_extent_end(&old) - end;
+        pieces[n++].flags = old.flags;
+    }
+
+    if (*count + n - 1 > max)
+        return -ENOSPC;
+
+    memmove(&exts[i + n], &exts[i + 1], (*count - i - 1) * sizeof(struct yukifs_extent));
+    memcpy(&exts[i], pieces, n * sizeof(struct yukifs_extent));
+    *count += n - 1;
+
+    // the changed run may now continue its neighbours
+    yukifs_extent_array_merge_next(exts, count, mid);
+    yukifs_extent_array_merge_next(exts, count, mid - 1);
+
+    return 0;
+}
+
+// bitmap blocks holding the bits of count data blocks from block
+static inline uint32_t yukifs_bitmap_span(struct super_block *sb, uint32_t block, uint32_t count)
+{
+    uint32_t bits = sb->s_blocksize * 8;
+
+    return (block + count - 1) / bits - block / bits + 1;
+}
+
+// drop mappings at or beyond from, last one first, and give the blocks behind them back to the allocator,
+// stops once the blocks freed have touched *budget bitmap blocks, whatever is left past from is the caller's
+static void yukifs_extent_array_trim(struct super_block *sb, struct yukifs_extent *exts, uint16_t *count,
+    uint32_t from, uint32_t *budget)
+{
+    while (*count > 0 && *budget > 0) {
+        struct yukifs_extent *last = &exts[*count - 1];
+
+        if (yukifs_extent_end(last) <= from)
+            break;
+
+        uint32_t start = max(last->logical_block, from);
+        uint32_t len = yukifs_extent_end(last) - start;
+        uint32_t span = yukifs_bitmap_span(sb, last->physical_block + (start - last->logical_block), len);
+
+        // free the tail the budget still covers
+        if (span > *budget) {
+            len = max(1U, (*budget - 1) * sb->s_blocksize * 8);
+            start = yukifs_extent_end(last) - len;
+            span = *budget;
+        }
+
+        yukifs_free_blocks(sb, last->physical_block + (start - last->logical_block), len);
+        *budget -= span;
+
+        if (start == last->logical_block) {
+            memset(last, 0, sizeof(struct yukifs_extent));
+            (*count)--;
+        } else {
+            last->length = start - last->logical_block;
+        }
+    }
+}
+
+// whether exts still maps anything at or beyond from
+static inline bool yukifs_extent_array_past(const struct yukifs_extent *exts, uint16_t count, uint32_t from)
+{
+    return count > 0 && yukifs_extent_end(&exts[count - 1]) > from;
+}
+
+// drop the mappings in first..end - 1 and free the blocks behind them, an extent reaching past both ends
+// is split in two, which takes one more entry, 1 when exts changed
+static int yukifs_extent_array_punch(struct super_block *sb, struct yukifs_extent *exts, uint16_t *count, uint16_t max,
+    uint32_t first, uint32_t end)
+{
+    int i = max(yukifs_extent_search(exts, *count, first), 0);
+    bool changed = false;
+
+    if (i < *count && yukifs_extent_end(&exts[i]) <= first)
+        i++;
+
+    // the extent holding first keeps what lies before it
+    if (i < *count && exts[i].logical_block < first) {
+        struct yukifs_extent *ext = &exts[i];
+        uint32_t cut = first - ext->logical_block;
+
+        if (yukifs_extent_end(ext) > end) {
+            if (*count >= max)
+                return -ENOSPC;
+
+            struct yukifs_extent tail = *ext;
+            tail.logical_block = end;
+            tail.physical_block += end - ext->logical_block;
+            tail.length = yukifs_extent_end(ext) - end;
+
+            yukifs_free_blocks(sb, ext->physical_block + cut, end - first);
+            ext->length = cut;
+
+            memmove(&exts[i + 2], &exts[i + 1], (*count - i - 1) * sizeof(struct yukifs_extent));
+            exts[i + 1] = tail;
+            (*count)++;
+            return 1;
+        }
+
+        yukifs_free_blocks(sb, ext->physical_block + cut, ext->length - cut);
+        ext->length = cut;
+        changed = true;
+        i++;
+    }
+
+    int drop = i;
+    while (drop < *count && yukifs_extent_end(&exts[drop]) <= end) {
+        yukifs_free_blocks(sb, exts[drop].physical_block, exts[drop].length);
+        drop++;
+    }
+
+    // and the one holding end - 1 what lies after it
+    if (drop < *count && exts[drop].logical_block < end) {
+        struct yukifs_extent *ext = &exts[drop];
+        uint32_t cut = end - ext->logical_block;
+
+        yukifs_free_blocks(sb, ext->physical_block, cut);
+        ext->logical_block = end;
+        ext->physical_block += cut;
+        ext->length -= cut;
+        changed = true;
+    }
+
+    memmove(&exts[i], &exts[drop], (*count - drop) * sizeof(struct yukifs_extent));
+    memset(&exts[*count - (drop - i)], 0, (drop - i) * sizeof(struct yukifs_extent));
+    *count -= drop - i;
+
+    return changed || drop > i;
+}
+
+// bitmap blocks freeing the mappings of exts in first..end - 1 touches, *last is the bitmap block counted
+// last, which the next piece does not count again
+static uint32_t yukifs_extent_array_punch_span(struct super_block *sb, const struct yukifs_extent *exts, uint16_t count,
+    uint32_t first, uint32_t end, uint32_t *last)
+{
+    uint32_t bits = sb->s_blocksize * 8;
+    uint32_t span = 0;
+
+    for (int i = max(yukifs_extent_search(exts, count, first), 0); i < count && exts[i].logical_block < end; i++) {
+        uint32_t start = max(exts[i].logical_block, first);
+        uint32_t stop = min(yukifs_extent_end(&exts[i]), end);
+
+        if (stop <= start)
+            continue;
+
+        uint32_t from = (exts[i].physical_block + (start - exts[i].logical_block)) / bits;
+        uint32_t to = (exts[i].physical_block + (stop - 1 - exts[i].logical_block)) / bits;
+        span += to - from + 1 - (from == *last);
+        *last = to;
+    }
+
+    return span;
+}
+
+#pragma endregion
+
+#pragma region Extent Tree Blocks
+
+static struct buffer_head *yukifs_extent_block_read(struct super_block *sb, uint32_t block)
+{
+    struct buffer_head *bh = sb_bread(sb, yukifs_data_block_nr(sb, block));
+    if (!bh) {
+        printk(KERN_ERR "YukiFS: Error reading extent block %u\n", block);
+        return ERR_PTR(-EIO);
+    }
+
+    if (((struct yukifs_extent_block *)bh->b_data)->magic != YUKIFS_EXTENT_MAGIC) {
+        printk(KERN_ERR "YukiFS: Bad magic in extent block %u\n", block);
+        brelse(bh);
+        return ERR_PTR(-EUCLEAN);
+    }
+
+    return bh;
+}
+
+static void yukifs_extent_block_write(struct super_block *sb, struct buffer_head *bh)
+{
+    // logged with the rest of the operation, see yukifs_journal_commit
+    yukifs_journal_dirty(sb, bh);
+}
+
+static int yukifs_extent_block_new(struct super_block *sb, uint32_t goal,
+    uint32_t *block, struct buffer_head **bhp)
+{
+    struct yukifs_extent_block *eb;
+    struct buffer_head *bh;
+    int ret;
+
+    ret = yukifs_new_block(sb, goal, block);
+    if (ret)
+        return ret;
+
+    bh = sb_getblk(sb, yukifs_data_block_nr(sb, *block));
+    if (!bh) {
+        printk(KERN_ERR "YukiFS: Error getting extent block %u\n", *block);
+        yukifs_free_blocks(sb, *block, 1);
+        return -EIO;
+    }
+
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    eb = (struct yukifs_extent_block *)bh->b_data;
+    eb->magic = YUKIFS_EXTENT_MAGIC;
+    eb->max = yukifs_extents_per_block(sb);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    *bhp = bh;
+    return 0;
+}
+
+// the tree blocks on the way from the record down to the leaf whose range holds a block, level 0 is the record,
+// level fo->extent_depth the leaf and bh[level - 1] the block holding level
+struct yukifs_extent_path
+{
+    struct buffer_head *bh[YUKIFS_EXTENT_MAX_DEPTH];
+    int index[YUKIFS_EXTENT_MAX_DEPTH]; // entry followed down out of each level above the leaf
+    uint32_t limit; // first block past the range of the leaf
+};
+
+// the entries at level of path, along with where their count is kept and how many fit
+static struct yukifs_extent *yukifs_extent_level(struct super_block *sb, struct file_object *fo,
+    struct yukifs_extent_path *path, int level, uint16_t **count, uint16_t *max)
+{
+    struct yukifs_extent_block *eb;
+
+    if (level == 0) {
+        *count = &fo->extent_count;
+        *max = YUKIFS_INLINE_EXTENTS;
+        return fo->extents;
+    }
+
+    eb = (struct yukifs_extent_block *)path->bh[level - 1]->b_data;
+    *count = &eb->count;
+    *max = yukifs_extents_per_block(sb);
+    return eb->extents;
+}
+
+static void yukifs_extent_path_release(struct yukifs_extent_path *path)
+{
+    for (int i = 0; i < YUKIFS_EXTENT_MAX_DEPTH; i++) {
+        brelse(path->bh[i]);
+        path->bh[i] = NULL;
+    }
+}
+
+static inline int yukifs_extent_depth_check(struct file_object *fo)
+{
+    if (fo->extent_depth <= YUKIFS_EXTENT_MAX_DEPTH)
+        return 0;
+
+    printk(KERN_ERR "YukiFS: extent tree of %s is %u levels deep\n", fo->name, fo->extent_depth);
+    return -EUCLEAN;
+}
+
+// read the tree blocks down to the leaf whose range holds lblk, the first entry of every level starts at block 0,
+// -ENOENT when the way down ends in an index block a truncate step emptied, nothing is mapped below it
+static int yukifs_extent_find(struct super_block *sb, struct file_object *fo, uint32_t lblk, struct yukifs_extent_path *path)
+{
+    int ret = yukifs_extent_depth_check(fo);
+    if (ret)
+        return ret;
+
+    memset(path, 0, sizeof(*path));
+    path->limit = UINT32_MAX;
+
+    for (int level = 0; level < fo->extent_depth; level++) {
+        uint16_t *count, max;
+        struct yukifs_extent *exts = yukifs_extent_level(sb, fo, path, level, &count, &max);
+        struct buffer_head *bh;
+
+        if (*count == 0) {
+            yukifs_extent_path_release(path);
+            return -ENOENT;
+        }
+
+        int i = max(yukifs_extent_search(exts, *count, lblk), 0);
+        path->index[level] = i;
+
+        // each level only narrows the range of the one above
+        if (i + 1 < *count)
+            path->limit = exts[i + 1].logical_block;
+
+        bh = yukifs_extent_block_read(sb, exts[i].physical_block);
+        if (IS_ERR(bh)) {
+            yukifs_extent_path_release(path);
+            return PTR_ERR(bh);
+        }
+        path->bh[level] = bh;
+    }
+
+    return 0;
+}
+
+// move the entries of the record into a new tree block and index that from the record instead,
+// the first time this makes the leaf, after that the tree gets a level deeper
+static int yukifs_extent_grow(struct super_block *sb, struct file_object *fo)
+{
+    struct yukifs_extent *last = &fo->extents[fo->extent_count - 1];
+    struct yukifs_extent_block *eb;
+    struct buffer_head *bh;
+    uint32_t block;
+    int ret;
+
+    if (fo->extent_depth >= YUKIFS_EXTENT_MAX_DEPTH) {
+        printk(KERN_ERR "YukiFS: extent tree of %s is full\n", fo->name);
+        return -ENOSPC;
+    }
+
+    ret = yukifs_extent_block_new(sb, last->physical_block + last->length, &block, &bh);
+    if (ret)
+        return ret;
+
+    eb = (struct yukifs_extent_block *)bh->b_data;
+    memcpy(eb->extents, fo->extents, fo->extent_count * sizeof(struct yukifs_extent));
+    eb->count = fo->extent_count;
+    yukifs_extent_block_write(sb, bh);
+    brelse(bh);
+
+    memset(fo->extents, 0, sizeof(fo->extents));
+    fo->extents[0].logical_block = 0;
+    fo->extents[0].physical_block = block;
+    fo->extent_count = 1;
+    fo->extent_depth++;
+
+    return 0;
+}
+
+// split the full tree block at level of path in half and index the upper half right after it one level up,
+// which the caller has made sure has room for one more entry, append is set when lblk lies past everything
+// the file maps
+static int yukifs_extent_split(struct super_block *sb, struct file_object *fo, struct yukifs_extent_path *path, int level,
+    uint32_t lblk, bool append)
+{
+    struct buffer_head *bh = path->bh[level - 1];
+    struct yukifs_extent_block *eb = (struct yukifs_extent_block *)bh->b_data;
+    struct yukifs_extent_block *neb;
+    struct buffer_head *nbh;
+    int index = path->index[level - 1];
+    uint16_t *parent_count, parent_max;
+    struct yukifs_extent *parent = yukifs_extent_level(sb, fo, path, level - 1, &parent_count, &parent_max);
+    uint16_t keep = eb->count / 2;
+    uint32_t block;
+    int ret;
+
+    // a file written from start to end would leave every block half empty, keep them full instead,
+    // a new leaf starts empty at lblk and a new index block takes just the last entry so it is never empty
+    if (append)
+        keep = level == fo->extent_depth ? eb->count : eb->count - 1;
+
+    ret = yukifs_extent_block_new(sb, parent[index].physical_block + 1, &block, &nbh);
+    if (ret)
+        return ret;
+
+    neb = (struct yukifs_extent_block *)nbh->b_data;
+    neb->count = eb->count - keep;
+    memcpy(neb->extents, &eb->extents[keep], neb->count * sizeof(struct yukifs_extent));
+    yukifs_extent_block_write(sb, nbh);
+
+    memset(&eb->extents[keep], 0, neb->count * sizeof(struct yukifs_extent));
+    eb->count = keep;
+    yukifs_extent_block_write(sb, bh);
+
+    memmove(&parent[index + 2], &parent[index + 1], (*parent_count - index - 1) * sizeof(struct yukifs_extent));
+    memset(&parent[index + 1], 0, sizeof(struct yukifs_extent));
+    parent[index + 1].logical_block = neb->count ? neb->extents[0].logical_block : lblk;
+    parent[index + 1].physical_block = block;
+    (*parent_count)++;
+    if (level > 1)
+        yukifs_extent_block_write(sb, path->bh[level - 2]);
+
+    brelse(nbh);
+    return 0;
+}
+
+// drop the mappings at or beyond from out of the subtree under exts, which sits height levels above the leaves,
+// see yukifs_extent_truncate_step, freeing a tree block takes one of *budget too
+static int yukifs_extent_trim_tree(struct super_block *sb, struct yukifs_extent *exts, uint16_t *count,
+    int height, uint32_t from, uint32_t *budget)
+{
+    if (height == 0) {
+        yukifs_extent_array_trim(sb, exts, count, from, budget);
+        return yukifs_extent_array_past(exts, *count, from);
+    }
+
+    while (*count > 0) {
+        struct yukifs_extent *entry = &exts[*count - 1];
+        struct yukifs_extent_block *eb;
+        struct buffer_head *bh;
+
+        if (!*budget)
+            return 1;
+
+        bh = yukifs_extent_block_read(sb, entry->physical_block);
+        if (IS_ERR(bh))
+            return PTR_ERR(bh);
+
+        eb = (struct yukifs_extent_block *)bh->b_data;
+        int more = yukifs_extent_trim_tree(sb, eb->extents, &eb->count, height - 1, from, budget);
+        if (more < 0) {
+            brelse(bh);
+            return more;
+        }
+
+        // everything a tree block maps starts at or after its index entry
+        bool empty = entry->logical_block >= from && eb->count == 0;
+        if (empty && *budget > 0) {
+            // yukifs_free_blocks drops the buffer from the journal, it may be handed out as file data next
+            brelse(bh);
+            yukifs_free_blocks(sb, entry->physical_block, 1);
+            (*budget)--;
+            memset(entry, 0, sizeof(struct yukifs_extent));
+            (*count)--;
+            continue;
+        }
+
+        // the budget may have run out inside this tree block, or before it could go
+        yukifs_extent_block_write(sb, bh);
+        brelse(bh);
+        return more || empty;
+    }
+
+    return 0;
+}
+
+// drop the mappings in first..end - 1 out of the subtree under exts, which sits height levels above the leaves,
+// only the leaves that change are written, 1 when exts or a block below it changed
+static int yukifs_extent_punch_tree(struct super_block *sb, struct yukifs_extent *exts, uint16_t *count, uint16_t max,
+    int height, uint32_t first, uint32_t end)
+{
+    int changed = 0;
+
+    if (height == 0)
+        return yukifs_extent_array_punch(sb, exts, count, max, first, end);
+
+    for (int i = max(yukifs_extent_search(exts, *count, first), 0); i < *count; i++) {
+        struct yukifs_extent_block *eb;
+        struct buffer_head *bh;
+
+        if (exts[i].logical_block >= end)
+            break;
+
+        bh = yukifs_extent_block_read(sb, exts[i].physical_block);
+        if (IS_ERR(bh))
+            return PTR_ERR(bh);
+
+        eb = (struct yukifs_extent_block *)bh->b_data;
+        int ret = yukifs_extent_punch_tree(sb, eb->extents, &eb->count, yukifs_extents_per_block(sb), height - 1, first, end);
+        // index entries keep their logical blocks, so a block above a changed leaf stays as it is
+        if (ret > 0 && height == 1)
+            yukifs_extent_block_write(sb, bh);
+        brelse(bh);
+        if (ret < 0)
+            return ret;
+        changed |= ret;
+    }
+
+    return changed;
+}
+
+// see yukifs_extent_punch_credits
+static int yukifs_extent_punch_tree_credits(struct super_block *sb, const struct yukifs_extent *exts, uint16_t count,
+    int height, uint32_t first, uint32_t end, uint32_t *last, uint32_t *credits)
+{
+    for (int i = max(yukifs_extent_search(exts, count, first), 0); i < count && exts[i].logical_block < end; i++) {
+        struct yukifs_extent_block *eb;
+        struct buffer_head *bh;
+        int ret = 0;
+
+        bh = yukifs_extent_block_read(sb, exts[i].physical_block);
+        if (IS_ERR(bh))
+            return PTR_ERR(bh);
+
+        eb = (struct yukifs_extent_block *)bh->b_data;
+        if (height > 1) {
+            ret = yukifs_extent_punch_tree_credits(sb, eb->extents, eb->count, height - 1, first, end, last, credits);
+        } else {
+            uint32_t span = yukifs_extent_array_punch_span(sb, eb->extents, eb->count, first, end, last);
+
+            // the leaf itself when anything in it goes
+            if (span)
+                *credits += span + 1;
+        }
+        brelse(bh);
+        if (ret)
+            return ret;
+    }
+
+    return 0;
+}
+
+#pragma endregion
+
+#pragma region Extent Map Operations
+
+// map lblk of the file to the extent holding it, -ENOENT with the hole described in ext when unmapped
+int yukifs_extent_lookup(struct super_block *sb, struct file_object *fo, uint32_t lblk, struct yukifs_extent *ext)
+{
+    struct yukifs_extent_path path;
+    struct yukifs_extent *exts;
+    uint16_t *count, max;
+    int ret;
+
+    ret = yukifs_extent_find(sb, fo, lblk, &path);
+    if (ret == -ENOENT)
+        return yukifs_extent_resolve(NULL, 0, lblk, path.limit, fo->first_block + lblk, ext);
+    if (ret)
+        return ret;
+
+    exts = yukifs_extent_level(sb, fo, &path, fo->extent_depth, &count, &max);
+    ret = yukifs_extent_resolve(exts, *count, lblk, path.limit, fo->first_block + lblk, ext);
+    yukifs_extent_path_release(&path);
+
+    return ret;
+}
+
+// make sure the extent map can take needed more extents around lblk before blocks get allocated or
+// extents split there, needed is 1 for an insert and 2 for yukifs_extent_set_flags, full tree blocks are
+// split from the top down and a full record pushes the tree a level deeper
+int yukifs_extent_prepare(struct super_block *sb, struct file_object *fo, uint32_t lblk, uint16_t needed)
+{
+    struct yukifs_extent_path path;
+    uint16_t *count, max;
+    int ret;
+
+    for (;;) {
+        if (fo->extent_depth == 0) {
+            if (fo->extent_count + needed <= YUKIFS_INLINE_EXTENTS)
+                return 0;
+
+            ret = yukifs_extent_grow(sb, fo);
+            if (ret)
+                return ret;
+            continue;
+        }
+
+        ret = yukifs_extent_find(sb, fo, lblk, &path);
+        if (ret == -ENOENT) {
+            printk(KERN_ERR "YukiFS: block %u of %s lies under an emptied extent index\n", lblk, fo->name);
+            return -EUCLEAN;
+        }
+        if (ret)
+            return ret;
+
+        int level = fo->extent_depth;
+        struct yukifs_extent *exts = yukifs_extent_level(sb, fo, &path, level, &count, &max);
+        if (*count + needed <= max) {
+            yukifs_extent_path_release(&path);
+            return 0;
+        }
+
+        bool append = path.limit == UINT32_MAX && *count > 0 && lblk >= yukifs_extent_end(&exts[*count - 1]);
+
+        // a split adds an entry one level up, so start at the highest level that is full all the way down
+        while (level > 0) {
+            yukifs_extent_level(sb, fo, &path, level - 1, &count, &max);
+            if (*count < max)
+                break;
+            level--;
+        }
+
+        if (level == 0)
+            ret = yukifs_extent_grow(sb, fo);
+        else
+            ret = yukifs_extent_split(sb, fo, &path, level, lblk, append);
+        yukifs_extent_path_release(&path);
+        if (ret)
+            return ret;
+    }
+}
+
+int yukifs_extent_insert(struct super_block *sb, struct file_object *fo, const struct yukifs_extent *ext)
+{
+    struct yukifs_extent_path path;
+    struct yukifs_extent *exts;
+    uint16_t *count, max;
+    int ret;
+
+    ret = yukifs_extent_find(sb, fo, ext->logical_block, &path);
+    if (ret)
+        return ret == -ENOENT ? -EUCLEAN : ret;
+
+    exts = yukifs_extent_level(sb, fo, &path, fo->extent_depth, &count, &max);
+    ret = yukifs_extent_array_insert(exts, count, max, ext);
+    if (!ret && fo->extent_depth > 0)
+        yukifs_extent_block_write(sb, path.bh[fo->extent_depth - 1]);
+    yukifs_extent_path_release(&path);
+
+    return ret;
+}
+
+// change the flags of the mapped range lblk..lblk+*len, *len comes back as the part of it the extent holding
+// lblk covers, call yukifs_extent_prepare with 2 first
+int yukifs_extent_set_flags(struct super_block *sb, struct file_object *fo, uint32_t lblk, uint32_t *len, uint16_t flags)
+{
+    struct yukifs_extent_path path;
+    struct yukifs_extent *exts;
+    uint16_t *count, max;
+    int ret;
+
+    ret = yukifs_extent_find(sb, fo, lblk, &path);
+    if (ret)
+        return ret;
+
+    exts = yukifs_extent_level(sb, fo, &path, fo->extent_depth, &count, &max);
+    ret = yukifs_extent_array_set_flags(exts, count, max, lblk, len, flags);
+    if (!ret && fo->extent_depth > 0)
+        yukifs_extent_block_write(sb, path.bh[fo->extent_depth - 1]);
+    yukifs_extent_path_release(&path);
+
+    return ret;
+}
+
+// unmap and free blocks at or beyond from, from the end of the file down, until the blocks freed have touched
+// budget bitmap blocks, 1 when there is more left to free, tree blocks left empty are freed and dropped from
+// the level above
+int yukifs_extent_truncate_step(struct super_block *sb, struct file_object *fo, uint32_t from, uint32_t budget)
+{
+    int ret = yukifs_extent_depth_check(fo);
+    if (ret)
+        return ret;
+
+    ret = yukifs_extent_trim_tree(sb, fo->extents, &fo->extent_count, fo->extent_depth, from, &budget);
+
+    if (fo->extent_count == 0)
+        fo->extent_depth = 0;
+
+    return ret;
+}
+
+// unmap and free every block at or beyond from in one go, for callers that know the range is short
+int yukifs_extent_truncate(struct super_block *sb, struct file_object *fo, uint32_t from)
+{
+    int ret = yukifs_extent_truncate_step(sb, fo, from, UINT32_MAX);
+
+    return ret < 0 ? ret : 0;
+}
+
+// unmap and free the blocks in first..end - 1, what lies around the range keeps its logical blocks,
+// tree blocks left empty stay indexed, call yukifs_extent_prepare with 1 for first
+int yukifs_extent_punch(struct super_block *sb, struct file_object *fo, uint32_t first, uint32_t end)
+{
+    int ret = yukifs_extent_depth_check(fo);
+    if (ret)
+        return ret;
+
+    ret = yukifs_extent_punch_tree(sb, fo->extents, &fo->extent_count, YUKIFS_INLINE_EXTENTS, fo->extent_depth, first, end);
+    return ret < 0 ? ret : 0;
+}
+
+// blocks besides the record yukifs_extent_punch of first..end - 1 would change, the leaves it writes and the
+// bitmap blocks of what it frees, for the handle it runs under, callers hold the extent map
+int yukifs_extent_punch_credits(struct super_block *sb, struct file_object *fo, uint32_t first, uint32_t end,
+    uint32_t *credits)
+{
+    uint32_t last = UINT32_MAX;
+    int ret = yukifs_extent_depth_check(fo);
+    if (ret)
+        return ret;
+
+    *credits = 0;
+    if (fo->extent_depth == 0) {
+        *credits = yukifs_extent_array_punch_span(sb, fo->extents, fo->extent_count, first, end, &last);
+        return 0;
+    }
+
+    return yukifs_extent_punch_tree_credits(sb, fo->extents, fo->extent_count, fo->extent_depth, first, end, &last, credits);
+}
+
+#pragma endregion
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: MIT
+#ifndef KO_EXTENT_H
+#define KO_EXTENT_H
+
+#include "misc.h"
+#include "alloc.h"
+#include "journal.h"
+
+extern int yukifs_extent_lookup(struct super_block *sb, struct file_object *fo, uint32_t lblk, struct yukifs_extent *ext);
+extern int yukifs_extent_prepare(struct super_block *sb, struct file_object *fo, uint32_t lblk, uint16_t needed);
+extern int yukifs_extent_insert(struct super_block *sb, struct file_object *fo, const struct yukifs_extent *ext);
+extern int yukifs_extent_set_flags(struct super_block *sb, struct file_object *fo, uint32_t lblk, uint32_t *len, uint16_t flags);
+extern int yukifs_extent_truncate_step(struct super_block *sb, struct file_object *fo, uint32_t from, uint32_t budget);
+extern int yukifs_extent_truncate(struct super_block *sb, struct file_object *fo, uint32_t from);
+extern int yukifs_extent_punch(struct super_block *sb, struct file_object *fo, uint32_t first, uint32_t end);
+extern int yukifs_extent_punch_credits(struct super_block *sb, struct file_object *fo, uint32_t first, uint32_t end,
+    uint32_t *credits);
+
+// open a handle for credits blocks and take the extent map of inode for writing, the handle always comes first
+static inline struct yukifs_handle yukifs_extent_write_lock(struct inode *inode, unsigned int credits)
+{
+    struct yukifs_handle handle = yukifs_journal_start(inode->i_sb, credits);
+
+    down_write(&YUKIFS_I(inode)->extent_sem);
+    return handle;
+}
+
+static inline void yukifs_extent_write_unlock(struct inode *inode, struct yukifs_handle handle)
+{
+    up_write(&YUKIFS_I(inode)->extent_sem);
+    yukifs_journal_stop(inode->i_sb, handle);
+}
+
+#endif
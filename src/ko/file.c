@@ -1,323 +1,156 @@
 // SPDX-License-Identifier: MIT
 
 #include "file.h"
+#include "trace.h"
 
 #pragma region File Operations
 
-static int yukifs_update_statfs(struct super_block *sb, struct file_object *fo);
-
-static struct inode *yukifs_make_inode(struct super_block *sb, struct file_object *fo);
+static struct inode *yukifs_iget(struct super_block *sb, uint32_t index);
+static ssize_t yukifs_dio_read(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t yukifs_dio_write(struct kiocb *iocb, struct iov_iter *from);
 
 static int yukifs_open(struct inode *inode, struct file *file)
 {
     struct file_object *fo = (struct file_object *)inode->i_private;
-    printk(KERN_INFO "YukiFS: open called %s %s\n", file->f_path.dentry->d_name.name,fo->name);
+    yukifs_debug("open called %s %s\n", file->f_path.dentry->d_name.name,fo->name);
 
-    printk(KERN_INFO "YukiFS: open called %s size:%d\n", fo->name, fo->size);
+    yukifs_debug("open called %s size:%d\n", fo->name, fo->size);
 
     //Check for O_APPEND flag
     if (file->f_flags & O_APPEND) {
         file->f_pos = i_size_read(inode); // Set file position to the end
-        printk(KERN_INFO "YukiFS: open called with O_APPEND, setting offset to %lld\n", file->f_pos);
+        yukifs_debug("open called with O_APPEND, setting offset to %lld\n", file->f_pos);
     } else {
         file->f_pos = 0; // Otherwise, start from the beginning
     }
 
-    return 0;
-}
-
-static ssize_t yukifs_read(struct file *filp, char __user *buf, size_t len, loff_t *offset)
-{
-    struct inode *inode = filp->f_inode;
-    struct file_object *fo = (struct file_object *)inode->i_private;
-    struct super_block *sb = inode->i_sb;
-    uint32_t block_size = sb->s_blocksize;
-
-    printk(KERN_INFO "YukiFS: read called for inode %lu, offset %lld, len %zu\n",
-           inode->i_ino, *offset, len);
-
-    if (!fo) {
-        printk(KERN_ERR "YukiFS: read - file_object is NULL\n");
-        return -ENOENT;
-    }
-
-    if (*offset > inode->i_size) {
-        printk(KERN_ERR "YukiFS: read - offset exceeds file size\n");
-        return -EINVAL;
-    }
-
-    uint32_t start_block = fo->first_block;
+    // O_DIRECT goes straight to the device through yukifs_iomap_ops
+    file->f_mode |= FMODE_CAN_ODIRECT;
 
-    if(len > inode->i_size - *offset)
-    {
-        len = inode->i_size - *offset;
-    }
-    else
-    {
-        len = 0;
-    }
-
-    uint32_t data_blocks_offset = ((struct superblock_info *)sb->s_fs_info)->data_blocks_offset;
-
-    // For simplicity, assuming single block for now
-    uint32_t physical_block_number = start_block;
-    uint32_t physical_offset = data_blocks_offset + physical_block_number * block_size;
-    uint32_t physical_block_index = physical_offset / block_size;
-    uint32_t offset_in_physical_block = physical_offset % block_size;
-
-    size_t bytes_to_read = len;
-    if (offset_in_physical_block + bytes_to_read > block_size) {
-        bytes_to_read = block_size - offset_in_physical_block;
-        // Need to handle multi-block writes later
-    }
-
-    char *kbuf = kmalloc(bytes_to_read, GFP_KERNEL);
-    if (!kbuf)
-        return -ENOMEM;
-
-    char *block_buf_old = kmalloc(block_size, GFP_KERNEL);
-    if (!block_buf_old) {
-        kfree(kbuf);
-        return -ENOMEM;
-    }
-    
-    // read the block from the physical block
-    if (yukifs_blocks_read(sb, physical_block_index, 1, block_buf_old)) {
-        printk(KERN_ERR "YukiFS: Error reading block %u\n", physical_block_index);
-        kfree(kbuf);
-        return -EIO;
-    }
-
-    // copy the data from the block to the kernel buffer
-    memcpy(kbuf, block_buf_old + *offset, bytes_to_read);
-    
-    printk(KERN_INFO "YukiFS: read - read %zu bytes from block %u\n", bytes_to_read, physical_block_index);
-    printk(KERN_INFO "YukiFS: read data : %s\n", kbuf);
-    kfree(block_buf_old);    
-
-    if (copy_to_user(buf, kbuf, len))
-        return -EFAULT;
-
-    kfree(kbuf);
-
-    *offset += len;
-    return len;
+    return 0;
 }
 
 static int yukifs_iterate_shared(struct file *file, struct dir_context *ctx)
 {
     struct inode *dir = file->f_inode;
-    struct superblock_info *sbi = dir->i_sb->s_fs_info;
     struct file_object * dirobj = (struct file_object *)dir->i_private;
 
-    printk(KERN_INFO "YukiFS: Iterating directory %s\n", dirobj->name);
-    
-    if (ctx->pos >= dirobj->size) // Or however you determine the end of directory entries
-    {
-        return 0;
-    }
-
-    char* inode_table = kmalloc(sbi->inode_table_size, GFP_KERNEL);
-    
-    if (!inode_table) {
-        printk(KERN_ERR "YukiFS: Error allocating inode table\n");
-        return -ENOMEM;
-    }    
-    
-    int inode_table_read = yukifs_inode_table_read(dir->i_sb, inode_table);
-    if(inode_table_read < 0)
-    {
-        kfree(inode_table);
-        return inode_table_read;
-    }
+    yukifs_debug("Iterating directory %s\n", dirobj->name);
+    yukifs_debug("directory i_mode %d\n", dirobj->descriptor);
 
-    struct file_object *fo = dirobj;
-    printk(KERN_INFO "YukiFS: directory i_mode %d\n", fo->descriptor);
-  
-    
-    char *data_block = kmalloc(fo->size, GFP_KERNEL);
-    int data_block_read = yukifs_data_blocks_read(dir->i_sb,fo,data_block);
-    if(data_block_read < 0)
-    {
-        kfree(data_block);
-        kfree(inode_table);
-        return data_block_read;
-    }
+    trace_yukifs_iterate_enter(dir, ctx->pos, 0);
+    int ret = 0;
+    if (dir_emit_dots(file, ctx))
+        ret = yukifs_dir_emit(dir, ctx);
+    trace_yukifs_iterate_exit(dir, ctx->pos, ret);
 
-    printk(KERN_INFO "YukiFS: directory data block %d\n", data_block[0]);
-    
-    // treat data block as inode index list type uint32_t*
-    uint32_t *inode_index_list = (uint32_t *)data_block;
-    uint32_t inode_index_list_size = sbi->block_size / sizeof(uint32_t);
-    
-    for (uint32_t i = ctx->pos / sizeof(uint32_t); i < inode_index_list_size; i++) {
-        if (inode_index_list[i] != 0) 
-        {
-            struct file_object *ffo = (struct file_object *)inode_table + inode_index_list[i];
-
-            printk("  Inode Index (dentry) %d: Name: %s, Size: %u, Descriptor: %o, First Block: %u, Inner: %u\n", i, 
-                strlen(ffo->name) > 0?ffo->name:"<root>", ffo->size, ffo->descriptor, ffo->first_block,
-                ffo->inner_file
-            ); 
-            
-            if(!dir_emit(ctx, ffo->name, strlen(ffo->name), inode_index_list[i] , DT_REG))
-            {
-                 ctx->pos = i * sizeof(uint32_t);
-                 kfree(data_block);
-                 kfree(inode_table);
-                 return 0;
-            }
-        }
-        ctx->pos += sizeof(uint32_t);
-    }
+    return ret;
+}
 
-    kfree(data_block);
-    kfree(inode_table);
-    
-    return 0;
+// readdir positions come from name hashes and reach well past the size of any directory, see yukifs_dir_emit
+static loff_t yukifs_dir_llseek(struct file *file, loff_t offset, int whence)
+{
+    return generic_file_llseek_size(file, offset, whence, YUKIFS_DIR_POS_END, YUKIFS_DIR_POS_END);
 }
 
-static int yukifs_create(struct mnt_idmap *mnt, struct inode *dir,struct dentry *entry, ushort umode_t, bool excl)
+static int __yukifs_create(struct mnt_idmap *mnt, struct inode *dir,struct dentry *entry, ushort umode_t, bool excl)
 {
     mnt=&nop_mnt_idmap;
-    printk(KERN_INFO "YukiFS: create called %s %s %d\n", entry->d_name.name,((struct file_object*)dir->i_private)->name,umode_t);
+    yukifs_debug("create called %s %s %d\n", entry->d_name.name,((struct file_object*)dir->i_private)->name,umode_t);
 
-    struct superblock_info *sbi = dir->i_sb->s_fs_info;
-    struct file_object * dirobj = (struct file_object *)dir->i_private;
+    struct super_block *sb = dir->i_sb;
 
-    // due to no sub directory support, we only support creating files
+    // directories come through yukifs_mkdir, which lays out their index and first leaf
     if (S_ISDIR(umode_t)) {
         return -EPERM;
     }
 
-    char *inode_table = kmalloc(sbi->inode_table_size, GFP_KERNEL);
-    if (!inode_table) {
-        printk(KERN_ERR "YukiFS: Error allocating inode table\n");
-        return -ENOMEM;
-    }
-
-    int inode_table_read = yukifs_inode_table_read(dir->i_sb, inode_table);
-    if(inode_table_read < 0)
-    {
-        kfree(inode_table);
-        return inode_table_read;
+    if (entry->d_name.len > YUKIFS_NAME_LEN) {
+        return -ENAMETOOLONG;
     }
-    
-    struct file_object *fo = dirobj;
-    printk(KERN_INFO "YukiFS: directory i_mode %d\n", fo->descriptor);
-
-    uint32_t data_blocks_offset = sbi->data_blocks_offset;
-    uint32_t dir_data_block_num = fo->first_block;
 
-    // read the data blocks from the device data blocks
-    uint32_t data_block_size = sbi->block_size;
-    uint32_t data_block_count = fo->size / sbi->block_size;
-    uint32_t data_block_offset = data_blocks_offset + dir_data_block_num * data_block_size;
-    uint32_t data_block_nr = data_block_offset / data_block_size;
-
-    
-    char *data_block = kmalloc(fo->size, GFP_KERNEL);
-    if(yukifs_blocks_read(dir->i_sb, data_block_nr, data_block_count, data_block) < 0)
-    {
-        printk(KERN_ERR "YukiFS: Error reading data block %d\n", data_block_nr);
-        kfree(data_block);
-        return -EIO;
-    }
+    // the record, the bitmap bit and the directory entry land in the same transaction
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_CREATE_CREDITS);
 
-    printk(KERN_INFO "YukiFS: directory data block %d\n", data_block[0]);
-    
-    // treat data block as inode index list type uint32_t*
-    uint32_t *inode_index_list = (uint32_t *)data_block;
-    uint32_t inode_index_list_size = data_block_size / sizeof(uint32_t);
-    uint32_t new_inode_index = UINT32_MAX;
-    for (uint32_t i = 0; i < inode_index_list_size; i++) {
-        if (inode_index_list[i] == 0) {
-            new_inode_index = i;
-            break;
-        }
-    }
-    if (new_inode_index == UINT32_MAX) {
-        printk(KERN_ERR "YukiFS: Error creating file, no free inode index\n");
-        
-        return -ENOSPC;
-    }
-    else
-    {
-        printk(KERN_INFO "YukiFS: new logical inode index %d\n", new_inode_index);
-    }
-
-    // read whole inode table from device
-   
-    struct file_object *new_fo = (struct file_object *)inode_table;
-
-    // find the first free inode in the inode table
+    // take a free inode from the inode bitmap, in the allocation group of the directory when it has one
     uint32_t ii = UINT32_MAX;
-    for (uint32_t i = 0; i < sbi->total_inodes; i++) {
-        printk(KERN_INFO "YukiFS: physical inode %d current use status %d\n", i, new_fo[i].in_use);
-        if (new_fo[i].in_use == 0) {
-            new_fo[i].in_use = 1;
-            new_fo[i].size = 0;
-            new_fo[i].inner_file = 0;
-            new_fo[i].descriptor = umode_t;
-            new_fo[i].first_block = i;
-            strncpy(new_fo[i].name, entry->d_name.name, FS_MAX_LEN);
-            ii = i;
-            break;
-        }
-    }
-    if (ii == UINT32_MAX) {
+    if (yukifs_new_inode_nr(sb, yukifs_inode_index(sb, (struct file_object *)dir->i_private), &ii) < 0) {
         printk(KERN_ERR "YukiFS: Error creating file, no free inode\n");
+        yukifs_journal_stop(sb, handle);
         return -ENOSPC;
     }
     else
     {
-        printk(KERN_INFO "YukiFS: new physical inode %d\n", ii);
+        yukifs_debug("new physical inode %d\n", ii);
     }
 
-
-    // write the new inode index to dir data block
-    inode_index_list[new_inode_index] = ii;
-
-    // write dir data block back and inode table back to device
-    if(yukifs_blocks_write(dir->i_sb, data_block_nr, data_block_count, data_block) < 0)
+    struct file_object *new_fo = yukifs_inode_get(sb, ii);
+    memset(new_fo, 0, sizeof(struct file_object));
+    new_fo->in_use = 1;
+    new_fo->size = 0;
+    new_fo->inner_file = 0;
+    new_fo->descriptor = umode_t;
+    new_fo->first_block = yukifs_inode_block_goal(sb, ii);
+    new_fo->extent_count = 0;
+    new_fo->extent_depth = 0;
+    new_fo->links = 1;
+    // regular files keep their data in the record until they outgrow it, see inline.c,
+    // under compress= their clusters are compressed from the first writeback on, see compress.c
+    if (S_ISREG(umode_t))
+        new_fo->flags = YUKIFS_INODE_INLINE_DATA | (YUKIFS_FS(sb)->compress ? YUKIFS_INODE_COMPRESSED : 0);
+    // the record keeps the start of the name for tools like infofs, the directory entry has all of it
+    strncpy(new_fo->name, entry->d_name.name, FS_MAX_LEN);
+
+    // file the name under its hash in the directory index
+    int ret = yukifs_dir_add(dir, &entry->d_name, ii, umode_t);
+    if (ret < 0)
     {
-        printk(KERN_ERR "YukiFS: Error writing data block %d\n", data_block_nr);
-        kfree(data_block);
-        return -EIO;
-    }
-
-    if(yukifs_inode_table_write(dir->i_sb, inode_table) < 0)
-    {
-        printk(KERN_ERR "YukiFS: Error writing inode table\n");
-        kfree(data_block);
-        return -EIO;
+        printk(KERN_ERR "YukiFS: Error adding %s to directory %s\n", entry->d_name.name, ((struct file_object*)dir->i_private)->name);
+        memset(new_fo, 0, sizeof(struct file_object));
+        yukifs_free_inode_nr(sb, ii);
+        yukifs_journal_stop(sb, handle);
+        return ret;
     }
     
-    yukifs_update_statfs(dir->i_sb, new_fo); // update all the statfs info after inode table is updated
+    yukifs_update_statfs(sb, new_fo); // update all the statfs info after inode table is updated
+    yukifs_journal_stop(sb, handle);
 
-    printk(KERN_INFO "YukiFS: file %s created successfully\n", entry->d_name.name);
+    struct inode *inode = yukifs_iget(sb, ii);
+    if (IS_ERR(inode)) {
+        printk(KERN_ERR "YukiFS: inode allocation failed\n");
+        return PTR_ERR(inode);
+    }
+    d_instantiate(entry, inode);
 
-    kfree(data_block);
-    kfree(inode_table);
+    yukifs_debug("file %s created successfully\n", entry->d_name.name);
 
     return 0;
 };
 
+static int yukifs_create(struct mnt_idmap *mnt, struct inode *dir, struct dentry *entry, umode_t mode, bool excl)
+{
+    trace_yukifs_create_enter(dir, &entry->d_name);
+
+    int ret = __yukifs_create(mnt, dir, entry, mode, excl);
+
+    trace_yukifs_create_exit(dir, ret ? 0 : d_inode(entry)->i_ino, ret);
+    return ret;
+}
+
 static int yukifs_getattr(struct mnt_idmap *mnt, const struct path *path, struct kstat *stat,u32 mask, unsigned int query_flags)
 {
     struct inode *inode = path->dentry->d_inode;
     struct file_object *fo = (struct file_object *)inode->i_private;
 
-    printk(KERN_INFO "YukiFS: getattr dentry: %s inode: %s with inode_num %ld\n", path->dentry->d_name.name,fo->name,inode->i_ino);
-    printk("  getattr(): Name: %s, Size: %u, Descriptor: %o, First Block: %u, Inner: %u\n", 
-        fo->name,fo->size, fo->descriptor,fo->first_block,fo->inner_file);
+    yukifs_debug("getattr dentry: %s inode: %s with inode_num %ld size %u descriptor %o first block %u\n",
+        path->dentry->d_name.name, fo->name, inode->i_ino, fo->size, fo->descriptor, fo->first_block);
 
     stat->mode = inode->i_mode;
     stat->ino = inode->i_ino;
     stat->size = inode->i_size;
     stat->blocks = inode->i_blocks; // Calculate number of blocks
     stat->blksize = inode->i_sb->s_blocksize;
-    stat->nlink = 1; // For simplicity, assume 1 hard link
+    stat->nlink = inode->i_nlink;
     stat->uid = KUIDT_INIT(0);     // Root user for now
     stat->gid = KGIDT_INIT(0);     // Root group for now
 
@@ -331,387 +164,1302 @@ static int yukifs_getattr(struct mnt_idmap *mnt, const struct path *path, struct
     return 0;
 };
 
-static struct dentry *yukifs_lookup(struct inode *parent, struct dentry *dentry, unsigned int flags)
+static struct dentry *__yukifs_lookup(struct inode *parent, struct dentry *dentry, unsigned int flags)
 {    
-    struct superblock_info *sbi = parent->i_sb->s_fs_info;
     const char *name = dentry->d_name.name;
-    int len = dentry->d_name.len;
-    int i;
+    uint32_t ino;
 
     struct file_object *fo = (struct file_object*)parent->i_private;
 
-    printk(KERN_INFO "YukiFS: lookup called for '%s' in directory inode %lu\n", name, parent->i_ino);
+    yukifs_debug("lookup called for '%s' in directory inode %lu\n", name, parent->i_ino);
 
-    char *inode_table = kmalloc(sbi->inode_table_size, GFP_KERNEL);
-    if (!inode_table) {
-        printk(KERN_ERR "YukiFS: Error allocating inode table\n");
-        return ERR_PTR(-ENOMEM);
+    if (dentry->d_name.len > YUKIFS_NAME_LEN)
+        return ERR_PTR(-ENAMETOOLONG);
+
+    // the name hash picks the one directory leaf that can hold it
+    int ret = yukifs_dir_find(parent, &dentry->d_name, &ino);
+    if (ret == -ENOENT) {
+        // cache the miss as a negative dentry, the next lookup of the name never gets here
+        return d_splice_alias(NULL, dentry);
     }
+    if (ret < 0)
+        return ERR_PTR(ret);
 
-    int inode_table_read = yukifs_inode_table_read(parent->i_sb, inode_table);
-    if(inode_table_read < 0)
-    {
-        kfree(inode_table);
-        return ERR_PTR(inode_table_read);
+    yukifs_debug("Found file %s in directory %s at inode %u\n", name, fo->name, ino);
+
+    // files still in the inode cache come back as they are
+    struct inode *inode = yukifs_iget(parent->i_sb, ino);
+    if (IS_ERR(inode)) {
+        printk(KERN_ERR "YukiFS: inode allocation failed\n");
+        return ERR_CAST(inode);
     }
 
-    uint32_t data_blocks_offset = sbi->data_blocks_offset;
-    uint32_t dir_data_block_num = fo->first_block;
+    yukifs_debug("File %s in directory %s at inode %u is poped successfully.\n", name, fo->name, ino);
 
-    // read the data blocks from the device data blocks
-    uint32_t data_block_size = sbi->block_size;
-    uint32_t data_block_count = fo->size / sbi->block_size;
-    uint32_t data_block_offset = data_blocks_offset + dir_data_block_num * data_block_size;
-    uint32_t data_block_nr = data_block_offset / data_block_size;
+    return d_splice_alias(inode, dentry);
+}
 
-    
-    char *data_block = kmalloc(fo->size, GFP_KERNEL);
-    if(yukifs_blocks_read(parent->i_sb, data_block_nr, data_block_count, data_block) < 0)
-    {
-        printk(KERN_ERR "YukiFS: Error reading data block %d\n", data_block_nr);
-        kfree(data_block);
-        kfree(inode_table);
-        return ERR_PTR(-EIO);
-    }
+static struct dentry *yukifs_lookup(struct inode *parent, struct dentry *dentry, unsigned int flags)
+{
+    trace_yukifs_lookup_enter(parent, &dentry->d_name);
 
-    printk(KERN_INFO "YukiFS: directory data block %d\n", data_block[0]);
-    
-    // treat data block as inode index list type uint32_t*
-    uint32_t *inode_index_list = (uint32_t *)data_block;
-    uint32_t inode_index_list_size = data_block_size / sizeof(uint32_t);
-
-    // try to find specified file in the directory
-    for (i = 0; i < inode_index_list_size; i++) {
-        if (inode_index_list[i] != 0) {
-            struct file_object *ffo = (struct file_object *)inode_table + inode_index_list[i];
-            if (strncmp(name, ffo->name, len) == 0 && len == strlen(ffo->name)) {
-                printk(KERN_INFO "YukiFS: Found file %s in directory %s at Inode Index (dentry) %d\n", name, fo->name,i);
-                
-                // pop the inode from the inode table object
-                printk(KERN_INFO "YukiFS: ffo->name %s ffo->size %d ffo->descriptor %o\n", ffo->name, ffo->size,ffo->descriptor);
-                struct inode *inode = yukifs_make_inode(parent->i_sb, ffo);
-                if (!inode) {
-                    printk(KERN_ERR "YukiFS: inode allocation failed\n");
-                    kfree(data_block);
-                    kfree(inode_table);
-                    return NULL;
-                }
-
-                dentry->d_inode = inode;
-                d_add(dentry, dentry->d_inode);
-
-                printk(KERN_INFO "YukiFS: File %s in directory %s at Inode Index (dentry) %d is poped successfully.\n", name, fo->name,i);
-
-                kfree(data_block);
-                kfree(inode_table);
-                return NULL;
+    struct dentry *res = __yukifs_lookup(parent, dentry, flags);
 
-            }
-        }
-    }
+    if (IS_ERR(res))
+        trace_yukifs_lookup_exit(parent, 0, PTR_ERR(res));
+    else if (d_really_is_positive(res ? res : dentry))
+        trace_yukifs_lookup_exit(parent, d_inode(res ? res : dentry)->i_ino, 0);
+    else
+        trace_yukifs_lookup_exit(parent, 0, -ENOENT);
 
-    return NULL;
+    return res;
 }
 
-static int yukifs_unlink(struct inode *parent,struct dentry *dentry)
+static int __yukifs_unlink(struct inode *parent,struct dentry *dentry)
 {
     struct file_object *fo = (struct file_object *)parent->i_private;
     struct super_block *sb = parent->i_sb;
-    uint32_t block_size = sb->s_blocksize;
-    struct superblock_info *sbi = (struct superblock_info *)sb->s_fs_info;
 
     if (!fo) {
         printk(KERN_ERR "YukiFS: unlink - file_object is NULL\n");
         return -ENOENT;
     }
 
-    printk(KERN_INFO "YukiFS: unlink called %s %s\n", dentry->d_name.name,fo->name);
+    yukifs_debug("unlink called %s %s\n", dentry->d_name.name,fo->name);
 
-    uint32_t dir_data_block_num = fo->first_block;   
+    struct file_object *ffo = (struct file_object *)dentry->d_inode->i_private;
+    uint32_t ino = yukifs_inode_index(sb, ffo);
 
-    printk(KERN_INFO "YukiFS: unlink dentry index logical start block %d of dir %s\n", dir_data_block_num, fo->name);
+    yukifs_debug("unlink inode %d\n", ino);
 
-    uint32_t data_blocks_offset = sbi->data_blocks_offset;    
+    // try to remove dentry from the directory
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_UNLINK_CREDITS);
+    int ret = yukifs_dir_remove(parent, &dentry->d_name, ino);
+    if (ret < 0) {
+        yukifs_journal_stop(sb, handle);
+        printk(KERN_ERR "YukiFS: unlink - dentry not found in directory\n");
+        return ret;
+    }
 
-    struct file_object *ffo = (struct file_object *)dentry->d_inode->i_private;
-    uint32_t dentry_block_index = ffo->first_block;
+    // the record and its blocks stay until the last user lets go, see yukifs_evict_inode, the orphan list
+    // lets the next mount give them back when a crash comes first
+    ffo->links = 0;
+    ret = yukifs_orphan_add(sb, ino);
+    yukifs_journal_stop(sb, handle);
 
-    printk(KERN_INFO "YukiFS: unlink logical data block %d\n", dentry_block_index);
+    yukifs_debug("unlinking dentry %s from dir %s successfully\n", dentry->d_name.name, fo->name);
 
-    // For simplicity, assuming single block for now
-    uint32_t physical_block_number = dentry_block_index;
-    uint32_t physical_offset = data_blocks_offset + physical_block_number * block_size;
-    uint32_t physical_block_index = physical_offset / block_size;    
+    clear_nlink(dentry->d_inode);
+    if (ret)
+        return ret;
 
-    size_t bytes_to_write = block_size;
+    return 0;
+}
 
-    char *kbuf = kmalloc(bytes_to_write, GFP_KERNEL);
-    if (!kbuf)
-        return -ENOMEM;
-    
-    memset(kbuf, 0, bytes_to_write);
+static int yukifs_unlink(struct inode *parent, struct dentry *dentry)
+{
+    unsigned long ino = d_inode(dentry)->i_ino;
 
-    if (yukifs_blocks_write(sb, physical_block_index, 1, kbuf)) {
-        printk(KERN_ERR "YukiFS: Error unlinking to physical block %u\n", physical_block_index);
-        kfree(kbuf);
-        return -EIO;
+    trace_yukifs_unlink_enter(parent, &dentry->d_name);
+
+    int ret = __yukifs_unlink(parent, dentry);
+
+    trace_yukifs_unlink_exit(parent, ino, ret);
+    return ret;
+}
+
+static int __yukifs_mkdir(struct inode *dir, struct dentry *entry, umode_t mode)
+{
+    struct super_block *sb = dir->i_sb;
+    struct file_object *dir_fo = (struct file_object *)dir->i_private;
+
+    yukifs_debug("mkdir called %s %s %o\n", entry->d_name.name, dir_fo->name, mode);
+
+    if (entry->d_name.len > YUKIFS_NAME_LEN)
+        return -ENAMETOOLONG;
+
+    // the record, its blocks, the parent entry and the parent link count land in the same transaction
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_MKDIR_CREDITS);
+
+    // new directories are spread over the groups, the files created in them follow them there
+    uint32_t ii = UINT32_MAX;
+    if (yukifs_new_inode_nr(sb, UINT32_MAX, &ii) < 0) {
+        printk(KERN_ERR "YukiFS: Error creating directory, no free inode\n");
+        yukifs_journal_stop(sb, handle);
+        return -ENOSPC;
+    }
+
+    struct file_object *new_fo = yukifs_inode_get(sb, ii);
+    memset(new_fo, 0, sizeof(struct file_object));
+    new_fo->in_use = 1;
+    new_fo->descriptor = S_IFDIR | mode;
+    new_fo->first_block = yukifs_inode_block_goal(sb, ii);
+    new_fo->links = 2;
+    strncpy(new_fo->name, entry->d_name.name, FS_MAX_LEN);
+
+    struct inode *inode = yukifs_iget(sb, ii);
+    if (IS_ERR(inode)) {
+        memset(new_fo, 0, sizeof(struct file_object));
+        yukifs_free_inode_nr(sb, ii);
+        yukifs_journal_stop(sb, handle);
+        return PTR_ERR(inode);
+    }
+
+    int ret = yukifs_dir_init(inode);
+    if (!ret)
+        ret = yukifs_dir_add(dir, &entry->d_name, ii, S_IFDIR);
+    if (ret) {
+        printk(KERN_ERR "YukiFS: Error adding directory %s to %s\n", entry->d_name.name, dir_fo->name);
+        yukifs_update_statfs(sb, new_fo);
+        yukifs_journal_stop(sb, handle);
+        // the last iput gives the blocks and the record back, see yukifs_evict_inode
+        clear_nlink(inode);
+        iput(inode);
+        return ret;
     }
+
+    // the .. of the new directory links the parent
+    inc_nlink(dir);
+    dir_fo->links++;
+    yukifs_inode_mark_dirty(sb, dir_fo);
+    yukifs_update_statfs(sb, new_fo);
+    yukifs_journal_stop(sb, handle);
+
+    d_instantiate(entry, inode);
+
+    return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,15,0)
+static int yukifs_mkdir(struct mnt_idmap *mnt, struct inode *dir, struct dentry *entry, umode_t mode)
+{
+    trace_yukifs_mkdir_enter(dir, &entry->d_name);
+
+    int ret = __yukifs_mkdir(dir, entry, mode);
+
+    trace_yukifs_mkdir_exit(dir, ret ? 0 : d_inode(entry)->i_ino, ret);
+    return ret;
+}
+#else
+static struct dentry *yukifs_mkdir(struct mnt_idmap *mnt, struct inode *dir, struct dentry *entry, umode_t mode)
+{
+    trace_yukifs_mkdir_enter(dir, &entry->d_name);
+
+    int ret = __yukifs_mkdir(dir, entry, mode);
+
+    trace_yukifs_mkdir_exit(dir, ret ? 0 : d_inode(entry)->i_ino, ret);
+    return ret ? ERR_PTR(ret) : NULL;
+}
+#endif
+
+static int __yukifs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+    struct super_block *sb = dir->i_sb;
+    struct file_object *dir_fo = (struct file_object *)dir->i_private;
+    struct inode *inode = d_inode(dentry);
+    uint32_t ino = yukifs_inode_index(sb, (struct file_object *)inode->i_private);
+
+    yukifs_debug("rmdir called %s %s\n", dentry->d_name.name, dir_fo->name);
+
+    // the parent lock the VFS holds keeps new names out of the directory while we look
+    int ret = yukifs_dir_empty(inode);
+    if (ret < 0)
+        return ret;
+    if (!ret)
+        return -ENOTEMPTY;
+
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_UNLINK_CREDITS);
+    ret = yukifs_dir_remove(dir, &dentry->d_name, ino);
+    if (ret) {
+        yukifs_journal_stop(sb, handle);
+        return ret;
+    }
+
+    drop_nlink(dir);
+    dir_fo->links--;
+    yukifs_update_statfs(sb, dir_fo);
+
+    // the blocks and the record go once the last user lets go, see yukifs_evict_inode, or at the next mount
+    ((struct file_object *)inode->i_private)->links = 0;
+    ret = yukifs_orphan_add(sb, ino);
+    yukifs_journal_stop(sb, handle);
+
+    clear_nlink(inode);
+
+    return ret;
+}
+
+static int yukifs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+    unsigned long ino = d_inode(dentry)->i_ino;
+
+    trace_yukifs_rmdir_enter(dir, &dentry->d_name);
+
+    int ret = __yukifs_rmdir(dir, dentry);
+
+    trace_yukifs_rmdir_exit(dir, ino, ret);
+    return ret;
+}
+
+static int yukifs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    struct inode *inode = file_inode(file);
+    struct super_block *sb = inode->i_sb;
+    int ret;
+
+    ret = file_write_and_wait_range(file, start, end);
+    if (ret)
+        return ret;
+
+    // the blocks just written back read as zeros after a crash until they are converted
+    ret = yukifs_unwritten_convert(inode, true);
+    if (ret)
+        return ret;
+
+    // no inode lock here, O_DSYNC direct writes land here from iomap with it still held,
+    // and whoever changes the record logs it under their own handle anyway
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_INODE_CREDITS);
+    ret = yukifs_update_statfs(sb, (struct file_object *)inode->i_private);
+    yukifs_journal_stop(sb, handle);
+    if (ret)
+        return ret;
+
+    // concurrent fsyncs find their changes committed by whoever got the commit first
+    return yukifs_journal_commit(sb);
+}
+
+// the first write to a shared mapping of a page allocates the blocks behind it, so writeback later has
+// somewhere to put it and a full disk shows up as SIGBUS at the fault instead of lost data
+static vm_fault_t yukifs_page_mkwrite(struct vm_fault *vmf)
+{
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    vm_fault_t ret;
+
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vmf->vma->vm_file);
+
+    filemap_invalidate_lock_shared(inode->i_mapping);
+    // a shared writable mapping writes the page back, so the data cannot stay in the record
+    int err = yukifs_inline_convert_inode(inode);
+    if (err)
+        ret = block_page_mkwrite_return(err);
+    else if (yukifs_has_compressed_data((struct file_object *)inode->i_private))
+        ret = yukifs_compress_page_mkwrite(vmf);
     else
-    {
-        printk(KERN_INFO "YukiFS: unlinking physical block %d successfully\n", physical_block_index);
+        ret = block_page_mkwrite_return(block_page_mkwrite(vmf->vma, vmf, yukifs_get_block));
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+
+    sb_end_pagefault(inode->i_sb);
+    return ret;
+}
+
+static const struct vm_operations_struct yukifs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = yukifs_page_mkwrite,
+};
+
+static int yukifs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    file_accessed(file);
+    vma->vm_ops = &yukifs_file_vm_ops;
+
+    return 0;
+}
+
+static int yukifs_release(struct inode *inode, struct file *file)
+{
+    yukifs_debug("release called %s %s\n", file->f_path.dentry->d_name.name,((struct file_object*)inode->i_private)->name);
+
+    return 0;
+}
+
+// FS_COMPR_FL reports whether writeback compresses the clusters of the file, chattr +c and -c switch it
+static int yukifs_fileattr_get(struct dentry *dentry, struct fileattr *fa)
+{
+    struct file_object *fo = (struct file_object *)d_inode(dentry)->i_private;
+
+    fileattr_fill_flags(fa, yukifs_has_compressed_data(fo) ? FS_COMPR_FL : 0);
+    return 0;
+}
+
+// the VFS holds the inode lock
+static int yukifs_fileattr_set(struct mnt_idmap *mnt, struct dentry *dentry, struct fileattr *fa)
+{
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    if (fileattr_has_fsx(fa) || (fa->flags & ~FS_COMPR_FL))
+        return -EOPNOTSUPP;
+
+    filemap_invalidate_lock(inode->i_mapping);
+    if (fa->flags & FS_COMPR_FL)
+        ret = yukifs_compress_inode(inode);
+    else
+        ret = yukifs_compress_expand_inode(inode);
+    filemap_invalidate_unlock(inode->i_mapping);
+
+    return ret;
+}
+
+static ssize_t yukifs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
+
+    trace_yukifs_read_enter(inode, iocb->ki_pos, iov_iter_count(to));
+    // there is no ->direct_IO for generic_file_read_iter to fall back on
+    if (iocb->ki_flags & IOCB_DIRECT)
+        ret = yukifs_dio_read(iocb, to);
+    else
+        ret = generic_file_read_iter(iocb, to);
+    trace_yukifs_read_exit(inode, iocb->ki_pos, ret);
+
+    return ret;
+}
+
+static ssize_t yukifs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *file = iocb->ki_filp;
+    struct inode *inode = file_inode(file);
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    ssize_t ret;
+
+    trace_yukifs_write_enter(inode, iocb->ki_pos, iov_iter_count(from));
+
+    inode_lock(inode);
+
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto out;
+
+    ret = file_remove_privs(file);
+    if (ret)
+        goto out;
+
+    ret = file_update_time(file);
+    if (ret)
+        goto out;
+
+    if (iocb->ki_flags & IOCB_DIRECT) {
+        ret = yukifs_dio_write(iocb, from);
+        // iomap gives up with -ENOTBLK when it cannot drop the cached pages over the range, go through them instead
+        if (ret != -ENOTBLK)
+            goto out_direct;
     }
 
-    // read the data blocks from the device data blocks
-    uint32_t data_block_size = sbi->block_size;
-    uint32_t data_block_count = fo->size / sbi->block_size;
-    uint32_t data_block_offset = data_blocks_offset + dir_data_block_num * data_block_size;
-    uint32_t data_block_nr = data_block_offset / data_block_size;
+    // data lands in the page cache here and is written back by yukifs_writepages later
+    ret = generic_perform_write(iocb, from);
+    #if LINUX_VERSION_CODE < KERNEL_VERSION(6,4,0)
+        if (ret > 0)
+            iocb->ki_pos += ret;
+    #endif
+
+    // only the size lives in the inode table, so only touch it when the size moved
+    if (ret > 0 && fo->size != i_size_read(inode)) {
+        struct yukifs_handle handle = yukifs_journal_start(inode->i_sb, YUKIFS_JOURNAL_INODE_CREDITS);
+        fo->size = i_size_read(inode);
+        yukifs_update_statfs(inode->i_sb, fo);
+        yukifs_journal_stop(inode->i_sb, handle);
+    }
 
-    
-    char *data_block = kmalloc(fo->size, GFP_KERNEL);
-    if(yukifs_blocks_read(parent->i_sb, data_block_nr, data_block_count, data_block) < 0)
-    {
-        printk(KERN_ERR "YukiFS: unlink Error reading data block %d\n", data_block_nr);
-        kfree(data_block);
-        return -EIO;
+    // an O_DIRECT writer expects the data on the device and out of the cache once we return
+    if (ret > 0 && (iocb->ki_flags & IOCB_DIRECT)) {
+        loff_t start = iocb->ki_pos - ret;
+        int err = filemap_write_and_wait_range(file->f_mapping, start, iocb->ki_pos - 1);
+        if (err)
+            ret = err;
+        else
+            invalidate_mapping_pages(file->f_mapping, start >> PAGE_SHIFT, (iocb->ki_pos - 1) >> PAGE_SHIFT);
     }
 
-    // try to remove dentry from the directory
-    uint32_t *inode_index_list = (uint32_t *)data_block;
-    uint32_t inode_index_list_size = data_block_size / sizeof(uint32_t);
-    uint32_t dentry_index = UINT32_MAX;
-    for (uint32_t i = 0; i < inode_index_list_size; i++) {
-        if (inode_index_list[i] == dentry_block_index) {
-            dentry_index = i;
-            break;
-        }
+out:
+    inode_unlock(inode);
+
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+
+    trace_yukifs_write_exit(inode, iocb->ki_pos, ret);
+    return ret;
+
+out_direct:
+    // iomap already ran generic_write_sync for O_DSYNC writes
+    inode_unlock(inode);
+
+    trace_yukifs_write_exit(inode, iocb->ki_pos, ret);
+    return ret;
+}
+
+static int yukifs_setattr(struct mnt_idmap *mnt, struct dentry *dentry, struct iattr *attr)
+{
+    struct inode *inode = d_inode(dentry);
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    int ret;
+
+    ret = setattr_prepare(&nop_mnt_idmap, dentry, attr);
+    if (ret)
+        return ret;
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        // direct I/O in flight still writes through the extents the truncate is about to free
+        inode_dio_wait(inode);
+
+        ret = yukifs_inline_truncate(inode, attr->ia_size);
+        if (ret < 0)
+            return ret;
     }
-    if (dentry_index == UINT32_MAX) {
-        printk(KERN_ERR "YukiFS: unlink - dentry not found in directory\n");
-        kfree(data_block);
-        return -ENOENT;
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        loff_t old_size = i_size_read(inode);
+        bool compressed = yukifs_has_compressed_data(fo);
+
+        // the partial cluster of a compressed file is rewritten whole below instead
+        if (!compressed) {
+            ret = block_truncate_page(inode->i_mapping, attr->ia_size, yukifs_get_block);
+            if (ret)
+                return ret;
+        }
+
+        // keeps write faults from allocating blocks in the range being cut off, see yukifs_page_mkwrite
+        filemap_invalidate_lock(inode->i_mapping);
+        truncate_setsize(inode, attr->ia_size);
+
+        // the cluster the file now ends in loses what lies past the end before its blocks go
+        if (compressed && attr->ia_size < old_size) {
+            ret = yukifs_compress_truncate(inode, attr->ia_size);
+            if (ret) {
+                filemap_invalidate_unlock(inode->i_mapping);
+                return ret;
+            }
+        }
+
+        uint32_t from = DIV_ROUND_UP(attr->ia_size, inode->i_sb->s_blocksize);
+        yukifs_unwritten_forget(inode, from, UINT32_MAX);
+
+        // give back the blocks past the new end of file, the pages are gone so no handle waits on a page lock
+        // a truncate may take several transactions, the orphan list has the next mount finish it after a crash
+        struct yukifs_handle handle = yukifs_extent_write_lock(inode, YUKIFS_JOURNAL_TRUNCATE_CREDITS);
+        uint32_t index = yukifs_inode_index(inode->i_sb, fo);
+        fo->size = attr->ia_size;
+        if (inode->i_nlink) {
+            // records from before links was kept read back 0, which would have the mount free the file
+            fo->links = inode->i_nlink;
+            ret = yukifs_orphan_add(inode->i_sb, index);
+        }
+        if (!ret)
+            ret = yukifs_truncate_blocks(inode, from, &handle);
+        // an unlinked file stays on the list for evict
+        if (!ret && inode->i_nlink)
+            ret = yukifs_orphan_del(inode->i_sb, index);
+        yukifs_extent_write_unlock(inode, handle);
+        filemap_invalidate_unlock(inode->i_mapping);
+        if (ret)
+            return ret;
     }
-    inode_index_list[dentry_index] = 0;
 
-    // write the data blocks back to the device data blocks
-    if (yukifs_blocks_write(sb, data_block_nr, data_block_count, data_block)) {
-        printk(KERN_ERR "YukiFS: unlink Error writing data block %d\n", data_block_nr);
-        kfree(data_block);
+    setattr_copy(&nop_mnt_idmap, inode, attr);
+    mark_inode_dirty(inode);
+
+    return 0;
+}
+
+// fo points into the mount-resident inode table, log the block holding it along with the bitmaps, the
+// superblock waits for yukifs_sync_fs since the free counts are rebuilt from the bitmaps at mount anyway,
+// callers hold a journal handle
+int yukifs_update_statfs(struct super_block *sb, struct file_object *fo)
+{
+    yukifs_debug("updating inode %s with size %d\n", fo->name, fo->size);
+
+    yukifs_inode_mark_dirty(sb, fo);
+    if (yukifs_inode_table_sync(sb) < 0)
         return -EIO;
+
+    return yukifs_bitmaps_sync(sb);
+}
+
+// give back every block at or beyond from, a step of at most one handle's worth of bitmap blocks at a time,
+// each step logs the record so a restart never leaves a freed block mapped, callers hold the extent map
+// for writing under *handle, which may be a different one on return
+int yukifs_truncate_blocks(struct inode *inode, uint32_t from, struct yukifs_handle *handle)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+
+    for (;;) {
+        int ret = yukifs_extent_truncate_step(sb, fo, from, YUKIFS_JOURNAL_TRUNCATE_BUDGET);
+        int err = yukifs_update_statfs(sb, fo);
+        if (ret < 0)
+            return ret;
+        if (err || !ret)
+            return err;
+
+        // the extent map goes along with the handle, a commit in between waits for handles that may want it
+        yukifs_extent_write_unlock(inode, *handle);
+        *handle = yukifs_extent_write_lock(inode, YUKIFS_JOURNAL_TRUNCATE_CREDITS);
     }
-    else
-    {
-        printk(KERN_INFO "YukiFS: unlinking dentry %s from dir %s successfully\n", dentry->d_name.name, fo->name);
+}
+
+#pragma endregion
+
+#pragma region Address Space Operations
+
+// allocate up to count blocks for the hole at lblk as one extent with flags, ext describes the hole on the way in
+// and the new extent on the way out, which may be shorter when the free space around the goal is fragmented,
+// callers hold the extent map for writing, see yukifs_extent_write_lock
+int yukifs_alloc_run(struct inode *inode, uint32_t lblk, uint32_t count, uint16_t flags, struct yukifs_extent *ext)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    uint32_t block;
+    int ret;
+
+    ret = yukifs_extent_prepare(sb, fo, lblk, 1);
+    if (ret)
+        return ret;
+
+    // the hole lookup left the block right after the previous run as the goal
+    ret = yukifs_new_blocks(sb, ext->physical_block, &block, &count);
+    if (ret)
+        return ret;
+
+    ext->logical_block = lblk;
+    ext->physical_block = block;
+    ext->length = count;
+    ext->flags = flags;
+    ret = yukifs_extent_insert(sb, fo, ext);
+    if (ret) {
+        yukifs_free_blocks(sb, block, count);
+        return ret;
     }
 
-    ffo->size = 0;
-    yukifs_update_statfs(sb, ffo);
+    // persist the new mapping together with the bitmap bits that now back it
+    return yukifs_update_statfs(sb, fo);
+}
 
-    return 0;
+// give the mapped blocks lblk..lblk+*len flags, *len comes back clipped to the extent holding lblk,
+// callers hold the extent map for writing
+static int yukifs_convert_run(struct inode *inode, uint32_t lblk, uint32_t *len, uint16_t flags)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    int ret;
+
+    ret = yukifs_extent_prepare(sb, fo, lblk, 2);
+    if (!ret)
+        ret = yukifs_extent_set_flags(sb, fo, lblk, len, flags);
+    if (!ret)
+        ret = yukifs_update_statfs(sb, fo);
+
+    return ret;
 }
 
-static int yukifs_release(struct inode *inode, struct file *file)
+// give every mapped block in first..last flags, holes and blocks that already have them are skipped,
+// each extent is its own handle
+static int yukifs_convert_range(struct inode *inode, uint32_t first, uint32_t last, uint16_t flags)
 {
-    printk(KERN_INFO "YukiFS: release called %s %s\n", file->f_path.dentry->d_name.name,((struct file_object*)inode->i_private)->name);
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    struct yukifs_extent ext;
+    uint32_t lblk = first;
+
+    while (lblk <= last) {
+        uint32_t len = last - lblk + 1;
+
+        struct yukifs_handle handle = yukifs_extent_write_lock(inode, YUKIFS_JOURNAL_MAP_CREDITS);
+        int ret = yukifs_extent_lookup(inode->i_sb, fo, lblk, &ext);
+        if (ret == -ENOENT) {
+            len = min_t(uint32_t, len, ext.length);
+            ret = 0;
+        } else if (!ret && ext.flags == flags) {
+            len = min_t(uint32_t, len, ext.logical_block + ext.length - lblk);
+        } else if (!ret) {
+            ret = yukifs_convert_run(inode, lblk, &len, flags);
+        }
+        yukifs_extent_write_unlock(inode, handle);
+        if (ret)
+            return ret;
+        lblk += len;
+    }
+
     return 0;
 }
 
-static ssize_t yukifs_write(struct file *file, const char __user *buf, size_t len, loff_t *offset)
+// the slow half of yukifs_get_block, the lookup is repeated under the write lock since another writer
+// may have filled the hole or converted the extent since the shared lookup
+static int yukifs_get_block_create(struct inode *inode, uint32_t iblock, struct buffer_head *bh_result)
 {
-    struct inode *inode = file->f_inode;
+    struct super_block *sb = inode->i_sb;
     struct file_object *fo = (struct file_object *)inode->i_private;
+    struct xarray *unwritten = &YUKIFS_I(inode)->unwritten;
+    uint32_t max_blocks = bh_result->b_size >> inode->i_blkbits;
+    struct yukifs_extent ext;
+
+    struct yukifs_handle handle = yukifs_extent_write_lock(inode, YUKIFS_JOURNAL_MAP_CREDITS);
+
+    // new blocks stay unwritten until writeback has put their data on the device, see yukifs_unwritten_convert
+    int ret = yukifs_extent_lookup(sb, fo, iblock, &ext);
+    if (ret == -ENOENT) {
+        // the writer asks for the other blocks of the page next, take them along so they end up in one run
+        uint32_t page_blocks = PAGE_SIZE >> inode->i_blkbits;
+        uint32_t count = max(max_blocks, page_blocks - iblock % page_blocks);
+
+        ret = yukifs_alloc_run(inode, iblock, min_t(uint32_t, count, ext.length), YUKIFS_EXTENT_UNWRITTEN, &ext);
+    }
+    if (ret)
+        goto out;
+
+    uint32_t offset = iblock - ext.logical_block;
+    uint32_t len = min_t(uint32_t, max_blocks, ext.length - offset);
+
+    // unwritten blocks are handed out one at a time, each is remembered until it is converted
+    if (ext.flags & YUKIFS_EXTENT_UNWRITTEN) {
+        len = 1;
+        // one already remembered holds data from an earlier writeback
+        if (!xa_load(unwritten, iblock)) {
+            ret = xa_err(xa_store(unwritten, iblock, xa_mk_value(0), GFP_NOFS));
+            if (ret)
+                goto out;
+
+            // the block holds whatever was on the disk, the page cache zeroes what the write does not cover
+            set_buffer_new(bh_result);
+        }
+    }
+
+    map_bh(bh_result, sb, yukifs_data_block_nr(sb, ext.physical_block + offset));
+    bh_result->b_size = (size_t)len << inode->i_blkbits;
+
+out:
+    yukifs_extent_write_unlock(inode, handle);
+    return ret;
+}
+
+// map a logical block of a file to its device block, the page cache and mpage code call this
+int yukifs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+{
     struct super_block *sb = inode->i_sb;
-    ssize_t written = 0;
-    uint32_t block_size = sb->s_blocksize;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    struct rw_semaphore *extent_sem = &YUKIFS_I(inode)->extent_sem;
+    uint32_t max_blocks = bh_result->b_size >> inode->i_blkbits;
+    struct yukifs_extent ext;
+    int ret;
 
-    printk(KERN_INFO "YukiFS: write called for inode %lu, offset %lld, len %zu\n",
-           inode->i_ino, *offset, len);
+    if (iblock >= UINT32_MAX)
+        return -EFBIG;
 
-    if (!fo) {
-        printk(KERN_ERR "YukiFS: write - file_object is NULL\n");
-        return -ENOENT;
+    // readahead and writeback of mapped blocks only ever need the shared lock
+    down_read(extent_sem);
+
+    // the record holds data instead of extents, writers move it to blocks before they get here
+    if (yukifs_has_inline_data(fo)) {
+        up_read(extent_sem);
+        return create ? -EIO : 0;
     }
 
-    if (*offset > inode->i_size) {
-        printk(KERN_ERR "YukiFS: write - offset exceeds file size\n");
-        return -EINVAL;
+    ret = yukifs_extent_lookup(sb, fo, iblock, &ext);
+    // writeback already filled the block but its extent is not converted yet, see yukifs_unwritten_convert
+    bool filled = ret == 0 && (ext.flags & YUKIFS_EXTENT_UNWRITTEN) && xa_load(&YUKIFS_I(inode)->unwritten, iblock);
+    up_read(extent_sem);
+
+    // compressed clusters are only read and written whole, see compress.c
+    if (ret == 0 && (ext.flags & YUKIFS_EXTENT_COMPRESSED)) {
+        printk(KERN_ERR "YukiFS: Block %u of %s is in a compressed cluster\n", (uint32_t)iblock, fo->name);
+        return -EUCLEAN;
+    }
+
+    if (ret == 0 && (!(ext.flags & YUKIFS_EXTENT_UNWRITTEN) || filled)) {
+        uint32_t offset = iblock - ext.logical_block;
+        uint32_t len = filled ? 1 : min_t(uint32_t, max_blocks, ext.length - offset);
+
+        // hand back the rest of the run so mpage can build one large bio out of it
+        map_bh(bh_result, sb, yukifs_data_block_nr(sb, ext.physical_block + offset));
+        bh_result->b_size = (size_t)len << inode->i_blkbits;
+        return 0;
     }
 
-    uint32_t start_block = fo->first_block;   
+    if (ret && ret != -ENOENT)
+        return ret;
 
-    uint32_t data_blocks_offset = ((struct superblock_info *)sb->s_fs_info)->data_blocks_offset;
+    // holes and preallocated blocks read back as zeros until something is written to them
+    if (!create)
+        return 0;
+
+    return yukifs_get_block_create(inode, iblock, bh_result);
+}
+
+static int yukifs_read_folio(struct file *file, struct folio *folio)
+{
+    struct inode *inode = folio->mapping->host;
+
+    if (yukifs_has_inline_data((struct file_object *)inode->i_private))
+        return yukifs_inline_read_folio(inode, folio);
+
+    if (yukifs_has_compressed_data((struct file_object *)inode->i_private))
+        return yukifs_compress_read_folio(inode, folio);
+
+    return mpage_read_folio(folio, yukifs_get_block);
+}
 
-    // For simplicity, assuming single block for now
-    uint32_t physical_block_number = start_block;
-    uint32_t physical_offset = data_blocks_offset + physical_block_number * block_size;
-    uint32_t physical_block_index = physical_offset / block_size;
-    uint32_t offset_in_physical_block = physical_offset % block_size;
+static void yukifs_readahead(struct readahead_control *rac)
+{
+    // inline files have nothing to read ahead, read_folio fills them from the record
+    if (yukifs_has_inline_data((struct file_object *)rac->mapping->host->i_private))
+        return;
 
-    size_t bytes_to_write = len;
-    if (offset_in_physical_block + bytes_to_write > block_size) {
-        bytes_to_write = block_size - offset_in_physical_block;
-        // Need to handle multi-block writes later
+    if (yukifs_has_compressed_data((struct file_object *)rac->mapping->host->i_private)) {
+        yukifs_compress_readahead(rac);
+        return;
     }
 
-    char *kbuf = kmalloc(bytes_to_write, GFP_KERNEL);
-    if (!kbuf)
-        return -ENOMEM;
-   
+    mpage_readahead(rac, yukifs_get_block);
+}
 
-    if (copy_from_user(kbuf, buf, bytes_to_write)) {
-        kfree(kbuf);
-        return -EFAULT;
-    }    
+static int yukifs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    struct yukifs_inode_info *ei = YUKIFS_I(mapping->host);
 
-    printk(KERN_INFO "YukiFS: kbuf %s", kbuf);
+    if (yukifs_has_compressed_data((struct file_object *)mapping->host->i_private))
+        return yukifs_compress_writepages(mapping, wbc);
 
-    char *block_buf = kmalloc(block_size, GFP_KERNEL);
-    if (!block_buf) {
-        kfree(kbuf);
-        return -ENOMEM;
+    int ret = mpage_writepages(mapping, wbc, yukifs_get_block);
+
+    // the unwritten blocks it filled are converted once the I/O completes
+    if (!xa_empty(&ei->unwritten))
+        queue_work(YUKIFS_FS(mapping->host->i_sb)->unwritten_wq, &ei->unwritten_work);
+
+    return ret;
+}
+
+static void yukifs_write_failed(struct address_space *mapping, loff_t to)
+{
+    struct inode *inode = mapping->host;
+
+    // drop any page cache instantiated beyond the size by a failed write
+    if (to > inode->i_size)
+        truncate_pagecache(inode, inode->i_size);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,12,0)
+static int yukifs_write_begin(struct file *file, struct address_space *mapping,
+    loff_t pos, unsigned len, struct page **pagep, void **fsdata)
+{
+    struct folio *folio;
+    int ret = yukifs_inline_write_begin(mapping->host, pos, len, &folio);
+    if (ret) {
+        if (ret > 0)
+            *pagep = &folio->page;
+        return min(ret, 0);
     }
 
-    char *block_buf_old = kmalloc(block_size, GFP_KERNEL);
-    if (!block_buf_old) {
-        kfree(kbuf);
-        return -ENOMEM;
+    if (yukifs_has_compressed_data((struct file_object *)mapping->host->i_private)) {
+        ret = yukifs_compress_write_begin(mapping->host, pos, len, &folio);
+        if (!ret)
+            *pagep = &folio->page;
+        return ret;
     }
 
-    // read the block from the physical block
-    if (yukifs_blocks_read(sb, physical_block_index, 1, block_buf_old)) {
-        printk(KERN_ERR "YukiFS: Error reading block %u\n", physical_block_index);
-        kfree(kbuf);
-        return -EIO;
+    ret = block_write_begin(mapping, pos, len, pagep, yukifs_get_block);
+    if (unlikely(ret))
+        yukifs_write_failed(mapping, pos + len);
+
+    return ret;
+}
+
+static int yukifs_write_end(struct file *file, struct address_space *mapping,
+    loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata)
+{
+    // the inline flag only ever clears under the lock of folio 0, which write_begin handed us
+    if (yukifs_has_inline_data((struct file_object *)mapping->host->i_private))
+        return yukifs_inline_write_end(mapping->host, page_folio(page), pos, copied);
+
+    if (yukifs_has_compressed_data((struct file_object *)mapping->host->i_private))
+        return yukifs_compress_write_end(mapping->host, page_folio(page), pos, len, copied);
+
+    int ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+    if (ret < len)
+        yukifs_write_failed(mapping, pos + len);
+
+    return ret;
+}
+#else
+static int yukifs_write_begin(struct file *file, struct address_space *mapping,
+    loff_t pos, unsigned len, struct folio **foliop, void **fsdata)
+{
+    int ret = yukifs_inline_write_begin(mapping->host, pos, len, foliop);
+    if (ret)
+        return min(ret, 0);
+
+    if (yukifs_has_compressed_data((struct file_object *)mapping->host->i_private))
+        return yukifs_compress_write_begin(mapping->host, pos, len, foliop);
+
+    ret = block_write_begin(mapping, pos, len, foliop, yukifs_get_block);
+    if (unlikely(ret))
+        yukifs_write_failed(mapping, pos + len);
+
+    return ret;
+}
+
+static int yukifs_write_end(struct file *file, struct address_space *mapping,
+    loff_t pos, unsigned len, unsigned copied, struct folio *folio, void *fsdata)
+{
+    // the inline flag only ever clears under the lock of folio 0, which write_begin handed us
+    if (yukifs_has_inline_data((struct file_object *)mapping->host->i_private))
+        return yukifs_inline_write_end(mapping->host, folio, pos, copied);
+
+    if (yukifs_has_compressed_data((struct file_object *)mapping->host->i_private))
+        return yukifs_compress_write_end(mapping->host, folio, pos, len, copied);
+
+    int ret = generic_write_end(file, mapping, pos, len, copied, folio, fsdata);
+    if (ret < len)
+        yukifs_write_failed(mapping, pos + len);
+
+    return ret;
+}
+#endif
+
+static sector_t yukifs_bmap(struct address_space *mapping, sector_t block)
+{
+    // no block holds the data of a compressed file as it is
+    if (yukifs_has_compressed_data((struct file_object *)mapping->host->i_private))
+        return 0;
+
+    return generic_block_bmap(mapping, block, yukifs_get_block);
+}
+
+#pragma endregion
+
+#pragma region Unwritten Conversion
+
+// buffered writes leave the blocks they fill unwritten until the data is on the device, ei->unwritten
+// remembers them so reads see the data in the meantime, and the rounds below convert them once their
+// folios are clean, a crash in between has them read back as zeros instead of whatever was there before
+
+// convert the remembered blocks whose data made it to the device, a block whose folio is dirty or under
+// writeback waits for a later round, wait has the round wait for the writeback instead, a writeback error
+// since the last round leaves every block this round would have converted unwritten
+int yukifs_unwritten_convert(struct inode *inode, bool wait)
+{
+    struct yukifs_inode_info *ei = YUKIFS_I(inode);
+    struct address_space *mapping = inode->i_mapping;
+    uint8_t shift = PAGE_SHIFT - inode->i_blkbits;
+    unsigned long lblk;
+    void *entry;
+    int ret = 0;
+
+    if (xa_empty(&ei->unwritten))
+        return 0;
+
+    mutex_lock(&ei->unwritten_mutex);
+
+    xa_for_each(&ei->unwritten, lblk, entry) {
+        struct folio *folio = filemap_get_folio(mapping, lblk >> shift);
+        bool busy = false;
+
+        // a folio that left the cache was clean
+        if (!IS_ERR(folio)) {
+            if (wait)
+                folio_wait_writeback(folio);
+            busy = folio_test_dirty(folio) || folio_test_writeback(folio);
+            folio_put(folio);
+        }
+        if (!busy)
+            xa_set_mark(&ei->unwritten, lblk, XA_MARK_0);
     }
 
-    // fill all bytes with zeros
-    memset(block_buf, 0, block_size);
+    // checked after the folios so an error from a writeback that ended in between is not missed
+    bool failed = filemap_check_wb_err(mapping, ei->unwritten_wb_err);
+    ei->unwritten_wb_err = filemap_sample_wb_err(mapping);
 
-    printk(KERN_INFO "YukiFS: write %s called flag %x\n", fo->name, file->f_flags);
-    // copy old data to new buffer
-    if(file->f_flags & O_APPEND) // copy old data to new buffer if appending
-    {
-        memcpy(block_buf, block_buf_old, fo->size);
+    uint32_t first = 0, last = 0;
+    bool run = false;
+
+    xa_for_each_marked(&ei->unwritten, lblk, entry, XA_MARK_0) {
+        if (run && lblk == last + 1) {
+            last = lblk;
+            continue;
+        }
+        if (run && !failed)
+            ret = yukifs_convert_range(inode, first, last, 0);
+        if (ret)
+            break;
+        first = last = lblk;
+        run = true;
+    }
+    if (run && !failed && !ret)
+        ret = yukifs_convert_range(inode, first, last, 0);
+
+    // what failed to convert stays for a later round
+    xa_for_each_marked(&ei->unwritten, lblk, entry, XA_MARK_0) {
+        if (ret)
+            xa_clear_mark(&ei->unwritten, lblk, XA_MARK_0);
+        else
+            xa_erase(&ei->unwritten, lblk);
     }
 
-    // copy data from user buffer to kernel buffer
-    memcpy(block_buf + *offset, kbuf, bytes_to_write);
+    mutex_unlock(&ei->unwritten_mutex);
+    return ret;
+}
 
-    // write the block to the physical block
-    if (yukifs_blocks_write(sb, physical_block_index, 1, block_buf)) {
-        printk(KERN_ERR "YukiFS: Error writing to block %u\n", physical_block_index);
-        kfree(kbuf);
-        return -EIO;
+// forget the remembered blocks in first..last, their extents are about to be freed or unwritten
+void yukifs_unwritten_forget(struct inode *inode, uint32_t first, uint32_t last)
+{
+    struct yukifs_inode_info *ei = YUKIFS_I(inode);
+    unsigned long lblk;
+    void *entry;
+
+    mutex_lock(&ei->unwritten_mutex);
+    xa_for_each_range(&ei->unwritten, lblk, entry, first, last)
+        xa_erase(&ei->unwritten, lblk);
+    mutex_unlock(&ei->unwritten_mutex);
+}
+
+// queued by yukifs_writepages, runs on the unwritten_wq of the mount
+void yukifs_unwritten_work(struct work_struct *work)
+{
+    struct yukifs_inode_info *ei = container_of(work, struct yukifs_inode_info, unwritten_work);
+
+    int ret = yukifs_unwritten_convert(&ei->vfs_inode, true);
+    if (ret)
+        printk(KERN_ERR "YukiFS: Error converting unwritten blocks of inode %lu: %d\n", ei->vfs_inode.i_ino, ret);
+}
+
+#pragma endregion
+
+#pragma region Direct IO
+
+// map as much of pos..pos+length as one extent covers, writes fill holes with a freshly allocated unwritten
+// run, unwritten blocks are converted once the data is on the device, see yukifs_dio_write_end_io
+static int yukifs_iomap_begin(struct inode *inode, loff_t pos, loff_t length, unsigned flags,
+    struct iomap *iomap, struct iomap *srcmap)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    uint8_t blkbits = inode->i_blkbits;
+    bool write = flags & IOMAP_WRITE;
+    struct yukifs_handle handle = { 0 };
+    struct yukifs_extent ext;
+    int ret;
+
+    if ((pos >> blkbits) >= UINT32_MAX)
+        return -EFBIG;
+
+    uint32_t lblk = pos >> blkbits;
+    uint32_t count = min_t(loff_t, ((pos + length - 1) >> blkbits) - lblk + 1, YUKIFS_EXTENT_MAX_LEN);
+
+    iomap->bdev = sb->s_bdev;
+    iomap->offset = (loff_t)lblk << blkbits;
+    iomap->flags = 0;
+
+    // reads share the extent map with readahead and each other, writes may change it
+    if (write)
+        handle = yukifs_extent_write_lock(inode, YUKIFS_JOURNAL_MAP_CREDITS);
+    else
+        down_read(&YUKIFS_I(inode)->extent_sem);
+
+    ret = yukifs_extent_lookup(sb, fo, lblk, &ext);
+    if (ret == -ENOENT && write)
+        ret = yukifs_alloc_run(inode, lblk, min_t(uint32_t, count, ext.length), YUKIFS_EXTENT_UNWRITTEN, &ext);
+
+    if (ret == -ENOENT) {
+        iomap->type = IOMAP_HOLE;
+        iomap->addr = IOMAP_NULL_ADDR;
+        iomap->length = (u64)min_t(uint32_t, count, ext.length) << blkbits;
+        ret = 0;
+        goto out;
     }
 
-    written = bytes_to_write;
-    *offset += written;
+    if (ret)
+        goto out;
 
-    inode->i_size = *offset; // update in-memory inode     
-    file->f_pos = *offset;
+    uint32_t offset = lblk - ext.logical_block;
+    count = min_t(uint32_t, count, ext.length - offset);
 
-    // prepare for new inode object
-    fo->size = *offset;
+    // iomap fills reads of unwritten blocks with zeros, and zeroes the parts of them a write does not cover
+    iomap->type = (ext.flags & YUKIFS_EXTENT_UNWRITTEN) ? IOMAP_UNWRITTEN : IOMAP_MAPPED;
 
-    yukifs_update_statfs(sb, fo);
+    iomap->addr = (u64)yukifs_data_block_nr(sb, ext.physical_block + offset) << blkbits;
+    iomap->length = (u64)count << blkbits;
 
-    kfree(block_buf);
+out:
+    if (write)
+        yukifs_extent_write_unlock(inode, handle);
+    else
+        up_read(&YUKIFS_I(inode)->extent_sem);
+    return ret;
+}
+
+static const struct iomap_ops yukifs_iomap_ops = {
+    .iomap_begin = yukifs_iomap_begin,
+};
+
+// unwritten blocks are converted and the size moves only once the data is on the device, so a crash never
+// exposes blocks that were not written, a failed or short write leaves what it did not reach unwritten
+static int yukifs_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error, unsigned int flags)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    loff_t end = iocb->ki_pos + size;
 
-    kfree(kbuf);
-    return written;
+    if (error || !size)
+        return error;
+
+    // iomap completes writes into unwritten blocks from a workqueue, so this may sleep
+    if (flags & IOMAP_DIO_UNWRITTEN) {
+        error = yukifs_convert_range(inode, iocb->ki_pos >> inode->i_blkbits, (end - 1) >> inode->i_blkbits, 0);
+        if (error)
+            return error;
+    }
+
+    if (end <= i_size_read(inode))
+        return 0;
+
+    // extending writes complete synchronously under the inode lock, see yukifs_dio_write
+    i_size_write(inode, end);
+
+    struct yukifs_handle handle = yukifs_journal_start(inode->i_sb, YUKIFS_JOURNAL_INODE_CREDITS);
+    fo->size = end;
+    error = yukifs_update_statfs(inode->i_sb, fo);
+    yukifs_journal_stop(inode->i_sb, handle);
+
+    return error;
 }
 
-static int yukifs_update_statfs(struct super_block *sb, struct file_object *fo)
+static const struct iomap_dio_ops yukifs_dio_write_ops = {
+    .end_io = yukifs_dio_write_end_io,
+};
+
+static ssize_t yukifs_dio_read(struct kiocb *iocb, struct iov_iter *to)
 {
-    struct superblock_info *sbi = (struct superblock_info *)sb->s_fs_info;
-    uint32_t inode_table_offset = sbi->inode_table_offset; 
-    uint32_t inode_table_size = sbi->inode_table_storage_size; // use storage size due to whole blocks read
-    uint32_t inode_table_clusters = sbi->inode_table_clusters;
-    uint32_t inode_block_nr=inode_table_offset/sbi->block_size;
+    struct inode *inode = file_inode(iocb->ki_filp);
+    ssize_t ret;
 
-    char *inode_table = kmalloc(inode_table_size, GFP_KERNEL);
-    if (!inode_table) {
-        printk(KERN_ERR "YukiFS: Error allocating inode table\n");
-        return -ENOMEM;
-    }  
+    if (!iov_iter_count(to))
+        return 0;
 
-    if(yukifs_blocks_read(sb, inode_block_nr, inode_table_clusters, (char *)inode_table) < 0)
-    {
-        printk(KERN_ERR "YukiFS: Error reading inode table\n");
-        return -EIO;
+    // inline and compressed files have no blocks to read from, they are read through the page cache
+    if (yukifs_has_inline_data((struct file_object *)inode->i_private) ||
+        yukifs_has_compressed_data((struct file_object *)inode->i_private)) {
+        iocb->ki_flags &= ~IOCB_DIRECT;
+        return generic_file_read_iter(iocb, to);
     }
 
-    uint32_t inode_index_list_size = sbi->total_inodes;
-
-    for (uint32_t i = 0; i < inode_index_list_size; i++) {
-        if (((struct file_object*)inode_table)[i].in_use == 1)
-        {
-            struct file_object *ffo = &(((struct file_object *)inode_table)[i]);
-            if (strncmp(fo->name, ffo->name, strlen(fo->name)) == 0 && strlen(fo->name) == strlen(ffo->name)) 
-            {     
-                // Update the inode object
-
-                printk(KERN_INFO "YukiFS: updating inode %s \n", ffo->name);
-                printk(KERN_INFO "YukiFS: updating inode %s old size %d new size %d \n", ffo->name,ffo->size,fo->size);
-
-                if(ffo->size != 0 && fo->size != 0)
-                {
-                    // update metadata for file
-                    ffo->size = fo->size;
-                    printk(KERN_INFO "YukiFS: updating inode %s with size %d\n", ffo->name, fo->size);
-                }
-                else if(ffo->size != 0 && fo->size == 0)
-                {
-                    // erase metadata for file                    
-                    printk(KERN_INFO "YukiFS: erasing inode %s\n", ffo->name);
-                    memset(ffo, 0, sizeof(struct file_object));
-                }
-                else if(ffo->size == 0 && fo->size != 0)
-                {
-                    // init metadata for file
-                    ffo->size = fo->size;
-                    printk(KERN_INFO "YukiFS: initializing inode %s with size %d\n", ffo->name, fo->size);
-                }
-                else
-                {
-                    // do nothing if ffo->size == 0 && fo->size == 0
-                }
-            }
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock_shared(inode))
+            return -EAGAIN;
+    } else {
+        inode_lock_shared(inode);
+    }
+
+    // blocks buffered writeback filled are still unwritten until the work gets to them
+    if (!xa_empty(&YUKIFS_I(inode)->unwritten)) {
+        loff_t pos = iocb->ki_pos;
+        ret = filemap_write_and_wait_range(inode->i_mapping, pos, pos + iov_iter_count(to) - 1);
+        if (!ret)
+            ret = yukifs_unwritten_convert(inode, true);
+        if (ret) {
+            inode_unlock_shared(inode);
+            return ret;
         }
     }
 
-    // write inode table back to disk
-    if (yukifs_blocks_write(sb, inode_block_nr, inode_table_clusters, (char *)inode_table))
-    {
-        printk(KERN_ERR "YukiFS: Error writing inode table\n");
-        return -EIO;
+    ret = iomap_dio_rw(iocb, to, &yukifs_iomap_ops, NULL, 0, NULL, 0);
+    inode_unlock_shared(inode);
+
+    file_accessed(iocb->ki_filp);
+    return ret;
+}
+
+// callers hold the inode lock and have run the write checks
+static ssize_t yukifs_dio_write(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    unsigned int dio_flags = 0;
+
+    // inline files take the buffered path, which also moves them to blocks once they outgrow the record,
+    // compressed files take it since writeback compresses whole clusters
+    if (yukifs_has_inline_data((struct file_object *)inode->i_private) ||
+        yukifs_has_compressed_data((struct file_object *)inode->i_private))
+        return -ENOTBLK;
+
+    // blocks buffered writeback filled are still unwritten until the work gets to them, iomap would zero
+    // the parts of them this write does not cover
+    if (!xa_empty(&YUKIFS_I(inode)->unwritten)) {
+        loff_t pos = iocb->ki_pos;
+        int ret = filemap_write_and_wait_range(inode->i_mapping, pos, pos + iov_iter_count(from) - 1);
+        if (!ret)
+            ret = yukifs_unwritten_convert(inode, true);
+        if (ret)
+            return ret;
     }
-    kfree(inode_table);
 
-    // update superblock
-    sbi->block_free = sbi->block_count;
-    sbi->free_inodes = sbi->total_inodes;
+    // the new size is set at completion, keep that under the inode lock by not letting the write go async
+    if (iocb->ki_pos + iov_iter_count(from) > i_size_read(inode))
+        dio_flags |= IOMAP_DIO_FORCE_WAIT;
 
-    for (uint32_t i = 0; i < inode_index_list_size; i++) {
-        if (((struct file_object*)inode_table)[i].in_use == 1)
-        {
-            //struct file_object *ffo = &(((struct file_object *)inode_table)[i]);
-            sbi->free_inodes -= 1;
-            sbi->block_free -= 1; // assume each inode takes 1 block , later will be changed to real size
-        }
+    return iomap_dio_rw(iocb, from, &yukifs_iomap_ops, &yukifs_dio_write_ops, dio_flags, NULL, 0);
+}
+
+#pragma endregion
+
+#pragma region Preallocation
+
+// write zeros over pos..pos+len through the page cache, for the partial blocks at the edges of a zeroed range
+static int yukifs_zero_partial(struct file *file, loff_t pos, loff_t len)
+{
+    struct kiocb kiocb;
+    struct iov_iter iter;
+    struct bio_vec bvec;
+
+    init_sync_kiocb(&kiocb, file);
+    kiocb.ki_pos = pos;
+
+    while (len > 0) {
+        size_t chunk = min_t(loff_t, len, PAGE_SIZE);
+        ssize_t ret;
+
+        bvec_set_page(&bvec, ZERO_PAGE(0), chunk, 0);
+        iov_iter_bvec(&iter, ITER_SOURCE, &bvec, 1, chunk);
+
+        ret = generic_perform_write(&kiocb, &iter);
+        if (ret < 0)
+            return ret;
+        #if LINUX_VERSION_CODE < KERNEL_VERSION(6,4,0)
+            kiocb.ki_pos += ret;
+        #endif
+        len -= ret;
     }
 
-    // write superblock back to disk
-    // superblock is always before the inode table
-    if(yukifs_blocks_write(sb, inode_block_nr - 1, 1, (char *)sbi))
-    {
-        printk(KERN_ERR "YukiFS: Error writing superblock\n");
-        return -EIO;
-    }   
+    return 0;
+}
+
+// map every hole in first..last as unwritten extents, mapped blocks are left alone, each run is its own handle
+static int yukifs_prealloc(struct inode *inode, uint32_t first, uint32_t last)
+{
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    struct yukifs_extent ext;
+    uint32_t lblk = first;
+
+    while (lblk <= last) {
+        struct yukifs_handle handle = yukifs_extent_write_lock(inode, YUKIFS_JOURNAL_MAP_CREDITS);
+        int ret = yukifs_extent_lookup(inode->i_sb, fo, lblk, &ext);
+        if (ret == 0) {
+            lblk = ext.logical_block + ext.length;
+        } else if (ret == -ENOENT) {
+            ret = yukifs_alloc_run(inode, lblk, min_t(uint32_t, ext.length, last - lblk + 1), YUKIFS_EXTENT_UNWRITTEN, &ext);
+            if (!ret)
+                lblk += ext.length;
+        }
+        yukifs_extent_write_unlock(inode, handle);
+        if (ret)
+            return ret;
+    }
 
     return 0;
 }
 
+// preallocate offset..offset+len as unwritten extents, FALLOC_FL_ZERO_RANGE also makes what is already
+// there read back as zeros, the partial blocks at its edges are zeroed through the page cache
+static long yukifs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    uint8_t blkbits = inode->i_blkbits;
+    loff_t end = offset + len;
+    long ret;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_ZERO_RANGE))
+        return -EOPNOTSUPP;
+
+    if (((end - 1) >> blkbits) >= UINT32_MAX)
+        return -EFBIG;
+
+    inode_lock(inode);
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+        ret = inode_newsize_ok(inode, end);
+        if (ret)
+            goto out;
+    }
+
+    ret = file_modified(file);
+    if (ret)
+        goto out;
+
+    // a direct write still in flight must not land in blocks the range is about to unwrite
+    inode_dio_wait(inode);
+
+    // writeback gives a compressed file new blocks for every cluster it writes, so there is nothing to keep for it
+    if (yukifs_has_compressed_data(fo)) {
+        ret = -EOPNOTSUPP;
+        goto out;
+    }
+
+    // preallocation is about blocks, which an inline file does not have yet
+    filemap_invalidate_lock(inode->i_mapping);
+    ret = yukifs_inline_convert_inode(inode);
+    filemap_invalidate_unlock(inode->i_mapping);
+    if (ret)
+        goto out;
+
+    uint32_t first = offset >> blkbits;
+    uint32_t last = (end - 1) >> blkbits;
+
+    if (mode & FALLOC_FL_ZERO_RANGE) {
+        loff_t size = i_size_read(inode);
+        loff_t head = round_up(offset, sb->s_blocksize);
+        loff_t tail = round_down(end, sb->s_blocksize);
+
+        // only bytes below the size can be read back, the rest of a partial block is zeroed by whatever extends the file
+        if (head > offset && offset < size) {
+            ret = yukifs_zero_partial(file, offset, min3(head, end, size) - offset);
+            if (ret)
+                goto out;
+        }
+        if (tail < end && tail >= head && tail < size) {
+            ret = yukifs_zero_partial(file, tail, min(end, size) - tail);
+            if (ret)
+                goto out;
+        }
+
+        ret = filemap_write_and_wait_range(inode->i_mapping, offset, end - 1);
+        if (ret)
+            goto out;
+    }
+
+    // write faults must not allocate into the range while its extents change
+    filemap_invalidate_lock(inode->i_mapping);
+
+    if ((mode & FALLOC_FL_ZERO_RANGE) && round_up(offset, sb->s_blocksize) < round_down(end, sb->s_blocksize)) {
+        uint32_t full_first = DIV_ROUND_UP(offset, sb->s_blocksize);
+        uint32_t full_last = (end >> blkbits) - 1;
+
+        truncate_pagecache_range(inode, (loff_t)full_first << blkbits, ((loff_t)(full_last + 1) << blkbits) - 1);
+        // blocks waiting for conversion would turn back into written ones behind our back
+        yukifs_unwritten_forget(inode, full_first, full_last);
+        ret = yukifs_convert_range(inode, full_first, full_last, YUKIFS_EXTENT_UNWRITTEN);
+    }
+
+    if (!ret)
+        ret = yukifs_prealloc(inode, first, last);
+
+    filemap_invalidate_unlock(inode->i_mapping);
+
+    if (ret)
+        goto out;
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > i_size_read(inode)) {
+        i_size_write(inode, end);
+
+        struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_INODE_CREDITS);
+        fo->size = end;
+        ret = yukifs_update_statfs(sb, fo);
+        yukifs_journal_stop(sb, handle);
+    }
+
+out:
+    inode_unlock(inode);
+    return ret;
+}
+
 #pragma endregion
 
 #pragma region File Operation Callback Structures
@@ -719,8 +1467,8 @@ static int yukifs_update_statfs(struct super_block *sb, struct file_object *fo)
 struct inode_operations yukifs_dir_inode_operations = {
     .lookup = yukifs_lookup,
     .create = yukifs_create,
-    .mkdir = NULL,
-    .rmdir = NULL,  
+    .mkdir = yukifs_mkdir,
+    .rmdir = yukifs_rmdir,
     .link = NULL,
     .unlink = yukifs_unlink, 
     .getattr = yukifs_getattr,
@@ -729,60 +1477,98 @@ struct inode_operations yukifs_dir_inode_operations = {
 struct inode_operations yukifs_file_inode_operations = {
     .unlink = yukifs_unlink, 
     .getattr = yukifs_getattr,
+    .setattr = yukifs_setattr,
+    .fileattr_get = yukifs_fileattr_get,
+    .fileattr_set = yukifs_fileattr_set,
 };
 
 struct file_operations yukifs_file_ops = {
     .owner = THIS_MODULE,
     .open = yukifs_open,
-    .read = yukifs_read,
-    .write = yukifs_write,
+    .llseek = generic_file_llseek,
+    .read_iter = yukifs_file_read_iter,
+    .write_iter = yukifs_file_write_iter,
+    // sendfile and splice move page cache pages without a copy through user memory
+    #if LINUX_VERSION_CODE < KERNEL_VERSION(6,5,0)
+        .splice_read = generic_file_splice_read,
+    #else
+        .splice_read = filemap_splice_read,
+    #endif
+    .splice_write = iter_file_splice_write,
+    .mmap = yukifs_file_mmap,
+    .fallocate = yukifs_fallocate,
+    .fsync = yukifs_fsync,
     .release = yukifs_release,
 };
 
+const struct address_space_operations yukifs_aops = {
+    .read_folio = yukifs_read_folio,
+    .readahead = yukifs_readahead,
+    .writepages = yukifs_writepages,
+    .write_begin = yukifs_write_begin,
+    .write_end = yukifs_write_end,
+    .bmap = yukifs_bmap,
+    .dirty_folio = block_dirty_folio,
+    .invalidate_folio = block_invalidate_folio,
+    .migrate_folio = buffer_migrate_folio,
+};
+
 struct file_operations yukifs_dir_ops = {
     .owner = THIS_MODULE,    
     .open = generic_file_open,
     .release = yukifs_release,
-    .llseek = generic_file_llseek, 
+    .llseek = yukifs_dir_llseek,
     .iterate_shared = yukifs_iterate_shared,   
+    .fsync = yukifs_fsync,
 };
 
 #pragma endregion
 
-static struct inode *yukifs_make_inode(struct super_block *sb, struct file_object *fo)
-{
-    printk(KERN_INFO "YukiFS: make_inode ffo->name %s ffo->size %d ffo->descriptor %o\n", fo->name, fo->size,fo->descriptor);
-    struct inode *inode = new_inode(sb);
-    if (inode) {
-        inode->i_mode = fo->descriptor;
-        inode->i_uid.val = 0;
-        inode->i_gid.val = 0;
-        inode->i_size = fo->size;
-        inode->i_blocks = inode->i_size / sb->s_blocksize;
-        #if LINUX_VERSION_CODE < KERNEL_VERSION(6,11,0)
-            inode->__i_atime = inode->__i_mtime = inode->__i_ctime = current_time(inode);
-        #else
-            struct timespec64 ts=current_time(inode);
-            inode->i_atime_sec = inode->i_mtime_sec = inode->i_ctime_sec = ts.tv_sec;
-            inode->i_atime_nsec = inode->i_mtime_nsec = inode->i_ctime_nsec = ts.tv_nsec;
-        #endif
-        inode->i_ino = 9854 + fo->first_block;
-        if (S_ISDIR(inode->i_mode)) {
-            inode->i_op = &yukifs_dir_inode_operations;
-            inode->i_fop = &yukifs_dir_ops;
-            // Initialize directory specific stuff if needed
-        } else if (S_ISREG(inode->i_mode)) {
-            inode->i_op = &yukifs_file_inode_operations; // You'll need to create this
-            inode->i_fop = &yukifs_file_ops;
-            // Initialize file specific stuff (e.g., first block)
-        } else {
-            printk(KERN_ERR "YukiFS: Unknown inode type\n");
-            iput(inode);
-            return NULL;
-        }
-        inode->i_private = fo;
+// the VFS inode of inode table record index, only the first user fills it in from the record
+static struct inode *yukifs_iget(struct super_block *sb, uint32_t index)
+{
+    struct file_object *fo = yukifs_inode_get(sb, index);
+    if (!fo || !fo->in_use)
+        return ERR_PTR(-EUCLEAN);
+
+    struct inode *inode = iget_locked(sb, yukifs_ino(index));
+    if (!inode)
+        return ERR_PTR(-ENOMEM);
+    if (!(inode->i_state & I_NEW))
+        return inode;
+
+    yukifs_debug("iget ffo->name %s ffo->size %d ffo->descriptor %o\n", fo->name, fo->size,fo->descriptor);
+    inode->i_mode = fo->descriptor;
+    inode->i_uid.val = 0;
+    inode->i_gid.val = 0;
+    inode->i_size = fo->size;
+    inode->i_blocks = inode->i_size / sb->s_blocksize;
+    // records written before link counts were kept have 0 here
+    set_nlink(inode, fo->links ? fo->links : (S_ISDIR(fo->descriptor) ? 2 : 1));
+    #if LINUX_VERSION_CODE < KERNEL_VERSION(6,11,0)
+        inode->__i_atime = inode->__i_mtime = inode->__i_ctime = current_time(inode);
+    #else
+        struct timespec64 ts=current_time(inode);
+        inode->i_atime_sec = inode->i_mtime_sec = inode->i_ctime_sec = ts.tv_sec;
+        inode->i_atime_nsec = inode->i_mtime_nsec = inode->i_ctime_nsec = ts.tv_nsec;
+    #endif
+    if (S_ISDIR(inode->i_mode)) {
+        inode->i_op = &yukifs_dir_inode_operations;
+        inode->i_fop = &yukifs_dir_ops;
+        // Initialize directory specific stuff if needed
+    } else if (S_ISREG(inode->i_mode)) {
+        inode->i_op = &yukifs_file_inode_operations; // You'll need to create this
+        inode->i_fop = &yukifs_file_ops;
+        inode->i_mapping->a_ops = &yukifs_aops;
+    } else {
+        printk(KERN_ERR "YukiFS: Unknown inode type\n");
+        iget_failed(inode);
+        return ERR_PTR(-EUCLEAN);
     }
+    // the record lives in the mount-resident inode table for as long as the filesystem is mounted
+    inode->i_private = fo;
 
+    unlock_new_inode(inode);
     return inode;
 }
 
@@ -791,34 +1577,11 @@ int yukifs_init_root(struct super_block *sb)
     struct inode *root;
     struct dentry *root_dentry;
 
-    // read root inode from the device inode table then create a dentry for it
-    struct superblock_info *sbi = sb->s_fs_info;
-    uint32_t inode_table_offset = sbi->inode_table_offset; 
-    uint32_t inode_size = sizeof(struct file_object);
-
-    struct file_object *root_fo = kmalloc(inode_size, GFP_KERNEL);
-    if (!root_fo)
-        return -ENOMEM;
-
-    loff_t offset = inode_table_offset;
-    sector_t block_nr = offset / sb->s_blocksize;
-    unsigned int block_offset = offset % sb->s_blocksize;
-    struct buffer_head *bh;
-
-    bh = sb_bread(sb, block_nr);
-    if (!bh) {
-        printk(KERN_ERR "YukiFS: Error reading root inode block\n");
-        kfree(root_fo);
-        return -EIO;
-    }
-
-    memcpy(root_fo, bh->b_data + block_offset, inode_size);
-    brelse(bh);
-
-    root = yukifs_make_inode(sb,root_fo);
-    if (!root) {
+    // root inode is always the first record of the inode table
+    root = yukifs_iget(sb, 0);
+    if (IS_ERR(root)) {
         printk(KERN_ERR "YukiFS: inode allocation failed\n");
-        return -ENOMEM;
+        return PTR_ERR(root);
     }
 
     root_dentry = d_make_root(root);
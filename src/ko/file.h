@@ -13,16 +13,34 @@
 #include <linux/time64.h>
 #include <linux/version.h>
 #include <linux/kernel.h>
+#include <linux/pagemap.h>
+#include <linux/mpage.h>
+#include <linux/writeback.h>
+#include <linux/uio.h>
+#include <linux/iomap.h>
+#include <linux/fileattr.h>
 
 #include "../../include/internal.h"
 #include "../../include/version.h"
 #include "../../include/file_table.h"
 #include "misc.h"
+#include "extent.h"
+#include "dir.h"
+#include "inline.h"
+#include "compress.h"
 
 
 //static int yukifs_open(struct inode *inode, struct file *filp);
 //static ssize_t yukifs_read(struct file *filp, char __user *buf, size_t len, loff_t *offset);
 extern struct file_operations yukifs_file_ops;
+extern const struct address_space_operations yukifs_aops;
+extern int yukifs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create);
 extern int yukifs_init_root(struct super_block *sb);
+extern int yukifs_update_statfs(struct super_block *sb, struct file_object *fo);
+extern int yukifs_truncate_blocks(struct inode *inode, uint32_t from, struct yukifs_handle *handle);
+extern int yukifs_alloc_run(struct inode *inode, uint32_t lblk, uint32_t count, uint16_t flags, struct yukifs_extent *ext);
+extern int yukifs_unwritten_convert(struct inode *inode, bool wait);
+extern void yukifs_unwritten_forget(struct inode *inode, uint32_t first, uint32_t last);
+extern void yukifs_unwritten_work(struct work_struct *work);
 
 #endif
\ No newline at end of file
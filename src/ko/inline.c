@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: MIT
+#include "file.h"
+#include "inline.h"
+
+// the data of an inline file only ever moves under the lock of folio 0, which every path below holds
+
+#pragma region Inline Data
+
+static void yukifs_inline_fill_folio(struct inode *inode, struct folio *folio)
+{
+    struct file_object *fo = (struct file_object *)inode->i_private;
+
+    folio_zero_segment(folio, 0, folio_size(folio));
+    if (folio->index == 0) {
+        char *kaddr = kmap_local_folio(folio, 0);
+        memcpy(kaddr, fo->inline_data, min_t(uint32_t, fo->size, YUKIFS_INLINE_DATA_SIZE));
+        kunmap_local(kaddr);
+    }
+    folio_mark_uptodate(folio);
+}
+
+// write the start of folio 0 straight to block, the block is not in the buffer cache so nothing stale stays behind
+static int yukifs_inline_write_block(struct super_block *sb, struct folio *folio, uint32_t block)
+{
+    struct bio *bio = bio_alloc(sb->s_bdev, 1, REQ_OP_WRITE | REQ_SYNC, GFP_NOFS);
+    int ret;
+
+    bio->bi_iter.bi_sector = yukifs_data_block_nr(sb, block) << (sb->s_blocksize_bits - SECTOR_SHIFT);
+    if (!bio_add_folio(bio, folio, min_t(size_t, folio_size(folio), sb->s_blocksize), 0)) {
+        bio_put(bio);
+        return -EIO;
+    }
+
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+
+    return ret;
+}
+
+// move the data of an inline file to a data block, folio 0 is locked and holds the data,
+// the extent map is held for writing so yukifs_get_block never sees the union half switched
+static int yukifs_inline_convert(struct inode *inode, struct folio *folio)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    uint32_t block;
+    int ret = 0;
+
+    struct yukifs_handle handle = yukifs_extent_write_lock(inode, YUKIFS_JOURNAL_MAP_CREDITS);
+
+    if (fo->size > 0) {
+        ret = yukifs_new_block(sb, fo->first_block, &block);
+        if (ret)
+            goto out;
+
+        // the block holds the data before the record lets go of it, so a crash keeps one copy or the other
+        ret = yukifs_inline_write_block(sb, folio, block);
+        if (ret) {
+            printk(KERN_ERR "YukiFS: Error moving the inline data of %s to block %u\n", fo->name, block);
+            yukifs_free_blocks(sb, block, 1);
+            goto out;
+        }
+    }
+
+    memset(fo->inline_data, 0, sizeof(fo->inline_data));
+    fo->flags &= ~YUKIFS_INODE_INLINE_DATA;
+    fo->extent_count = 0;
+    fo->extent_depth = 0;
+    if (fo->size > 0) {
+        fo->extents[0].logical_block = 0;
+        fo->extents[0].physical_block = block;
+        fo->extents[0].length = 1;
+        fo->extent_count = 1;
+    }
+
+    ret = yukifs_update_statfs(sb, fo);
+
+out:
+    yukifs_extent_write_unlock(inode, handle);
+    return ret;
+}
+
+// read_folio of an inline file, no block I/O at all
+int yukifs_inline_read_folio(struct inode *inode, struct folio *folio)
+{
+    yukifs_inline_fill_folio(inode, folio);
+    folio_unlock(folio);
+
+    return 0;
+}
+
+// 1 with folio 0 locked in *foliop when the write still fits the record, 0 when the caller goes on with
+// blocks, which is also where a write that outgrows the record leaves the file
+int yukifs_inline_write_begin(struct inode *inode, loff_t pos, unsigned len, struct folio **foliop)
+{
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    struct folio *folio;
+    int ret;
+
+    if (!yukifs_has_inline_data(fo))
+        return 0;
+
+    folio = __filemap_get_folio(inode->i_mapping, 0, FGP_WRITEBEGIN, mapping_gfp_mask(inode->i_mapping));
+    if (IS_ERR(folio))
+        return PTR_ERR(folio);
+
+    if (!yukifs_has_inline_data(fo)) {
+        ret = 0;
+        goto out;
+    }
+
+    if (!folio_test_uptodate(folio))
+        yukifs_inline_fill_folio(inode, folio);
+
+    if (pos + len <= YUKIFS_INLINE_DATA_SIZE) {
+        *foliop = folio;
+        return 1;
+    }
+
+    ret = yukifs_inline_convert(inode, folio);
+
+out:
+    folio_unlock(folio);
+    folio_put(folio);
+    return ret;
+}
+
+// copy what the write put in folio 0 into the record, the folio stays clean since there is nothing to write back
+int yukifs_inline_write_end(struct inode *inode, struct folio *folio, loff_t pos, unsigned copied)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+
+    // the record may only change inside a handle, or a commit could log it half written
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_INODE_CREDITS);
+    char *kaddr = kmap_local_folio(folio, 0);
+    memcpy(fo->inline_data + pos, kaddr + pos, copied);
+    kunmap_local(kaddr);
+    if (pos + copied > i_size_read(inode)) {
+        i_size_write(inode, pos + copied);
+        fo->size = pos + copied;
+    }
+    int ret = yukifs_update_statfs(sb, fo);
+    yukifs_journal_stop(sb, handle);
+
+    folio_unlock(folio);
+    folio_put(folio);
+
+    return ret ? ret : copied;
+}
+
+// give the file real blocks, for paths that cannot work on the record, callers hold the invalidate lock
+int yukifs_inline_convert_inode(struct inode *inode)
+{
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    struct folio *folio;
+    int ret = 0;
+
+    if (!yukifs_has_inline_data(fo))
+        return 0;
+
+    folio = __filemap_get_folio(inode->i_mapping, 0, FGP_LOCK | FGP_CREAT, mapping_gfp_mask(inode->i_mapping));
+    if (IS_ERR(folio))
+        return PTR_ERR(folio);
+
+    if (yukifs_has_inline_data(fo)) {
+        if (!folio_test_uptodate(folio))
+            yukifs_inline_fill_folio(inode, folio);
+        ret = yukifs_inline_convert(inode, folio);
+    }
+
+    folio_unlock(folio);
+    folio_put(folio);
+    return ret;
+}
+
+// 1 when an inline file took the new size in its record, 0 when the caller truncates blocks,
+// a size past the record moves the file to blocks first
+int yukifs_inline_truncate(struct inode *inode, loff_t size)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    int ret;
+
+    filemap_invalidate_lock(inode->i_mapping);
+
+    if (!yukifs_has_inline_data(fo)) {
+        ret = 0;
+        goto out;
+    }
+
+    if (size > YUKIFS_INLINE_DATA_SIZE) {
+        ret = yukifs_inline_convert_inode(inode);
+        goto out;
+    }
+
+    truncate_setsize(inode, size);
+
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_INODE_CREDITS);
+    if (size < fo->size)
+        memset(fo->inline_data + size, 0, fo->size - size);
+    fo->size = size;
+    ret = yukifs_update_statfs(sb, fo);
+    yukifs_journal_stop(sb, handle);
+
+    if (!ret)
+        ret = 1;
+
+out:
+    filemap_invalidate_unlock(inode->i_mapping);
+    return ret;
+}
+
+#pragma endregion
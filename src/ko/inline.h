@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: MIT
+#ifndef KO_INLINE_H
+#define KO_INLINE_H
+
+#include "misc.h"
+#include "extent.h"
+
+static inline bool yukifs_has_inline_data(struct file_object *fo)
+{
+    return fo->flags & YUKIFS_INODE_INLINE_DATA;
+}
+
+extern int yukifs_inline_read_folio(struct inode *inode, struct folio *folio);
+extern int yukifs_inline_write_begin(struct inode *inode, loff_t pos, unsigned len, struct folio **foliop);
+extern int yukifs_inline_write_end(struct inode *inode, struct folio *folio, loff_t pos, unsigned copied);
+extern int yukifs_inline_convert_inode(struct inode *inode);
+extern int yukifs_inline_truncate(struct inode *inode, loff_t size);
+
+#endif
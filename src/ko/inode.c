@@ -7,137 +7,340 @@
 #include <linux/namei.h>
 #include <linux/statfs.h>
 #include <linux/buffer_head.h>
+#include <linux/blkdev.h>
 #include <linux/log2.h>
+#include <linux/seq_file.h>
 
 #include "../../include/internal.h"
 #include "../../include/version.h"
 #include "../../include/file_table.h"
 #include "file.h"
 
+static int yukifs_sync_fs(struct super_block *sb, int wait);
+
+static struct kmem_cache *yukifs_inode_cachep;
+
+static void yukifs_inode_init_once(void *obj)
+{
+    struct yukifs_inode_info *ei = obj;
+
+    init_rwsem(&ei->extent_sem);
+    mutex_init(&ei->compress_mutex);
+    mutex_init(&ei->unwritten_mutex);
+    xa_init(&ei->unwritten);
+    INIT_WORK(&ei->unwritten_work, yukifs_unwritten_work);
+    inode_init_once(&ei->vfs_inode);
+}
+
+static struct inode *yukifs_alloc_inode(struct super_block *sb)
+{
+    struct yukifs_inode_info *ei = alloc_inode_sb(sb, yukifs_inode_cachep, GFP_KERNEL);
+
+    if (!ei)
+        return NULL;
+
+    // evict leaves ei->unwritten empty, the mapping starts without errors
+    ei->unwritten_wb_err = 0;
+    return &ei->vfs_inode;
+}
+
+static void yukifs_free_inode(struct inode *inode)
+{
+    kmem_cache_free(yukifs_inode_cachep, YUKIFS_I(inode));
+}
+
 static void yukifs_put_super(struct super_block *sb)
 {
-    printk(KERN_INFO "YukiFS: put_super called\n");
-    printk(KERN_DEBUG "YukiFS super block destroyed\n");
-    printk(KERN_INFO "YukiFS: put_super called done\n");
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+
+    yukifs_debug("put_super called\n");
+
+    // flush whatever inode table blocks are still dirty before the resident copy goes away
+    if (fsi) {
+        if (yukifs_sync_fs(sb, 1) < 0)
+            printk(KERN_ERR "YukiFS: Error writing metadata back on put_super\n");
+
+        destroy_workqueue(fsi->unwritten_wq);
+        yukifs_journal_release(sb);
+        yukifs_bitmaps_release(sb);
+        yukifs_inode_table_release(sb);
+        yukifs_compress_release(sb);
+        kfree(fsi->sbi);
+        kfree(fsi);
+        sb->s_fs_info = NULL;
+    }
+
+    yukifs_debug("super block destroyed\n");
+    yukifs_debug("put_super called done\n");
+}
+
+static void yukifs_evict_inode(struct inode *inode)
+{
+    struct file_object *fo = (struct file_object *)inode->i_private;
+
+    // nothing else writes the pages back once the inode leaves the cache
+    if (inode->i_nlink)
+        filemap_write_and_wait(&inode->i_data);
+
+    // the blocks that writeback filled are converted now, the work must not run on a freed inode
+    cancel_work_sync(&YUKIFS_I(inode)->unwritten_work);
+    if (inode->i_nlink && fo && yukifs_unwritten_convert(inode, true) < 0)
+        printk(KERN_ERR "YukiFS: Error converting unwritten blocks of inode %lu on evict\n", inode->i_ino);
+    yukifs_unwritten_forget(inode, 0, UINT32_MAX);
+
+    // unlinked files just drop their cached pages
+    truncate_inode_pages_final(&inode->i_data);
+
+    // the last reference to an unlinked file gives its blocks and its record back
+    if (!inode->i_nlink && fo) {
+        // a large file takes several transactions, the record goes in the last one
+        struct yukifs_handle handle = yukifs_extent_write_lock(inode, YUKIFS_JOURNAL_TRUNCATE_CREDITS);
+        uint32_t index = yukifs_inode_index(inode->i_sb, fo);
+        // a failed truncate leaves the record on the orphan list for the next mount
+        if (!yukifs_has_inline_data(fo) && yukifs_truncate_blocks(inode, 0, &handle) < 0) {
+            yukifs_extent_write_unlock(inode, handle);
+            goto out;
+        }
+        yukifs_orphan_del(inode->i_sb, index);
+        memset(fo, 0, sizeof(struct file_object));
+        yukifs_free_inode_nr(inode->i_sb, index);
+        yukifs_update_statfs(inode->i_sb, fo);
+        yukifs_extent_write_unlock(inode, handle);
+    }
+
+out:
+    clear_inode(inode);
+
+    // i_private points into the mount-resident inode table, which put_super frees
+    inode->i_private = NULL;
+}
+
+// finish what evict and setattr did not get to before the last mount went down, records nothing links any more
+// are freed along with their blocks, the others lose the blocks past their size
+static int yukifs_orphans_process(struct super_block *sb)
+{
+    struct superblock_info *sbi = YUKIFS_FS(sb)->sbi;
+    int ret = 0;
+
+    while (!ret && sbi->orphan_head) {
+        uint32_t index = sbi->orphan_head;
+        struct file_object *fo = yukifs_inode_get(sb, index);
+
+        if (!fo || !fo->in_use || !(fo->flags & YUKIFS_INODE_ORPHAN)) {
+            printk(KERN_ERR "YukiFS: orphan list names inode %u which is not an orphan, dropping the list\n", index);
+            struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_INODE_CREDITS);
+            sbi->orphan_head = 0;
+            ret = yukifs_super_write(sb);
+            yukifs_journal_stop(sb, handle);
+            break;
+        }
+
+        bool unlinked = !fo->links;
+        uint32_t from = unlinked ? 0 : DIV_ROUND_UP(fo->size, sb->s_blocksize);
+        int more;
+
+        do {
+            struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_TRUNCATE_CREDITS);
+
+            more = yukifs_has_inline_data(fo) ? 0 : yukifs_extent_truncate_step(sb, fo, from, YUKIFS_JOURNAL_TRUNCATE_BUDGET);
+            if (!more) {
+                ret = yukifs_orphan_del(sb, index);
+                if (unlinked) {
+                    memset(fo, 0, sizeof(struct file_object));
+                    yukifs_free_inode_nr(sb, index);
+                }
+            }
+            int err = yukifs_update_statfs(sb, fo);
+            yukifs_journal_stop(sb, handle);
+
+            if (more < 0)
+                ret = more;
+            else if (!ret)
+                ret = err;
+        } while (more > 0 && !ret);
+
+        if (!ret)
+            printk(KERN_INFO "YukiFS: %s orphan inode %u\n", unlinked ? "freed" : "truncated", index);
+    }
+
+    return ret;
+}
+
+static int yukifs_write_inode(struct inode *inode, struct writeback_control *wbc)
+{
+    struct super_block *sb = inode->i_sb;
+    struct file_object *fo = (struct file_object *)inode->i_private;
+    int ret;
+
+    if (!fo)
+        return 0;
+
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_INODE_CREDITS);
+    // setattr_copy only changes the VFS inode, chmod reaches the record here
+    if (fo->in_use)
+        fo->descriptor = inode->i_mode;
+    yukifs_inode_mark_dirty(sb, fo);
+    ret = yukifs_inode_table_sync(sb);
+    yukifs_journal_stop(sb, handle);
+    if (ret)
+        return ret;
+
+    // sync() and fsync() want the record on the device, background writeback leaves it to the commit timer
+    if (wbc->sync_mode == WB_SYNC_ALL)
+        ret = yukifs_journal_commit(sb);
+
+    return ret;
+}
+
+// log the resident metadata and, when asked to wait, commit it
+static int yukifs_sync_fs(struct super_block *sb, int wait)
+{
+    int ret;
+
+    struct yukifs_handle handle = yukifs_journal_start(sb, YUKIFS_JOURNAL_HANDLE_BLOCKS);
+    ret = yukifs_inode_table_sync(sb);
+    if (!ret)
+        ret = yukifs_bitmaps_sync(sb);
+    if (!ret)
+        ret = yukifs_super_write(sb);
+    yukifs_journal_stop(sb, handle);
+    if (ret)
+        return ret;
+
+    if (!wait)
+        return 0;
+
+    // sync() has written every file back by now, the conversions it queued go in the same commit
+    flush_workqueue(YUKIFS_FS(sb)->unwritten_wq);
+
+    return yukifs_journal_commit(sb);
 }
 
 static int yukifs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
-    struct superblock_info *sbi = (struct superblock_info*)dentry->d_sb->s_fs_info;
+    struct yukifs_fs_info *fsi = YUKIFS_FS(dentry->d_sb);
+    struct superblock_info *sbi = fsi->sbi;
+    s64 free_blocks = percpu_counter_sum_positive(&fsi->free_blocks);
 
     buf->f_type = dentry->d_sb->s_magic;
     buf->f_bsize = dentry->d_sb->s_blocksize;
     buf->f_blocks = sbi->block_count; // Total blocks
-    buf->f_bfree = sbi->block_free;   // Free blocks
-    buf->f_bavail = sbi->block_free;  // Available blocks
+    buf->f_bfree = free_blocks;   // Free blocks
+    buf->f_bavail = free_blocks;  // Available blocks
     buf->f_files = sbi->total_inodes;   // Total inodes
-    buf->f_ffree = sbi->free_inodes;    // Free inodes
-    buf->f_namelen = FS_MAX_LEN; // Maximum filename length
+    buf->f_ffree = percpu_counter_sum_positive(&fsi->free_inodes);    // Free inodes
+    buf->f_namelen = YUKIFS_NAME_LEN; // Maximum filename length
+    return 0;
+}
+
+static int yukifs_show_options(struct seq_file *m, struct dentry *root)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(root->d_sb);
+
+    if (fsi->compress)
+        seq_printf(m, ",compress=%s", yukifs_compress_name(fsi->compress));
+    return 0;
+}
+
+// compress=lz4|zstd|none picks what new files are created compressed with, anything else is ignored
+static int yukifs_parse_options(struct super_block *sb, char *options)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    char *opt;
+
+    while ((opt = strsep(&options, ",")) != NULL) {
+        if (strncmp(opt, "compress=", 9))
+            continue;
+
+        int algorithm = yukifs_compress_algorithm(opt + 9);
+        if (algorithm < 0) {
+            printk(KERN_ERR "YukiFS: Unknown compression %s\n", opt + 9);
+            return algorithm;
+        }
+        fsi->compress = algorithm;
+    }
+
     return 0;
 }
 
 static struct super_operations const yukifs_super_ops = {
+    .alloc_inode = yukifs_alloc_inode,
+    .free_inode = yukifs_free_inode,
     .put_super = yukifs_put_super,
+    .write_inode = yukifs_write_inode,
+    .sync_fs = yukifs_sync_fs,
     .statfs = yukifs_statfs,
-    .drop_inode = generic_delete_inode,
+    .show_options = yukifs_show_options,
+    .evict_inode = yukifs_evict_inode,
 };
 
-static int yukifs_fill_super(struct super_block *sb, void *data, int silent)
-{   
+// copy the locator at byte pos of the device to loc, -EINVAL when it is not a usable one
+static int yukifs_locator_read(struct super_block *sb, loff_t pos, struct yukifs_locator *loc)
+{
+    struct buffer_head *bh = sb_bread(sb, pos >> sb->s_blocksize_bits);
+    if (!bh) {
+        printk(KERN_ERR "YukiFS: Error reading superblock locator at %lld\n", pos);
+        return -EIO;
+    }
 
-    printk(KERN_INFO "YukiFS: fill_super called\n");
+    const struct yukifs_locator *disk = (const struct yukifs_locator *)(bh->b_data + (pos & (sb->s_blocksize - 1)));
+    int valid = yukifs_locator_valid(disk);
+    if (valid)
+        memcpy(loc, disk, sizeof(*loc));
 
-    #pragma region Read Headers from devices
+    brelse(bh);
+    return valid ? 0 : -EINVAL;
+}
+
+static int yukifs_fill_super(struct super_block *sb, void *data, int silent)
+{   
 
-    // Read first 16KiB from devices for hidden header
-    unsigned char *hidden_header_buffer;
-    unsigned long header_size = 16 * 1024;
+    yukifs_debug("fill_super called\n");
 
-    hidden_header_buffer = kmalloc(header_size, GFP_KERNEL);
-    if (!hidden_header_buffer) {
-        printk(KERN_ERR "YukiFS: Failed to allocate memory for hidden header\n");
-        return -ENOMEM;
-    }
+    #pragma region Find the superblock
 
-    unsigned long bytes_read = 0;
-    unsigned long offset = 0;
-    unsigned long block_nr = 0;
     struct buffer_head *bh;
     sb_set_blocksize(sb, 1024);
     int block_size = sb_min_blocksize(sb, 1024);
-    
-    for (block_nr = 0; bytes_read < header_size; block_nr++) {
-        bh = sb_bread(sb, block_nr);
-        if (!bh) {
-            printk(KERN_ERR "YukiFS: Error reading block %lu\n", block_nr);
-            
-            return -EIO;
-        }        
-
-        unsigned long read_size = block_size;
-        if (bytes_read + read_size > header_size) {
-            read_size = header_size - bytes_read;
-        }
-
-        memcpy(hidden_header_buffer + offset, bh->b_data, read_size);
-        bytes_read += read_size;
-        offset += read_size;
-        brelse(bh);
-    }
-
-    printk(KERN_DEBUG "YukiFS: Read %lu bytes of hidden header from device\n", bytes_read);  
-
-    #pragma endregion
 
-    #pragma region find and pop the Hidden Header
-    int64_t hidden_data_start = -1;
-    int64_t hidden_data_end = -1;
+    // one read of the first block, the backup at the end of the device only when that copy is damaged
+    struct yukifs_locator locator;
+    int located = yukifs_locator_read(sb, YUKIFS_LOCATOR_OFFSET, &locator);
+    if (located) {
+        loff_t device_size = bdev_nr_bytes(sb->s_bdev);
 
-    for (off_t i = 0; i < bytes_read - 1; ++i) {
-        if (hidden_header_buffer[i] == 0x55 && hidden_header_buffer[i + 1] == 0xAA) {
-            //printk(KERN_DEBUG "YukiFS: Found sequence 0x55AA at offset %ld\n", (long)i);
-            hidden_data_start = i;
-        }
-        if (hidden_header_buffer[i] == 0xAA && hidden_header_buffer[i + 1] == 0x55) {
-            //printk(KERN_DEBUG "YukiFS: Found sequence 0xAA55 at offset %ld\n", (long)i);
-            hidden_data_end = i;
-        }
+        printk(KERN_WARNING "YukiFS: Superblock locator at %u unusable, trying the backup\n", YUKIFS_LOCATOR_OFFSET);
+        if (device_size >= 2 * YUKIFS_LOCATOR_BACKUP_AREA)
+            located = yukifs_locator_read(sb, YUKIFS_LOCATOR_BACKUP_OFFSET(device_size), &locator);
     }
-
-    if (hidden_data_start == -1 || hidden_data_end == -1) {
-        printk(KERN_ERR "YukiFS: Failed to find both hidden data markers (0x55AA and 0xAA55).\n");
-        // Handle the case where the markers are not found.
-        // You might want to return an error or take other appropriate action.
-        return -EINVAL;
-    } else {
-        printk(KERN_DEBUG "YukiFS: Hidden data markers found. Start at %lld, End at %lld.\n",
-               hidden_data_start, hidden_data_end);
+    if (located) {
+        printk(KERN_ERR "YukiFS: No usable superblock locator, not made by this version of mkfs.yukifs\n");
+        return located;
     }
-    #pragma endregion
-
-    #pragma region go for hidden_data
 
-    struct hidden_data_struct *hidden_data = (struct hidden_data_struct *)(hidden_header_buffer + hidden_data_start);  
+    yukifs_debug("Superblock locator version %u, superblock at %llu\n", locator.version, locator.superblock_offset);
 
     #pragma endregion
 
     #pragma region Initialize the superblock
 
-    uint64_t superblock_offset = hidden_data->superblock_offset;
-   
-    // done for hidden data
+    uint64_t superblock_offset = locator.superblock_offset;
 
     // go ahead for superblock reading from devices
     struct superblock_info *sb_info=kmalloc(sizeof(struct superblock_info), GFP_KERNEL);
-    printk(KERN_DEBUG "YukiFS: Reading superblock from device\n");
-    bytes_read = 0;
-    offset = 0;
+    if (!sb_info) {
+        return -ENOMEM;
+    }
+    yukifs_debug("Reading superblock from device\n");
+    unsigned long bytes_read = 0;
+    unsigned long offset = superblock_offset % block_size;
     unsigned long read_size = 0;
 
-    block_nr = superblock_offset / block_size;
+    unsigned long block_nr = superblock_offset / block_size;
     bh = sb_bread(sb, block_nr);
     if (!bh) {
         printk(KERN_ERR "YukiFS: Error reading block %lu\n", block_nr);
+        kfree(sb_info);
         return -EIO;
     }
     read_size = sizeof(struct superblock_info);
@@ -147,32 +350,139 @@ static int yukifs_fill_super(struct super_block *sb, void *data, int silent)
     offset += read_size;
     brelse(bh);
 
-    printk(KERN_DEBUG "YukiFS: Read %lu bytes of superblock from device\n", bytes_read);
+    // everything below is laid out from what the superblock says, so it has to be what mkfs or we wrote
+    if (sb_info->checksum != yukifs_super_csum(sb_info)) {
+        printk(KERN_ERR "YukiFS: Superblock checksum mismatch\n");
+        kfree(sb_info);
+        return -EUCLEAN;
+    }
+
+    yukifs_debug("Read %lu bytes of superblock from device\n", bytes_read);
 
     #pragma endregion
 
     #pragma region pop to superblock VFS
 
+    struct yukifs_fs_info *fsi = kzalloc(sizeof(struct yukifs_fs_info), GFP_KERNEL);
+    if (!fsi) {
+        kfree(sb_info);
+        return -ENOMEM;
+    }
+
+    // keep the superblock a whole block long so it can be written back without reading it again
+    fsi->sbi = kzalloc(sb_info->block_size, GFP_KERNEL);
+    if (!fsi->sbi) {
+        kfree(fsi);
+        kfree(sb_info);
+        return -ENOMEM;
+    }
+    memcpy(fsi->sbi, sb_info, sizeof(struct superblock_info));
+    kfree(sb_info);
+    sb_info = fsi->sbi;
+
     sb->s_blocksize = sb_info->block_size;
     sb->s_blocksize_bits=ilog2(sb_info->block_size);
-    sb->s_fs_info = sb_info;
-    sb->s_maxbytes = MAX_LFS_FILESIZE;
+    sb->s_fs_info = fsi;
+    // extents address 32 bit logical blocks, a file stops short of that so its last cluster ends in range
+    sb->s_maxbytes = (loff_t)YUKIFS_MAX_FILE_BLOCKS * sb_info->block_size;
     sb_set_blocksize(sb, sb_info->block_size);
+    yukifs_compress_init(sb);
+    mutex_init(&fsi->orphan_mutex);
+
+    int parse = yukifs_parse_options(sb, data);
+    if (parse < 0) {
+        kfree(fsi->sbi);
+        kfree(fsi);
+        sb->s_fs_info = NULL;
+        return parse;
+    }
+
+    #pragma endregion
+
+    #pragma region Replay the journal
+
+    // anything the last mount committed but did not write home yet goes there before it is read
+    int journal_load = yukifs_journal_load(sb);
+    if (journal_load < 0) {
+        kfree(fsi->sbi);
+        kfree(fsi);
+        sb->s_fs_info = NULL;
+        return journal_load;
+    }
+
+    // the superblock may have been one of the replayed blocks
+    if (yukifs_blocks_read(sb, sb_info->inode_table_offset / sb_info->block_size - 1, 1, (char *)sb_info) < 0) {
+        printk(KERN_ERR "YukiFS: Error reading superblock after journal replay\n");
+        yukifs_journal_release(sb);
+        kfree(fsi->sbi);
+        kfree(fsi);
+        sb->s_fs_info = NULL;
+        return -EIO;
+    }
+    if (sb_info->checksum != yukifs_super_csum(sb_info)) {
+        printk(KERN_ERR "YukiFS: Superblock checksum mismatch after journal replay\n");
+        yukifs_journal_release(sb);
+        kfree(fsi->sbi);
+        kfree(fsi);
+        sb->s_fs_info = NULL;
+        return -EUCLEAN;
+    }
+
+    #pragma endregion
+
+    #pragma region Load the inode table and bitmaps
+
+    // every later metadata operation works on this copy instead of reading the table again
+    int inode_table_load = yukifs_inode_table_load(sb);
+    if (inode_table_load < 0) {
+        printk(KERN_ERR "YukiFS: Error loading inode table\n");
+        yukifs_journal_release(sb);
+        kfree(fsi->sbi);
+        kfree(fsi);
+        sb->s_fs_info = NULL;
+        return inode_table_load;
+    }
+
+    int bitmaps_load = yukifs_bitmaps_load(sb);
+    if (bitmaps_load < 0) {
+        yukifs_inode_table_release(sb);
+        yukifs_journal_release(sb);
+        kfree(fsi->sbi);
+        kfree(fsi);
+        sb->s_fs_info = NULL;
+        return bitmaps_load;
+    }
 
     #pragma endregion
 
-    #pragma region Free all the temp viariables
+    #pragma region Finish orphans
 
-    kfree(hidden_header_buffer);
+    // a failure leaves the blocks in use until a later mount gets through the list
+    int orphans = yukifs_orphans_process(sb);
+    if (orphans < 0)
+        printk(KERN_ERR "YukiFS: Error processing the orphan list: %d\n", orphans);
 
     #pragma endregion
 
     sb->s_magic = FILESYSTEM_MAGIC_NUMBER;
     sb->s_op = &yukifs_super_ops;
 
-    int ret = yukifs_init_root(sb);
+    // conversions wait on writeback, which reclaim may be waiting on in turn
+    fsi->unwritten_wq = alloc_workqueue("yukifs-unwritten/%s", WQ_MEM_RECLAIM, 0, sb->s_id);
+    int ret = fsi->unwritten_wq ? yukifs_init_root(sb) : -ENOMEM;
+    if (ret) {
+        // put_super only runs once there is a root, so clean up here
+        if (fsi->unwritten_wq)
+            destroy_workqueue(fsi->unwritten_wq);
+        yukifs_journal_release(sb);
+        yukifs_bitmaps_release(sb);
+        yukifs_inode_table_release(sb);
+        kfree(fsi->sbi);
+        kfree(fsi);
+        sb->s_fs_info = NULL;
+    }
     
-    printk(KERN_INFO "YukiFS: fill_super called done\n");
+    yukifs_debug("fill_super called done\n");
 
     return 0 | ret;
 }
@@ -195,13 +505,27 @@ static struct file_system_type yukifs_type = {
 
 static int __init yukifs_init(void)
 {
+    yukifs_inode_cachep = kmem_cache_create("yukifs_inode_cache", sizeof(struct yukifs_inode_info), 0,
+        SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT, yukifs_inode_init_once);
+    if (!yukifs_inode_cachep)
+        return -ENOMEM;
+
+    int ret = register_filesystem(&yukifs_type);
+    if (ret) {
+        kmem_cache_destroy(yukifs_inode_cachep);
+        return ret;
+    }
+
     printk(KERN_DEBUG "YukiFS module loaded\n");
-    return register_filesystem(&yukifs_type);
+    return 0;
 }
 
 static void __exit yukifs_exit(void)
 {
     unregister_filesystem(&yukifs_type);
+    // inodes are freed after an RCU grace period, let the last of them go before the cache does
+    rcu_barrier();
+    kmem_cache_destroy(yukifs_inode_cachep);
     printk(KERN_DEBUG "YukiFS module unloaded\n");
 }
 
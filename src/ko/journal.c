@@ -0,0 +1,659 @@
+// SPDX-License-Identifier: MIT
+#include "journal.h"
+#include "alloc.h"
+#include <linux/bio.h>
+#include <linux/sched/mm.h>
+#include <linux/wait_bit.h>
+
+static inline struct yukifs_journal *YUKIFS_JOURNAL(struct super_block *sb)
+{
+    return YUKIFS_FS(sb)->journal;
+}
+
+#pragma region Journal I/O
+
+static void yukifs_journal_end_io(struct bio *bio)
+{
+    struct yukifs_journal *j = bio->bi_private;
+
+    if (bio->bi_status)
+        WRITE_ONCE(j->io_status, bio->bi_status);
+
+    if (atomic_dec_and_test(&j->io_pending))
+        complete(&j->io_done);
+
+    bio_put(bio);
+}
+
+// write the contents of src to block, bypassing whatever the buffer cache holds for block
+static void yukifs_journal_submit(struct yukifs_journal *j, sector_t block, struct buffer_head *src)
+{
+    struct super_block *sb = j->sb;
+    struct bio *bio;
+
+    bio = bio_alloc(sb->s_bdev, 1, REQ_OP_WRITE | REQ_SYNC, GFP_NOFS);
+    bio->bi_iter.bi_sector = block << (sb->s_blocksize_bits - SECTOR_SHIFT);
+    bio_add_page(bio, src->b_page, sb->s_blocksize, bh_offset(src));
+    bio->bi_end_io = yukifs_journal_end_io;
+    bio->bi_private = j;
+
+    atomic_inc(&j->io_pending);
+    submit_bio(bio);
+}
+
+// wait for every yukifs_journal_submit since the last wait
+static int yukifs_journal_wait(struct yukifs_journal *j)
+{
+    blk_status_t status;
+
+    if (!atomic_dec_and_test(&j->io_pending))
+        wait_for_completion_io(&j->io_done);
+
+    status = READ_ONCE(j->io_status);
+    j->io_status = BLK_STS_OK;
+    atomic_set(&j->io_pending, 1);
+    reinit_completion(&j->io_done);
+
+    return status == BLK_STS_OK ? 0 : -EIO;
+}
+
+// journal blocks are written through the buffer cache, so replay never reads a stale cached copy,
+// bh is locked and filled in by the caller
+static void yukifs_journal_log_submit(struct buffer_head *bh, blk_opf_t opf)
+{
+    set_buffer_uptodate(bh);
+    clear_buffer_dirty(bh);
+    get_bh(bh);
+    bh->b_end_io = end_buffer_write_sync;
+    submit_bh(REQ_OP_WRITE | REQ_SYNC | opf, bh);
+}
+
+static int yukifs_journal_log_wait(struct buffer_head *bh)
+{
+    wait_on_buffer(bh);
+    return buffer_uptodate(bh) ? 0 : -EIO;
+}
+
+#pragma endregion
+
+#pragma region Replay
+
+// a descriptor with a count of 0 keeps the sequence going without describing anything to replay
+static int yukifs_journal_close(struct yukifs_journal *j)
+{
+    struct yukifs_journal_descriptor *desc;
+    struct buffer_head *bh;
+    int ret;
+
+    bh = sb_getblk(j->sb, j->start);
+    if (!bh)
+        return -EIO;
+
+    lock_buffer(bh);
+    memset(bh->b_data, 0, j->sb->s_blocksize);
+    desc = (struct yukifs_journal_descriptor *)bh->b_data;
+    desc->header.magic = YUKIFS_JOURNAL_DESC_MAGIC;
+    desc->header.sequence = j->sequence - 1;
+
+    // the flush puts everything written so far ahead of the descriptor
+    yukifs_journal_log_submit(bh, REQ_PREFLUSH | REQ_FUA);
+    ret = yukifs_journal_log_wait(bh);
+    brelse(bh);
+
+    return ret;
+}
+
+// copy the last committed transaction to its home blocks, a transaction without its commit block is ignored
+static int yukifs_journal_replay(struct yukifs_journal *j)
+{
+    struct super_block *sb = j->sb;
+    struct superblock_info *sbi = YUKIFS_FS(sb)->sbi;
+    uint32_t last_block = sbi->data_blocks_offset / sbi->block_size + sbi->block_count;
+    struct yukifs_journal_descriptor *desc;
+    struct yukifs_journal_header *commit;
+    struct buffer_head *desc_bh, *commit_bh;
+    int ret = 0;
+
+    desc_bh = sb_bread(sb, j->start);
+    if (!desc_bh)
+        return -EIO;
+
+    desc = (struct yukifs_journal_descriptor *)desc_bh->b_data;
+    if (desc->header.magic != YUKIFS_JOURNAL_DESC_MAGIC) {
+        // never committed to since mkfs
+        brelse(desc_bh);
+        return 0;
+    }
+
+    j->sequence = desc->header.sequence + 1;
+    if (desc->header.count == 0 || desc->header.count > j->capacity) {
+        brelse(desc_bh);
+        return 0;
+    }
+
+    commit_bh = sb_bread(sb, j->start + 1 + desc->header.count);
+    if (!commit_bh) {
+        brelse(desc_bh);
+        return -EIO;
+    }
+
+    commit = (struct yukifs_journal_header *)commit_bh->b_data;
+    if (commit->magic != YUKIFS_JOURNAL_COMMIT_MAGIC || commit->sequence != desc->header.sequence ||
+        commit->count != desc->header.count) {
+        // the crash hit before the commit block, the home blocks still hold the previous transaction
+        printk(KERN_INFO "YukiFS: discarding incomplete journal transaction %llu\n", desc->header.sequence);
+        goto out;
+    }
+
+    printk(KERN_INFO "YukiFS: replaying journal transaction %llu, %u blocks\n", desc->header.sequence, desc->header.count);
+
+    for (uint32_t i = 0; i < desc->header.count; i++) {
+        uint32_t home = desc->blocks[i];
+        struct buffer_head *log_bh, *home_bh;
+
+        if (home >= last_block || (home >= j->start && home < j->start + sbi->journal_clusters)) {
+            printk(KERN_ERR "YukiFS: journal names block %u outside the metadata\n", home);
+            ret = -EUCLEAN;
+            goto out;
+        }
+
+        log_bh = sb_bread(sb, j->start + 1 + i);
+        if (!log_bh) {
+            ret = -EIO;
+            goto out;
+        }
+
+        home_bh = sb_getblk(sb, home);
+        if (!home_bh) {
+            brelse(log_bh);
+            ret = -EIO;
+            goto out;
+        }
+
+        lock_buffer(home_bh);
+        memcpy(home_bh->b_data, log_bh->b_data, sb->s_blocksize);
+        set_buffer_uptodate(home_bh);
+        unlock_buffer(home_bh);
+        mark_buffer_dirty(home_bh);
+
+        brelse(home_bh);
+        brelse(log_bh);
+    }
+
+    ret = sync_blockdev(sb->s_bdev);
+    if (!ret)
+        ret = yukifs_journal_close(j);
+
+out:
+    brelse(commit_bh);
+    brelse(desc_bh);
+    return ret;
+}
+
+#pragma endregion
+
+#pragma region Abort
+
+// stop logging for good once a transaction could not be kept whole, nothing is logged, committed or written home
+// from here on and the volume goes read-only, so the next mount finds the last transaction that made it
+static void yukifs_journal_abort(struct yukifs_journal *j, const char *why)
+{
+    if (xchg(&j->aborted, 1))
+        return;
+
+    printk(KERN_CRIT "YukiFS: journal aborted, %s, remounting read-only\n", why);
+    j->sb->s_flags |= SB_RDONLY;
+}
+
+#pragma endregion
+
+#pragma region Commit
+
+// give the blocks the committing transaction freed to the allocator
+static void yukifs_journal_release_runs(struct yukifs_journal *j)
+{
+    struct yukifs_freed_run *run, *next;
+
+    list_for_each_entry_safe(run, next, &j->committing_freed, list) {
+        yukifs_release_blocks(j->sb, run->block, run->count);
+        list_del(&run->list);
+        kfree(run);
+    }
+}
+
+// log the running transaction, then write its blocks home so the journal can be reused by the next one
+static int yukifs_journal_do_commit(struct yukifs_journal *j)
+{
+    struct super_block *sb = j->sb;
+    struct yukifs_journal_descriptor *desc;
+    struct yukifs_journal_header *commit;
+    uint32_t count;
+    uint64_t sequence;
+    struct blk_plug plug;
+    int ret = 0;
+
+    // wait out the open handles so the snapshot never holds half an operation
+    down_write(&j->barrier);
+
+    if (READ_ONCE(j->aborted)) {
+        up_write(&j->barrier);
+        return -EIO;
+    }
+
+    spin_lock(&j->lock);
+    count = j->running_count;
+    if (count == 0) {
+        spin_unlock(&j->lock);
+        up_write(&j->barrier);
+        return blkdev_issue_flush(sb->s_bdev);
+    }
+
+    // the handles never reserve more than the log holds, see yukifs_journal_dirty
+    sequence = j->sequence++;
+    list_splice_init(&j->freed, &j->committing_freed);
+    memcpy(j->committing, j->running, count * sizeof(struct buffer_head *));
+    j->running_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        set_bit(BH_YukiCheckpoint, &j->committing[i]->b_state);
+        clear_buffer_yuki_journal(j->committing[i]);
+    }
+    spin_unlock(&j->lock);
+
+    for (uint32_t i = 0; i < count + 2; i++) {
+        j->log[i] = sb_getblk(sb, j->start + i);
+        lock_buffer(j->log[i]);
+    }
+
+    desc = (struct yukifs_journal_descriptor *)j->log[0]->b_data;
+    memset(desc, 0, sb->s_blocksize);
+    desc->header.magic = YUKIFS_JOURNAL_DESC_MAGIC;
+    desc->header.count = count;
+    desc->header.sequence = sequence;
+    for (uint32_t i = 0; i < count; i++) {
+        // records are summed here rather than under a handle, where another handle may still be changing them,
+        // the home buffer gets the sums too so a cached copy read back after unmount checks out
+        yukifs_inode_table_csum(sb, j->committing[i]);
+        memcpy(j->log[1 + i]->b_data, j->committing[i]->b_data, sb->s_blocksize);
+        desc->blocks[i] = j->committing[i]->b_blocknr;
+    }
+
+    // new handles only touch the home buffers, the log buffers are what goes to the disk from here on
+    up_write(&j->barrier);
+
+    blk_start_plug(&plug);
+    for (uint32_t i = 0; i < count + 1; i++)
+        yukifs_journal_log_submit(j->log[i], 0);
+    blk_finish_plug(&plug);
+
+    for (uint32_t i = 0; i < count + 1; i++) {
+        if (yukifs_journal_log_wait(j->log[i]))
+            ret = -EIO;
+    }
+
+    // the flush orders the log ahead of the commit block, FUA makes the commit block itself durable
+    commit = (struct yukifs_journal_header *)j->log[count + 1]->b_data;
+    memset(commit, 0, sb->s_blocksize);
+    commit->magic = YUKIFS_JOURNAL_COMMIT_MAGIC;
+    commit->count = count;
+    commit->sequence = sequence;
+    if (ret) {
+        unlock_buffer(j->log[count + 1]);
+        goto fail;
+    }
+
+    yukifs_journal_log_submit(j->log[count + 1], REQ_PREFLUSH | REQ_FUA);
+    ret = yukifs_journal_log_wait(j->log[count + 1]);
+    if (ret)
+        goto fail;
+
+    j->committed = sequence;
+
+    // nothing the disk will ever replay maps the freed blocks any more
+    yukifs_journal_release_runs(j);
+
+    // checkpoint from the log, the home buffers may already carry changes of the next transaction
+    blk_start_plug(&plug);
+    for (uint32_t i = 0; i < count; i++)
+        yukifs_journal_submit(j, j->committing[i]->b_blocknr, j->log[1 + i]);
+    blk_finish_plug(&plug);
+
+    ret = yukifs_journal_wait(j);
+    if (!ret)
+        ret = blkdev_issue_flush(sb->s_bdev);
+    if (ret)
+        goto fail;
+
+    for (uint32_t i = 0; i < count; i++) {
+        struct buffer_head *bh = j->committing[i];
+
+        clear_bit_unlock(BH_YukiCheckpoint, &bh->b_state);
+        smp_mb__after_atomic();
+        wake_up_bit(&bh->b_state, BH_YukiCheckpoint);
+        brelse(bh);
+    }
+
+    for (uint32_t i = 0; i < count + 2; i++)
+        brelse(j->log[i]);
+
+    return 0;
+
+fail:
+    printk(KERN_ERR "YukiFS: Error committing journal transaction %llu: %d\n", sequence, ret);
+
+    // writing the blocks home unlogged could tear an operation in half, the log keeps whatever made it there
+    yukifs_journal_abort(j, "a transaction could not be written");
+    for (uint32_t i = 0; i < count; i++) {
+        struct buffer_head *bh = j->committing[i];
+
+        clear_bit_unlock(BH_YukiCheckpoint, &bh->b_state);
+        smp_mb__after_atomic();
+        wake_up_bit(&bh->b_state, BH_YukiCheckpoint);
+        brelse(bh);
+    }
+
+    for (uint32_t i = 0; i < count + 2; i++)
+        brelse(j->log[i]);
+
+    return ret;
+}
+
+// make every change of handles already stopped durable, callers arriving during a commit share the next one
+int yukifs_journal_commit(struct super_block *sb)
+{
+    struct yukifs_journal *j = YUKIFS_JOURNAL(sb);
+    uint64_t target;
+    int ret = 0;
+
+    if (!j) {
+        ret = sync_blockdev(sb->s_bdev);
+        if (ret)
+            return ret;
+        return blkdev_issue_flush(sb->s_bdev);
+    }
+
+    if (READ_ONCE(j->aborted))
+        return -EIO;
+
+    spin_lock(&j->lock);
+    target = j->sequence;
+    spin_unlock(&j->lock);
+
+    mutex_lock(&j->commit_mutex);
+    if (j->committed < target)
+        ret = yukifs_journal_do_commit(j);
+    mutex_unlock(&j->commit_mutex);
+
+    return ret;
+}
+
+static void yukifs_journal_commit_work(struct work_struct *work)
+{
+    struct yukifs_journal *j = container_of(to_delayed_work(work), struct yukifs_journal, commit_work);
+
+    yukifs_journal_commit(j->sb);
+}
+
+#pragma endregion
+
+#pragma region Handles
+
+// open a handle around one metadata operation that changes at most credits blocks, the running transaction
+// is committed first when it has no room left for them
+struct yukifs_handle yukifs_journal_start(struct super_block *sb, unsigned int credits)
+{
+    struct yukifs_journal *j = YUKIFS_JOURNAL(sb);
+    struct yukifs_handle handle = { .credits = credits };
+
+    // reclaim must not re-enter the filesystem while a commit may be waiting on this handle
+    handle.nofs = memalloc_nofs_save();
+
+    if (!j)
+        return handle;
+
+    // no transaction could ever take the handle, see yukifs_journal_max_credits
+    if (WARN_ON_ONCE(credits > j->capacity))
+        yukifs_journal_abort(j, "a handle reserved more blocks than the log holds");
+
+    for (;;) {
+        down_read(&j->barrier);
+
+        spin_lock(&j->lock);
+        // an aborted journal logs nothing, so there is nothing to reserve room for
+        if (READ_ONCE(j->aborted)) {
+            handle.credits = 0;
+            spin_unlock(&j->lock);
+            return handle;
+        }
+        if (j->running_count + j->reserved + handle.credits <= j->capacity) {
+            j->reserved += handle.credits;
+            spin_unlock(&j->lock);
+            return handle;
+        }
+        spin_unlock(&j->lock);
+
+        // the running transaction is full, commit it and try again
+        up_read(&j->barrier);
+        yukifs_journal_commit(sb);
+    }
+}
+
+// most credits a handle may ask for, mount makes sure YUKIFS_JOURNAL_HANDLE_BLOCKS always fit
+unsigned int yukifs_journal_max_credits(struct super_block *sb)
+{
+    struct yukifs_journal *j = YUKIFS_JOURNAL(sb);
+
+    return j ? j->capacity : UINT_MAX;
+}
+
+void yukifs_journal_stop(struct super_block *sb, struct yukifs_handle handle)
+{
+    struct yukifs_journal *j = YUKIFS_JOURNAL(sb);
+
+    if (j) {
+        spin_lock(&j->lock);
+        j->reserved -= handle.credits;
+        spin_unlock(&j->lock);
+
+        up_read(&j->barrier);
+    }
+
+    memalloc_nofs_restore(handle.nofs);
+}
+
+// add a changed metadata block to the running transaction instead of marking it dirty
+void yukifs_journal_dirty(struct super_block *sb, struct buffer_head *bh)
+{
+    struct yukifs_journal *j = YUKIFS_JOURNAL(sb);
+    bool first;
+
+    if (!j) {
+        mark_buffer_dirty(bh);
+        return;
+    }
+
+    spin_lock(&j->lock);
+
+    if (buffer_yuki_journal(bh) || READ_ONCE(j->aborted)) {
+        spin_unlock(&j->lock);
+        return;
+    }
+
+    // the open handles reserved no more than the log holds, so a full transaction means one of them changed
+    // more blocks than its credits say, committing part of it would tear that operation in half
+    if (WARN_ON_ONCE(j->running_count == j->capacity)) {
+        spin_unlock(&j->lock);
+        printk(KERN_CRIT "YukiFS: journal transaction overran its %u blocks at block %llu\n", j->capacity,
+            (unsigned long long)bh->b_blocknr);
+        yukifs_journal_abort(j, "a handle changed more blocks than it reserved");
+        return;
+    }
+
+    set_buffer_yuki_journal(bh);
+    get_bh(bh);
+    j->running[j->running_count++] = bh;
+    first = j->running_count == 1;
+
+    spin_unlock(&j->lock);
+
+    if (first)
+        schedule_delayed_work(&j->commit_work, YUKIFS_JOURNAL_COMMIT_INTERVAL);
+}
+
+// keep count data blocks from block, freed under a handle, allocated until the running transaction is on the disk,
+// a run right next to the last one freed joins it
+void yukifs_journal_defer_free(struct super_block *sb, uint32_t block, uint32_t count)
+{
+    struct yukifs_journal *j = YUKIFS_JOURNAL(sb);
+    struct yukifs_freed_run *run;
+
+    spin_lock(&j->lock);
+    if (!list_empty(&j->freed)) {
+        run = list_last_entry(&j->freed, struct yukifs_freed_run, list);
+        if (run->block + run->count == block || block + count == run->block) {
+            run->block = min(run->block, block);
+            run->count += count;
+            spin_unlock(&j->lock);
+            return;
+        }
+    }
+    spin_unlock(&j->lock);
+
+    // the free already happened in memory, it cannot fail here
+    run = kmalloc(sizeof(*run), GFP_NOFS | __GFP_NOFAIL);
+    run->block = block;
+    run->count = count;
+
+    spin_lock(&j->lock);
+    list_add_tail(&run->list, &j->freed);
+    spin_unlock(&j->lock);
+}
+
+// drop a freed metadata block, once this returns no copy of it will be written home any more
+void yukifs_journal_forget(struct super_block *sb, struct buffer_head *bh)
+{
+    struct yukifs_journal *j = YUKIFS_JOURNAL(sb);
+
+    if (j) {
+        spin_lock(&j->lock);
+        if (buffer_yuki_journal(bh)) {
+            for (uint32_t i = 0; i < j->running_count; i++) {
+                if (j->running[i] == bh) {
+                    j->running[i] = j->running[--j->running_count];
+                    break;
+                }
+            }
+            clear_buffer_yuki_journal(bh);
+            put_bh(bh);
+        }
+        spin_unlock(&j->lock);
+
+        // a commit still writing the old contents home would race whoever gets the block next
+        wait_on_bit_io(&bh->b_state, BH_YukiCheckpoint, TASK_UNINTERRUPTIBLE);
+    }
+
+    bforget(bh);
+}
+
+#pragma endregion
+
+#pragma region Load and Release
+
+static void yukifs_journal_free(struct yukifs_journal *j)
+{
+    struct yukifs_freed_run *run, *next;
+
+    // only an aborted journal leaves blocks running, or freed blocks pinned
+    for (uint32_t i = 0; i < j->running_count; i++) {
+        clear_buffer_yuki_journal(j->running[i]);
+        brelse(j->running[i]);
+    }
+    list_splice_init(&j->freed, &j->committing_freed);
+    list_for_each_entry_safe(run, next, &j->committing_freed, list)
+        kfree(run);
+
+    kfree(j->log);
+    kfree(j->committing);
+    kfree(j->running);
+    kfree(j);
+}
+
+// replay whatever the last mount committed and set up the running transaction, before any metadata is read
+int yukifs_journal_load(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+    struct yukifs_journal *j;
+    uint32_t per_descriptor = (sbi->block_size - sizeof(struct yukifs_journal_header)) / sizeof(uint32_t);
+    int ret;
+
+    // every fixed reservation fits the smallest log, so no handle can wait for room that never comes
+    BUILD_BUG_ON(YUKIFS_JOURNAL_MKDIR_CREDITS > YUKIFS_JOURNAL_HANDLE_BLOCKS);
+    BUILD_BUG_ON(YUKIFS_JOURNAL_CLUSTER_CREDITS > YUKIFS_JOURNAL_HANDLE_BLOCKS);
+    BUILD_BUG_ON(YUKIFS_JOURNAL_TRUNCATE_BUDGET < 1);
+    BUILD_BUG_ON(YUKIFS_JOURNAL_HANDLE_BLOCKS > (MINIMAL_BLOCK_SIZE - sizeof(struct yukifs_journal_header)) / sizeof(uint32_t));
+
+    // images made before the journal existed have no room reserved for it
+    if (sbi->journal_offset != sbi->block_bitmap_offset + sbi->block_bitmap_clusters * sbi->block_size ||
+        sbi->journal_clusters < YUKIFS_JOURNAL_MIN_BLOCKS) {
+        printk(KERN_ERR "YukiFS: image has no usable journal, recreate it with a newer mkfs\n");
+        return -EINVAL;
+    }
+
+    j = kzalloc(sizeof(struct yukifs_journal), GFP_KERNEL);
+    if (!j)
+        return -ENOMEM;
+
+    j->sb = sb;
+    j->start = sbi->journal_offset / sbi->block_size;
+    j->capacity = min(sbi->journal_clusters - 2, per_descriptor);
+    init_rwsem(&j->barrier);
+    spin_lock_init(&j->lock);
+    INIT_LIST_HEAD(&j->freed);
+    INIT_LIST_HEAD(&j->committing_freed);
+    mutex_init(&j->commit_mutex);
+    INIT_DELAYED_WORK(&j->commit_work, yukifs_journal_commit_work);
+    atomic_set(&j->io_pending, 1);
+    init_completion(&j->io_done);
+    j->sequence = 1;
+
+    j->running = kcalloc(j->capacity, sizeof(struct buffer_head *), GFP_KERNEL);
+    j->committing = kcalloc(j->capacity, sizeof(struct buffer_head *), GFP_KERNEL);
+    j->log = kcalloc(j->capacity + 2, sizeof(struct buffer_head *), GFP_KERNEL);
+    if (!j->running || !j->committing || !j->log) {
+        yukifs_journal_free(j);
+        return -ENOMEM;
+    }
+
+    ret = yukifs_journal_replay(j);
+    if (ret) {
+        printk(KERN_ERR "YukiFS: Error replaying journal: %d\n", ret);
+        yukifs_journal_free(j);
+        return ret;
+    }
+
+    j->committed = j->sequence - 1;
+    fsi->journal = j;
+
+    return 0;
+}
+
+// commit what is left and mark the journal empty so the next mount has nothing to replay
+void yukifs_journal_release(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct yukifs_journal *j = fsi->journal;
+
+    if (!j)
+        return;
+
+    cancel_delayed_work_sync(&j->commit_work);
+
+    // an aborted journal is left as it is for the next mount to replay
+    if (!READ_ONCE(j->aborted) && (yukifs_journal_commit(sb) < 0 || yukifs_journal_close(j) < 0))
+        printk(KERN_ERR "YukiFS: Error closing journal\n");
+
+    fsi->journal = NULL;
+    yukifs_journal_free(j);
+}
+
+#pragma endregion
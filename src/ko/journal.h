@@ -0,0 +1,102 @@
+// SPDX-License-Identifier: MIT
+#ifndef KO_JOURNAL_H
+#define KO_JOURNAL_H
+
+#include "misc.h"
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/list.h>
+
+#define YUKIFS_JOURNAL_HANDLE_BLOCKS (YUKIFS_JOURNAL_MIN_BLOCKS - 2) // most blocks a single handle may reserve
+#define YUKIFS_JOURNAL_COMMIT_INTERVAL (5 * HZ) // changes nobody waits for are committed after this long
+
+// blocks an operation may change, which is what its handle reserves in the running transaction, a handle changing
+// more than it reserved aborts the journal, see yukifs_journal_dirty
+#define YUKIFS_JOURNAL_INODE_CREDITS 2 // a record on its own, its inode table block and a bitmap block
+#define YUKIFS_JOURNAL_EXTENT_CREDITS (3 * YUKIFS_EXTENT_MAX_DEPTH) // extents going in at one place of the map, the tree
+                                                                     // blocks on the path, one split off each of them
+                                                                     // and the bitmap blocks of those
+#define YUKIFS_JOURNAL_MAP_CREDITS (YUKIFS_JOURNAL_EXTENT_CREDITS + 2) // a run of new blocks, the record and the bitmap
+                                                                       // block of the run, see yukifs_new_blocks
+#define YUKIFS_JOURNAL_DIR_CREDITS (YUKIFS_JOURNAL_MAP_CREDITS + 11) // a directory entry and the two leaf splits it may
+                                                                     // take, three leaves, block 0, three new nodes and
+                                                                     // the bitmap blocks of four more directory blocks
+#define YUKIFS_JOURNAL_CREATE_CREDITS (YUKIFS_JOURNAL_DIR_CREDITS + 2) // the entry, the new record and the inode bitmap
+#define YUKIFS_JOURNAL_MKDIR_CREDITS (YUKIFS_JOURNAL_CREATE_CREDITS + 4) // a create plus the index and leaf of the new
+                                                                         // directory and their bitmap blocks
+#define YUKIFS_JOURNAL_UNLINK_CREDITS 5 // the leaf, the index block, both records and the superblock for the orphan list
+#define YUKIFS_JOURNAL_CLUSTER_RUNS 4 // most runs a compressed cluster is written to, see yukifs_cluster_put
+#define YUKIFS_JOURNAL_CLUSTER_CREDITS (2 * YUKIFS_JOURNAL_EXTENT_CREDITS + YUKIFS_JOURNAL_CLUSTER_RUNS + 1)
+    // the record, the bitmap blocks of the new runs and the extent changes around them, what the old cluster
+    // gives back comes on top, see yukifs_cluster_write
+#define YUKIFS_JOURNAL_TRUNCATE_CREDITS YUKIFS_JOURNAL_HANDLE_BLOCKS // one step of a truncate, see yukifs_truncate_blocks
+#define YUKIFS_JOURNAL_TRUNCATE_BUDGET (YUKIFS_JOURNAL_TRUNCATE_CREDITS - YUKIFS_EXTENT_MAX_DEPTH - 4)
+    // bitmap blocks one truncate step may free bits in, the rest is the record, the tree blocks on its path,
+    // the inode bitmap and the superblock and record the orphan list changes
+
+// buffer state bits on metadata blocks, a block is never marked dirty while the journal owns it
+enum yukifs_bh_state_bits {
+    BH_YukiJournal = BH_PrivateStart, // changed in the running transaction
+    BH_YukiCheckpoint, // logged by the committing transaction, home copy not written yet
+    BH_YukiVerified, // checksum checked since the block was read, or set since it was last changed
+};
+
+BUFFER_FNS(YukiJournal, yuki_journal)
+BUFFER_FNS(YukiVerified, yuki_verified)
+
+// data blocks a transaction freed, they stay allocated until it is on the disk, see yukifs_free_blocks
+struct yukifs_freed_run
+{
+    struct list_head list;
+    uint32_t block;
+    uint32_t count;
+};
+
+struct yukifs_journal
+{
+    struct super_block *sb;
+    uint32_t start; // device block of the descriptor
+    uint32_t capacity; // most blocks one transaction may log
+
+    struct rw_semaphore barrier; // handles hold it shared, a commit takes it to snapshot the running transaction
+    spinlock_t lock; // protects running, running_count, freed, reserved and sequence
+    struct buffer_head **running; // blocks changed since the last commit, each holds a reference
+    uint32_t running_count; // never more than capacity, the handles reserve no more than that
+    struct list_head freed; // yukifs_freed_run of the running transaction
+    uint32_t reserved; // blocks promised to open handles
+    uint64_t sequence; // sequence the running transaction will commit under
+    int aborted; // set once for good, see yukifs_journal_abort
+
+    struct mutex commit_mutex; // one commit at a time, protects everything below
+    uint64_t committed; // last sequence known to be on disk
+    struct buffer_head **committing;
+    struct list_head committing_freed; // yukifs_freed_run of the committing transaction
+    struct buffer_head **log; // descriptor, copies of the committing blocks and commit block, in journal order
+    struct delayed_work commit_work;
+
+    atomic_t io_pending; // biased by one while nobody waits
+    struct completion io_done;
+    blk_status_t io_status;
+};
+
+extern int yukifs_journal_load(struct super_block *sb);
+extern void yukifs_journal_release(struct super_block *sb);
+
+// an open handle, pass it back to yukifs_journal_stop
+struct yukifs_handle
+{
+    unsigned int nofs;
+    unsigned int credits; // blocks reserved in the running transaction
+};
+
+extern struct yukifs_handle yukifs_journal_start(struct super_block *sb, unsigned int credits);
+extern unsigned int yukifs_journal_max_credits(struct super_block *sb);
+extern void yukifs_journal_stop(struct super_block *sb, struct yukifs_handle handle);
+extern void yukifs_journal_dirty(struct super_block *sb, struct buffer_head *bh);
+extern void yukifs_journal_forget(struct super_block *sb, struct buffer_head *bh);
+extern void yukifs_journal_defer_free(struct super_block *sb, uint32_t block, uint32_t count);
+extern int yukifs_journal_commit(struct super_block *sb);
+
+#endif
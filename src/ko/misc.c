@@ -1,6 +1,48 @@
 // SPDX-License-Identifier: MIT
 #include "misc.h"
+#include "journal.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+
+#pragma region Debug Logging
+
+#ifdef CONFIG_YUKI_FS_DEBUG
+
+DEFINE_STATIC_KEY_FALSE(yukifs_debug_enabled);
+
+static int yukifs_debug_set(const char *val, const struct kernel_param *kp)
+{
+    bool enable;
+    int ret = kstrtobool(val, &enable);
+    if (ret)
+        return ret;
+
+    if (enable)
+        static_branch_enable(&yukifs_debug_enabled);
+    else
+        static_branch_disable(&yukifs_debug_enabled);
+
+    return 0;
+}
+
+static int yukifs_debug_get(char *buffer, const struct kernel_param *kp)
+{
+    return sysfs_emit(buffer, "%c\n", static_key_enabled(&yukifs_debug_enabled) ? 'Y' : 'N');
+}
+
+static const struct kernel_param_ops yukifs_debug_ops = {
+    .set = yukifs_debug_set,
+    .get = yukifs_debug_get,
+};
+
+module_param_cb(debug, &yukifs_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Log every yukifs operation to the kernel log");
+
+#endif
+
+#pragma endregion
 
 #pragma region Block IO Operations
 
@@ -9,37 +51,92 @@
 /*
 uint32_t yukifs_offset2block(struct super_block *sb, uint32_t offset)
 {
-    struct superblock_info *sbi = sb->s_fs_info;
+    struct superblock_info *sbi = YUKIFS_FS(sb)->sbi;
     uint32_t block_size = sbi->block_size;
     uint32_t block_nr = offset / block_size;
     return block_nr;
 };
 */
 
+static void yukifs_bh_release(struct buffer_head *bhs[], uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+        brelse(bhs[i]);
+}
+
+// read up to YUKIFS_BH_BATCH contiguous blocks, every read is submitted before waiting on the first
+// so the plug merges them into one request
+static int yukifs_blocks_read_batch(struct super_block *sb, uint32_t block_nr, uint32_t block_count, char *buf)
+{
+    struct buffer_head *bhs[YUKIFS_BH_BATCH];
+    uint32_t block_size = sb->s_blocksize;
+    struct blk_plug plug;
+    int ret = 0;
+
+    for (uint32_t i = 0; i < block_count; i++) {
+        bhs[i] = sb_getblk(sb, block_nr + i);
+        if (!bhs[i]) {
+            printk(KERN_ERR "YukiFS: Error reading block %d\n", block_nr + i);
+            yukifs_bh_release(bhs, i);
+            return -EIO;
+        }
+    }
+
+    blk_start_plug(&plug);
+    bh_read_batch(block_count, bhs);
+    blk_finish_plug(&plug);
+
+    for (uint32_t i = 0; i < block_count; i++) {
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i])) {
+            printk(KERN_ERR "YukiFS: Error reading block %d\n", block_nr + i);
+            ret = -EIO;
+            break;
+        }
+        memcpy(buf + i * block_size, bhs[i]->b_data, block_size);
+    }
+
+    yukifs_bh_release(bhs, block_count);
+    return ret;
+}
+
 int yukifs_blocks_read(struct super_block *sb, uint32_t block_nr,uint32_t block_count, char *buf)
 {
-    struct superblock_info *sbi = sb->s_fs_info;
+    struct superblock_info *sbi = YUKIFS_FS(sb)->sbi;
     uint32_t block_size = sbi->block_size;
     
     // no block count check due to module didn't know the real size of the file
 
-    for (uint32_t i = 0; i < block_count; i++) 
+    // start readahead on everything past the first batch so the device sees the range
+    // as a few large requests while the batches below wait on it
+    if (block_count > YUKIFS_BH_BATCH)
     {
-        struct buffer_head *bh;
-        bh = sb_bread(sb, block_nr + i);
-        if (!bh) {
-            printk(KERN_ERR "YukiFS: Error reading block %d\n", block_nr);
-            return -EIO;
-        }
-        memcpy(buf+i * block_size, bh->b_data, block_size);
-        brelse(bh);
+        struct blk_plug plug;
+
+        blk_start_plug(&plug);
+        for (uint32_t i = YUKIFS_BH_BATCH; i < block_count; i++)
+            sb_breadahead(sb, block_nr + i);
+        blk_finish_plug(&plug);
     }
-    return 0;
+
+    int ret = 0;
+    for (uint32_t i = 0; i < block_count; i += YUKIFS_BH_BATCH)
+    {
+        uint32_t count = min_t(uint32_t, block_count - i, YUKIFS_BH_BATCH);
+        ret = yukifs_blocks_read_batch(sb, block_nr + i, count, buf + i * block_size);
+        if (ret < 0)
+            break;
+    }
+
+    trace_yukifs_blocks_read(sb, block_nr, block_count, ret);
+    return ret;
 };
 
+// copy buf into the buffer cache and hand the blocks to the running journal transaction,
+// see yukifs_journal_commit for when they reach the disk
 int yukifs_blocks_write(struct super_block *sb, uint32_t block_nr,uint32_t block_count, char *buf)
 {
-    struct superblock_info *sbi = sb->s_fs_info;
+    struct superblock_info *sbi = YUKIFS_FS(sb)->sbi;
     uint32_t block_size = sbi->block_size;
 
     // no block count check due to module didn't know the real size of the file
@@ -50,13 +147,16 @@ int yukifs_blocks_write(struct super_block *sb, uint32_t block_nr,uint32_t block
             struct buffer_head *bh;
             bh = sb_getblk(sb, block_nr + i);
             if (!bh) {
-                printk(KERN_ERR "YukiFS: Error getting block %d\n", block_nr);
+                printk(KERN_ERR "YukiFS: Error getting block %d\n", block_nr + i);
+                trace_yukifs_blocks_write(sb, block_nr, block_count, -EIO);
                 return -EIO;
             }   
-            memcpy(bh->b_data, buf+i * block_size, block_size);
 
-            set_buffer_dirty(bh);
-            sync_dirty_buffer(bh);
+            lock_buffer(bh);
+            memcpy(bh->b_data, buf+i * block_size, block_size);
+            set_buffer_uptodate(bh);
+            unlock_buffer(bh);
+            yukifs_journal_dirty(sb, bh);
             
             brelse(bh);
         }
@@ -66,6 +166,8 @@ int yukifs_blocks_write(struct super_block *sb, uint32_t block_nr,uint32_t block
         printk(KERN_ERR "YukiFS: Error writing block %d, block count is 0\n", block_nr);
         return -EIO;
     }
+
+    trace_yukifs_blocks_write(sb, block_nr, block_count, 0);
     return 0;
 };
 
@@ -73,7 +175,7 @@ int yukifs_blocks_write(struct super_block *sb, uint32_t block_nr,uint32_t block
 
 int yukifs_inode_table_read(struct super_block *sb, char* inode_table)
 {
-    struct superblock_info *sbi = sb->s_fs_info;
+    struct superblock_info *sbi = YUKIFS_FS(sb)->sbi;
 
     uint32_t inode_table_offset = sbi->inode_table_offset; 
     //uint32_t inode_table_size = sbi->inode_table_storage_size; // use storage size due to whole blocks read
@@ -91,7 +193,7 @@ int yukifs_inode_table_read(struct super_block *sb, char* inode_table)
 
 int yukifs_inode_table_write(struct super_block *sb, char* inode_table)
 {
-    struct superblock_info *sbi = sb->s_fs_info;
+    struct superblock_info *sbi = YUKIFS_FS(sb)->sbi;
 
     uint32_t inode_table_offset = sbi->inode_table_offset; 
     //uint32_t inode_table_size = sbi->inode_table_storage_size; // use storage size due to whole blocks read
@@ -107,26 +209,221 @@ int yukifs_inode_table_write(struct super_block *sb, char* inode_table)
     return 0;
 }
 
-int yukifs_data_blocks_read(struct super_block *sb, struct file_object *fo, char *data_block)
+#pragma region Mount-Resident Inode Table
+
+int yukifs_inode_table_load(struct super_block *sb)
 {
-    struct superblock_info *sbi = sb->s_fs_info;
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
 
-    uint32_t data_blocks_offset = sbi->data_blocks_offset;
-    uint32_t dir_data_block_num = fo->first_block;
+    // read whole blocks, the table is written back a block at a time
+    fsi->inode_table = kvzalloc(sbi->inode_table_storage_size, GFP_KERNEL);
+    if (!fsi->inode_table) {
+        printk(KERN_ERR "YukiFS: Error allocating inode table\n");
+        return -ENOMEM;
+    }
 
-    // read the data blocks from the device data blocks
-    uint32_t data_block_size = sbi->block_size;
-    uint32_t data_block_count = fo->size / sbi->block_size;
-    uint32_t data_block_offset = data_blocks_offset + dir_data_block_num * data_block_size;
-    uint32_t data_block_nr = data_block_offset / data_block_size;
+    fsi->inode_table_dirty = bitmap_zalloc(sbi->inode_table_clusters, GFP_KERNEL);
+    if (!fsi->inode_table_dirty) {
+        kvfree(fsi->inode_table);
+        fsi->inode_table = NULL;
+        return -ENOMEM;
+    }
 
-    
-    if(yukifs_blocks_read(sb, data_block_nr, data_block_count, data_block) < 0)
-    {
-        printk(KERN_ERR "YukiFS: Error reading data block %d\n", data_block_nr);
-        kfree(data_block);
+    spin_lock_init(&fsi->inode_table_lock);
+
+    int inode_table_read = yukifs_inode_table_read(sb, fsi->inode_table);
+    if (inode_table_read < 0) {
+        yukifs_inode_table_release(sb);
+        return inode_table_read;
+    }
+
+    // the table is only read here, so this is the one place a record is checked against its checksum
+    for (uint32_t i = 0; i < sbi->total_inodes; i++) {
+        struct file_object *fo = (struct file_object *)fsi->inode_table + i;
+
+        if (fo->in_use && fo->checksum != yukifs_inode_csum(fo)) {
+            printk(KERN_ERR "YukiFS: checksum mismatch in inode %u\n", i);
+            yukifs_inode_table_release(sb);
+            return -EUCLEAN;
+        }
+    }
+
+    return 0;
+}
+
+void yukifs_inode_table_release(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+
+    bitmap_free(fsi->inode_table_dirty);
+    kvfree(fsi->inode_table);
+    fsi->inode_table_dirty = NULL;
+    fsi->inode_table = NULL;
+}
+
+struct file_object *yukifs_inode_get(struct super_block *sb, uint32_t index)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+
+    if (index >= fsi->sbi->total_inodes) {
+        printk(KERN_ERR "YukiFS: inode index %u out of range\n", index);
+        return NULL;
+    }
+
+    return (struct file_object *)fsi->inode_table + index;
+}
+
+uint32_t yukifs_inode_index(struct super_block *sb, struct file_object *fo)
+{
+    return fo - (struct file_object *)YUKIFS_FS(sb)->inode_table;
+}
+
+// remember the block holding fo so the next sync writes it back
+void yukifs_inode_mark_dirty(struct super_block *sb, struct file_object *fo)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    uint32_t block = ((char *)fo - fsi->inode_table) / fsi->sbi->block_size;
+
+    spin_lock(&fsi->inode_table_lock);
+    __set_bit(block, fsi->inode_table_dirty);
+    spin_unlock(&fsi->inode_table_lock);
+}
+
+// write back only the inode table blocks touched since the last sync, neighbouring dirty blocks go out as one batch
+int yukifs_inode_table_sync(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+    uint32_t inode_block_nr = sbi->inode_table_offset / sbi->block_size;
+    unsigned int start, end;
+
+    for_each_set_bitrange(start, end, fsi->inode_table_dirty, sbi->inode_table_clusters) {
+        spin_lock(&fsi->inode_table_lock);
+        bitmap_clear(fsi->inode_table_dirty, start, end - start);
+        spin_unlock(&fsi->inode_table_lock);
+
+        // the checksums are filled in at commit, see yukifs_inode_table_csum
+        if (yukifs_blocks_write(sb, inode_block_nr + start, end - start, fsi->inode_table + start * sbi->block_size) < 0) {
+            printk(KERN_ERR "YukiFS: Error writing inode table blocks %u-%u\n", start, end - 1);
+            spin_lock(&fsi->inode_table_lock);
+            bitmap_set(fsi->inode_table_dirty, start, end - start);
+            spin_unlock(&fsi->inode_table_lock);
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+// sum the records of bh when it is an inode table block, the journal calls this on the blocks it is about to log
+// while no handle is open, so no record in them is half changed
+void yukifs_inode_table_csum(struct super_block *sb, struct buffer_head *bh)
+{
+    struct superblock_info *sbi = YUKIFS_FS(sb)->sbi;
+    uint32_t inode_block_nr = sbi->inode_table_offset / sbi->block_size;
+
+    if (bh->b_blocknr < inode_block_nr || bh->b_blocknr >= inode_block_nr + sbi->inode_table_clusters)
+        return;
+
+    struct file_object *fo = (struct file_object *)bh->b_data;
+    struct file_object *last = (struct file_object *)(bh->b_data + sbi->block_size);
+    for (; fo < last; fo++)
+        fo->checksum = yukifs_inode_csum(fo);
+}
+
+// fold the per-CPU free counts into the superblock and log it, called at sync and unmount and when the orphan list changes
+int yukifs_super_write(struct super_block *sb)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+
+    sbi->free_inodes = percpu_counter_sum_positive(&fsi->free_inodes);
+    sbi->block_free = percpu_counter_sum_positive(&fsi->free_blocks);
+    sbi->checksum = yukifs_super_csum(sbi);
+
+    // superblock is always before the inode table
+    if (yukifs_blocks_write(sb, sbi->inode_table_offset / sbi->block_size - 1, 1, (char *)sbi) < 0) {
+        printk(KERN_ERR "YukiFS: Error writing superblock\n");
         return -EIO;
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+#pragma endregion
+
+#pragma region Orphan List
+
+// records still holding blocks that nothing links any more, or that a truncate is giving back, hang off the
+// superblock through next_orphan, mount frees or truncates whatever a crash left on the list
+
+// put the record at index on the orphan list, callers hold a journal handle
+int yukifs_orphan_add(struct super_block *sb, uint32_t index)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct file_object *fo = yukifs_inode_get(sb, index);
+    int ret = 0;
+
+    mutex_lock(&fsi->orphan_mutex);
+
+    if (!(fo->flags & YUKIFS_INODE_ORPHAN)) {
+        fo->flags |= YUKIFS_INODE_ORPHAN;
+        fo->next_orphan = fsi->sbi->orphan_head;
+        fsi->sbi->orphan_head = index;
+
+        yukifs_inode_mark_dirty(sb, fo);
+        ret = yukifs_inode_table_sync(sb);
+        if (!ret)
+            ret = yukifs_super_write(sb);
+    }
+
+    mutex_unlock(&fsi->orphan_mutex);
+    return ret;
+}
+
+// take the record at index off the orphan list, callers hold a journal handle
+int yukifs_orphan_del(struct super_block *sb, uint32_t index)
+{
+    struct yukifs_fs_info *fsi = YUKIFS_FS(sb);
+    struct superblock_info *sbi = fsi->sbi;
+    struct file_object *fo = yukifs_inode_get(sb, index);
+    int ret = 0;
+
+    mutex_lock(&fsi->orphan_mutex);
+
+    if (!(fo->flags & YUKIFS_INODE_ORPHAN))
+        goto out;
+
+    if (sbi->orphan_head == index) {
+        sbi->orphan_head = fo->next_orphan;
+        ret = yukifs_super_write(sb);
+    } else {
+        // the list only holds what is open and unlinked or being truncated, walking it is cheap
+        uint32_t prev = sbi->orphan_head;
+        for (uint32_t n = 0; prev && n < sbi->total_inodes; n++) {
+            struct file_object *prev_fo = yukifs_inode_get(sb, prev);
+
+            if (!prev_fo)
+                break;
+            if (prev_fo->next_orphan == index) {
+                prev_fo->next_orphan = fo->next_orphan;
+                yukifs_inode_mark_dirty(sb, prev_fo);
+                break;
+            }
+            prev = prev_fo->next_orphan;
+        }
+    }
+
+    fo->flags &= ~YUKIFS_INODE_ORPHAN;
+    fo->next_orphan = 0;
+    yukifs_inode_mark_dirty(sb, fo);
+    if (!ret)
+        ret = yukifs_inode_table_sync(sb);
+
+out:
+    mutex_unlock(&fsi->orphan_mutex);
+    return ret;
+}
+
+#pragma endregion
@@ -10,10 +10,122 @@
 #include <linux/buffer_head.h>
 #include <linux/log2.h>
 #include <linux/time64.h>
+#include <linux/bitmap.h>
+#include <linux/spinlock.h>
+#include <linux/mm.h>
+#include <linux/blkdev.h>
+#include <linux/percpu_counter.h>
+#include <linux/jump_label.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/xarray.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
 
 #include "../../include/internal.h"
 #include "../../include/version.h"
 #include "../../include/file_table.h"
+#include "../../include/checksum.h"
+
+#define YUKIFS_BH_BATCH 32 // buffer heads submitted together by yukifs_blocks_read
+#define YUKIFS_INO_BASE 9854 // VFS inode number of inode table record 0
+
+// chatty per-operation logging, compiled out without CONFIG_YUKI_FS_DEBUG and switched off by default
+// with it, flip it at runtime through /sys/module/yukifs/parameters/debug
+#ifdef CONFIG_YUKI_FS_DEBUG
+DECLARE_STATIC_KEY_FALSE(yukifs_debug_enabled);
+#define yukifs_debug(fmt, ...) \
+    do { \
+        if (static_branch_unlikely(&yukifs_debug_enabled)) \
+            printk(KERN_DEBUG "YukiFS: " fmt, ##__VA_ARGS__); \
+    } while (0)
+#else
+#define yukifs_debug(fmt, ...) no_printk(KERN_DEBUG "YukiFS: " fmt, ##__VA_ARGS__)
+#endif
+
+struct yukifs_journal;
+
+// one allocation group, a slice of both bitmaps that allocators on other groups never have to wait for
+struct yukifs_group
+{
+    spinlock_t lock; // protects the bits of this group in both bitmaps and everything below
+    uint32_t free_inodes;
+    uint32_t free_blocks;
+    uint32_t inode_hint; // where the next inode search in this group starts
+    uint32_t block_hint; // where the next block search in this group starts when the caller has no goal
+} ____cacheline_aligned_in_smp;
+
+// kinds of codec workspace, each pooled on its own
+enum yukifs_workspace_kind {
+    YUKIFS_WORKSPACE_LZ4, // LZ4 compression state, LZ4 decompresses without one
+    YUKIFS_WORKSPACE_ZSTD, // zstd compression context
+    YUKIFS_WORKSPACE_UNZSTD, // zstd decompression context
+    YUKIFS_WORKSPACE_KINDS,
+};
+
+// idle codec workspaces of one kind, at most one per online CPU is ever allocated, see compress.c
+struct yukifs_workspace_pool
+{
+    spinlock_t lock; // protects idle and count
+    struct list_head idle;
+    unsigned int count; // workspaces allocated, idle or in use
+    wait_queue_head_t wait; // callers waiting for one to come back
+};
+
+// in-memory state of a mounted filesystem, hung off sb->s_fs_info
+struct yukifs_fs_info
+{
+    struct superblock_info *sbi; // superblock as on disk, kept a whole block long so it can be written back as is,
+                                 // its free counts are only brought up to date by yukifs_super_write
+    char *inode_table; // the whole inode table, read once at mount
+    unsigned long *inode_table_dirty; // one bit per inode table block that differs from the disk
+    spinlock_t inode_table_lock; // protects inode_table_dirty
+
+    char *bitmaps; // inode bitmap followed by block bitmap, read once at mount
+    char *inode_bitmap; // points into bitmaps
+    char *block_bitmap; // points into bitmaps
+    unsigned long *bitmaps_dirty; // one bit per bitmap block that differs from the disk
+    char *block_pinned; // one bit per data block freed by a transaction not yet committed, see yukifs_free_blocks
+    struct yukifs_group *groups; // see alloc.c
+    uint32_t group_count;
+    uint32_t group_blocks; // taken from the superblock, or the whole volume for images without groups
+    uint32_t group_inodes;
+    struct percpu_counter free_inodes; // what statfs reports, rebuilt from the bitmaps at mount
+    struct percpu_counter free_blocks;
+
+    struct yukifs_journal *journal; // every metadata block change goes through it, see journal.c
+    struct mutex orphan_mutex; // protects sbi->orphan_head and the next_orphan links, see yukifs_orphan_add
+    struct workqueue_struct *unwritten_wq; // converts what buffered writeback filled, see yukifs_unwritten_work
+
+    uint8_t compress; // YUKIFS_COMPRESS_* new files are created compressed with, 0 leaves them alone,
+                      // set by the compress= mount option
+    struct yukifs_workspace_pool workspaces[YUKIFS_WORKSPACE_KINDS];
+};
+
+static inline struct yukifs_fs_info *YUKIFS_FS(struct super_block *sb)
+{
+    return sb->s_fs_info;
+}
+
+// in-memory state of an inode, the record itself stays in the inode table behind i_private
+// lock order: i_rwsem (parent before child), invalidate_lock, compress_mutex, folio lock, journal handle,
+// extent_sem, then the inode table and allocator spinlocks
+struct yukifs_inode_info
+{
+    struct rw_semaphore extent_sem; // protects the extent map and the move away from inline data,
+                                    // lookups take it shared, anything that changes the map takes it inside a handle
+    struct mutex compress_mutex; // one cluster written back or rewritten at a time, see compress.c
+    struct mutex unwritten_mutex; // one conversion round at a time, see yukifs_unwritten_convert
+    struct xarray unwritten; // blocks of unwritten extents buffered writes filled, converted once written back
+    errseq_t unwritten_wb_err; // writeback errors the last conversion round has seen
+    struct work_struct unwritten_work;
+    struct inode vfs_inode;
+};
+
+static inline struct yukifs_inode_info *YUKIFS_I(struct inode *inode)
+{
+    return container_of(inode, struct yukifs_inode_info, vfs_inode);
+}
 
 //extern uint32_t yukifs_offset2block(struct super_block *sb, uint32_t offset);
 extern int yukifs_blocks_read(struct super_block *sb, uint32_t block_nr,uint32_t block_count, char *buf);
@@ -22,6 +134,30 @@ extern int yukifs_blocks_write(struct super_block *sb, uint32_t block_nr,uint32_
 extern int yukifs_inode_table_read(struct super_block *sb, char* inode_table);
 extern int yukifs_inode_table_write(struct super_block *sb, char* inode_table);
 
-extern int yukifs_data_blocks_read(struct super_block *sb, struct file_object *fo, char *data_block);
+extern int yukifs_inode_table_load(struct super_block *sb);
+extern void yukifs_inode_table_release(struct super_block *sb);
+extern int yukifs_inode_table_sync(struct super_block *sb);
+extern void yukifs_inode_table_csum(struct super_block *sb, struct buffer_head *bh);
+extern struct file_object *yukifs_inode_get(struct super_block *sb, uint32_t index);
+extern uint32_t yukifs_inode_index(struct super_block *sb, struct file_object *fo);
+extern void yukifs_inode_mark_dirty(struct super_block *sb, struct file_object *fo);
+
+extern int yukifs_super_write(struct super_block *sb);
+
+extern int yukifs_orphan_add(struct super_block *sb, uint32_t index);
+extern int yukifs_orphan_del(struct super_block *sb, uint32_t index);
+
+// VFS inode numbers are the inode table index shifted by YUKIFS_INO_BASE
+static inline unsigned long yukifs_ino(uint32_t index)
+{
+    return YUKIFS_INO_BASE + index;
+}
+
+// device block number of a data block, data blocks are counted from data_blocks_offset
+static inline sector_t yukifs_data_block_nr(struct super_block *sb, uint32_t block)
+{
+    struct superblock_info *sbi = YUKIFS_FS(sb)->sbi;
+    return sbi->data_blocks_offset / sbi->block_size + block;
+}
 
 #endif
@@ -0,0 +1,239 @@
+// SPDX-License-Identifier: MIT
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM yukifs
+
+#if !defined(KO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define KO_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+#include "../../include/file_table.h"
+
+#pragma region Read and Write
+
+DECLARE_EVENT_CLASS(yukifs_rw_enter,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+    TP_ARGS(inode, pos, len),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(size_t, len)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->len = len;
+    ),
+    TP_printk("dev %d:%d ino %lu pos %lld len %zu",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->pos, __entry->len)
+);
+
+DEFINE_EVENT(yukifs_rw_enter, yukifs_read_enter,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+    TP_ARGS(inode, pos, len)
+);
+
+DEFINE_EVENT(yukifs_rw_enter, yukifs_write_enter,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len),
+    TP_ARGS(inode, pos, len)
+);
+
+// pos is where the file position ended up, ret the byte count or the error
+DECLARE_EVENT_CLASS(yukifs_rw_exit,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+    TP_ARGS(inode, pos, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d:%d ino %lu pos %lld ret %zd",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->pos, __entry->ret)
+);
+
+DEFINE_EVENT(yukifs_rw_exit, yukifs_read_exit,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+    TP_ARGS(inode, pos, ret)
+);
+
+DEFINE_EVENT(yukifs_rw_exit, yukifs_write_exit,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret),
+    TP_ARGS(inode, pos, ret)
+);
+
+#pragma endregion
+
+#pragma region Directory Operations
+
+// names are cut to what a directory entry can hold, longer ones are refused anyway
+DECLARE_EVENT_CLASS(yukifs_name_enter,
+    TP_PROTO(struct inode *dir, const struct qstr *name),
+    TP_ARGS(dir, name),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __array(char, name, YUKIFS_NAME_LEN + 1)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        memcpy(__entry->name, name->name, min_t(u32, name->len, YUKIFS_NAME_LEN));
+        __entry->name[min_t(u32, name->len, YUKIFS_NAME_LEN)] = '\0';
+    ),
+    TP_printk("dev %d:%d dir %lu name %s",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __entry->name)
+);
+
+DEFINE_EVENT(yukifs_name_enter, yukifs_lookup_enter,
+    TP_PROTO(struct inode *dir, const struct qstr *name),
+    TP_ARGS(dir, name)
+);
+
+DEFINE_EVENT(yukifs_name_enter, yukifs_create_enter,
+    TP_PROTO(struct inode *dir, const struct qstr *name),
+    TP_ARGS(dir, name)
+);
+
+DEFINE_EVENT(yukifs_name_enter, yukifs_unlink_enter,
+    TP_PROTO(struct inode *dir, const struct qstr *name),
+    TP_ARGS(dir, name)
+);
+
+DEFINE_EVENT(yukifs_name_enter, yukifs_mkdir_enter,
+    TP_PROTO(struct inode *dir, const struct qstr *name),
+    TP_ARGS(dir, name)
+);
+
+DEFINE_EVENT(yukifs_name_enter, yukifs_rmdir_enter,
+    TP_PROTO(struct inode *dir, const struct qstr *name),
+    TP_ARGS(dir, name)
+);
+
+// ino is the inode found, created or removed, 0 when there is none
+DECLARE_EVENT_CLASS(yukifs_name_exit,
+    TP_PROTO(struct inode *dir, unsigned long ino, int ret),
+    TP_ARGS(dir, ino, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(unsigned long, ino)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = ino;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d:%d dir %lu ino %lu ret %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __entry->ino, __entry->ret)
+);
+
+DEFINE_EVENT(yukifs_name_exit, yukifs_lookup_exit,
+    TP_PROTO(struct inode *dir, unsigned long ino, int ret),
+    TP_ARGS(dir, ino, ret)
+);
+
+DEFINE_EVENT(yukifs_name_exit, yukifs_create_exit,
+    TP_PROTO(struct inode *dir, unsigned long ino, int ret),
+    TP_ARGS(dir, ino, ret)
+);
+
+DEFINE_EVENT(yukifs_name_exit, yukifs_unlink_exit,
+    TP_PROTO(struct inode *dir, unsigned long ino, int ret),
+    TP_ARGS(dir, ino, ret)
+);
+
+DEFINE_EVENT(yukifs_name_exit, yukifs_mkdir_exit,
+    TP_PROTO(struct inode *dir, unsigned long ino, int ret),
+    TP_ARGS(dir, ino, ret)
+);
+
+DEFINE_EVENT(yukifs_name_exit, yukifs_rmdir_exit,
+    TP_PROTO(struct inode *dir, unsigned long ino, int ret),
+    TP_ARGS(dir, ino, ret)
+);
+
+DECLARE_EVENT_CLASS(yukifs_iterate,
+    TP_PROTO(struct inode *dir, loff_t pos, int ret),
+    TP_ARGS(dir, pos, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(loff_t, pos)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->pos = pos;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d:%d dir %lu pos %lld ret %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __entry->pos, __entry->ret)
+);
+
+DEFINE_EVENT(yukifs_iterate, yukifs_iterate_enter,
+    TP_PROTO(struct inode *dir, loff_t pos, int ret),
+    TP_ARGS(dir, pos, ret)
+);
+
+DEFINE_EVENT(yukifs_iterate, yukifs_iterate_exit,
+    TP_PROTO(struct inode *dir, loff_t pos, int ret),
+    TP_ARGS(dir, pos, ret)
+);
+
+#pragma endregion
+
+#pragma region Block IO
+
+// block is the device block number of the first block of the run
+DECLARE_EVENT_CLASS(yukifs_blocks,
+    TP_PROTO(struct super_block *sb, u32 block, u32 count, int ret),
+    TP_ARGS(sb, block, count, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(u32, block)
+        __field(u32, count)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->block = block;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d:%d block %u count %u ret %d",
+        MAJOR(__entry->dev), MINOR(__entry->dev), __entry->block, __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(yukifs_blocks, yukifs_blocks_read,
+    TP_PROTO(struct super_block *sb, u32 block, u32 count, int ret),
+    TP_ARGS(sb, block, count, ret)
+);
+
+DEFINE_EVENT(yukifs_blocks, yukifs_blocks_write,
+    TP_PROTO(struct super_block *sb, u32 block, u32 count, int ret),
+    TP_ARGS(sb, block, count, ret)
+);
+
+#pragma endregion
+
+#endif
+
+// the kernel build looks for this header next to the sources, see ccflags-y in the Makefile
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
@@ -16,6 +16,7 @@
 
 #include "../../include/version.h"
 #include "../../include/file_table.h"
+#include "../../include/checksum.h"
 #include "../../tools/built-in.h"
 
 const char filesystem_magic_bytes[8]=FILESYSTEM_MAGIC_BYTES;
@@ -160,6 +161,37 @@ void gen_fs_padding_data(unsigned char padding[], size_t size, int device_type)
     }
 }
 
+uint32_t calc_clusters(uint64_t size, uint32_t block_size)
+{
+    return (size + block_size - 1) / block_size;
+}
+
+// journal takes 1/16 of the data blocks within YUKIFS_JOURNAL_MIN_BLOCKS and YUKIFS_JOURNAL_MAX_BLOCKS
+uint32_t calc_journal_clusters(uint32_t x)
+{
+    uint32_t journal_clusters = x / 16;
+    if (journal_clusters < YUKIFS_JOURNAL_MIN_BLOCKS)
+    {
+        journal_clusters = YUKIFS_JOURNAL_MIN_BLOCKS;
+    }
+    if (journal_clusters > YUKIFS_JOURNAL_MAX_BLOCKS)
+    {
+        journal_clusters = YUKIFS_JOURNAL_MAX_BLOCKS;
+    }
+    return journal_clusters;
+}
+
+// bytes taken by the inode table, both bitmaps, the journal and the data blocks of x inodes/blocks
+uint64_t calc_fs_body_size(uint32_t x, uint32_t block_size)
+{
+    uint64_t size = 0;
+    size += (uint64_t)calc_clusters((uint64_t)FILE_OBJECT_ALIGN_SIZE * x, block_size) * block_size; // inode table
+    size += (uint64_t)calc_clusters((x + 7) / 8, block_size) * block_size * 2; // inode bitmap and block bitmap
+    size += (uint64_t)calc_journal_clusters(x) * block_size; // journal
+    size += (uint64_t)x * block_size; // data blocks
+    return size;
+}
+
 int gen_fs_header(unsigned char *header, unsigned char padding[], size_t fs_padding_size, unsigned char hidden_data[], size_t hidden_data_size,
     struct superblock_info *super_block, uint32_t block_size)
 {
@@ -344,6 +376,14 @@ int main(int argc, char *argv[]) {
     size_t header_data_size = hidden_data_size + superblock_padded_size + fs_padding_size;
     size_t initial_header_size = header_data_size;
 
+    // the primary superblock locator takes the last YUKIFS_LOCATOR_SIZE bytes of the padding
+    if (!S_ISBLK(get_device_type(device_path)) && built_in_len > YUKIFS_LOCATOR_OFFSET) {
+        fprintf(stderr, "Error: built-in ELF (%u bytes) overlaps the superblock locator at offset %u\n", built_in_len, YUKIFS_LOCATOR_OFFSET);
+        if (!try_run && fd != -1) close(fd);
+        if (try_run && mem_device != NULL) free(mem_device);
+        return 1;
+    }
+
     // Allocate memory for the padding
     unsigned char *fs_padding_data = (unsigned char *)malloc(fs_padding_size);
     if (fs_padding_data == NULL) {
@@ -391,19 +431,35 @@ int main(int argc, char *argv[]) {
     // Calculate total_inodes (x) and block_count (x) using the provided formulas
     uint32_t x = 0;
     uint32_t file_object_align_size = FILE_OBJECT_ALIGN_SIZE; // Get the aligned size
-    if (device_size > initial_header_size) {
-        uint32_t remaining_space = device_size - initial_header_size;
+    // the last whole 1 KiB of the device holds the backup superblock locator
+    if (device_size > initial_header_size + YUKIFS_LOCATOR_BACKUP_AREA) {
+        uint32_t remaining_space = YUKIFS_LOCATOR_BACKUP_OFFSET(device_size) - initial_header_size;
         uint32_t block_count = remaining_space / block_size; //block_count means blocks for inode_tables and datas
 
         // solve x for block_count=file_object_align_size*x /block_size + x
         x = (block_count * block_size) / (file_object_align_size + block_size);
 
+        // the bitmaps and the journal take some blocks out of that, give back inodes/blocks until everything fits
+        while (x > 0 && calc_fs_body_size(x, block_size) > remaining_space) {
+            x--;
+        }
     }    
 
+    // the root directory alone takes two data blocks
+    if (x < 2) {
+        fprintf(stderr, "Error: %s is too small for a yukifs filesystem with block size %u\n", device_path, block_size);
+        free(hidden_data_buffer);
+        free(fs_padding_data);
+        free(fs_header_data);
+        if (!try_run && fd != -1) close(fd);
+        if (try_run && mem_device != NULL) free(mem_device);
+        return 1;
+    }
+
     superblock.total_inodes = x;
     superblock.block_count = x;
 
-    superblock.block_free = superblock.block_count -1; // Initially all data blocks are free except for /
+    superblock.block_free = superblock.block_count - 2; // Initially all data blocks are free except for the index and first leaf of /
     superblock.free_inodes = superblock.total_inodes - 1; // Initially all inodes are free except for /
     superblock.inode_table_size = file_object_align_size * x;
 
@@ -422,17 +478,47 @@ int main(int argc, char *argv[]) {
         superblock.inode_table_storage_size = inode_table_clusters * superblock.block_size;
     }
 
+    superblock.inode_bitmap_clusters = calc_clusters((x + 7) / 8, block_size);
+    superblock.block_bitmap_clusters = calc_clusters((x + 7) / 8, block_size);
+    superblock.journal_clusters = calc_journal_clusters(x);
+
+    // one bitmap block of inodes and one of data blocks per allocation group, so every group has bitmaps of its own
+    superblock.group_blocks = block_size * 8;
+    superblock.group_inodes = block_size * 8;
+    superblock.group_count = (x + superblock.group_blocks - 1) / superblock.group_blocks;
+
     // Generate the file system header
     size_t actual_header_size = gen_fs_header(fs_header_data, fs_padding_data, fs_padding_size, hidden_data_buffer, hidden_data_size, &superblock, block_size);
     superblock.inode_table_offset = actual_header_size;
-    superblock.data_blocks_offset = actual_header_size + superblock.inode_table_storage_size;
+    superblock.inode_bitmap_offset = superblock.inode_table_offset + superblock.inode_table_storage_size;
+    superblock.block_bitmap_offset = superblock.inode_bitmap_offset + superblock.inode_bitmap_clusters * block_size;
+    superblock.journal_offset = superblock.block_bitmap_offset + superblock.block_bitmap_clusters * block_size;
+    superblock.data_blocks_offset = superblock.journal_offset + superblock.journal_clusters * block_size;
     superblock.data_blocks_total_size = superblock.block_count * block_size;
     superblock.data_blocks_end_offset = superblock.data_blocks_offset + superblock.data_blocks_total_size;
     superblock.unallocated_space_size = device_size - superblock.data_blocks_end_offset;
 
     // Generate the file system header again to include the actual size of the header
+    superblock.checksum = yukifs_super_csum(&superblock);
     actual_header_size = gen_fs_header(fs_header_data, fs_padding_data, fs_padding_size, hidden_data_buffer, hidden_data_size, &superblock, block_size);
 
+    // Point the superblock locator and its backup at the superblock gen_fs_header placed after the hidden data
+    struct yukifs_locator locator;
+    memset(&locator, 0, sizeof(struct yukifs_locator));
+    locator.magic = YUKIFS_LOCATOR_MAGIC;
+    locator.version = YUKIFS_LOCATOR_VERSION;
+    locator.size = sizeof(struct yukifs_locator);
+    locator.superblock_offset = fs_padding_size + hidden_data_size;
+    locator.hidden_data_offset = fs_padding_size;
+    locator.device_size = device_size;
+    locator.block_size = block_size;
+    locator.checksum = yukifs_locator_csum(&locator);
+    memcpy(fs_header_data + YUKIFS_LOCATOR_OFFSET, &locator, sizeof(struct yukifs_locator));
+
+    unsigned char locator_backup[YUKIFS_LOCATOR_BACKUP_AREA];
+    memset(locator_backup, 0, sizeof(locator_backup));
+    memcpy(locator_backup, &locator, sizeof(struct yukifs_locator));
+
     // Free the allocated memory for the hidden data buffer
     free(hidden_data_buffer); // Free the hidden data buffer
    
@@ -538,15 +624,87 @@ int main(int argc, char *argv[]) {
     // Initialize the inode table with root directory
     struct file_object root_dir;
     memset(&root_dir, 0, sizeof(struct file_object));
-    root_dir.size = block_size;
+    root_dir.size = block_size * 2;
     root_dir.inner_file = 0;
     memset(root_dir.name, 0, sizeof(root_dir.name));
     root_dir.name[0] = '$';
     root_dir.descriptor = S_IFDIR | 0777;
     root_dir.first_block = 0;
+    root_dir.extent_count = 1;
+    root_dir.extent_depth = 0;
+    root_dir.extents[0].logical_block = 0;
+    root_dir.extents[0].physical_block = 0;
+    root_dir.extents[0].length = 2;
+    root_dir.links = 2; // . and .. of the root both point at itself
     root_dir.in_use = 1;
+    root_dir.checksum = yukifs_inode_csum(&root_dir);
     inode_table[0] = root_dir;
 
+    // Allocate and Initialize the inode and block bitmaps, they are laid out back to back
+    size_t bitmaps_size = (superblock.inode_bitmap_clusters + superblock.block_bitmap_clusters) * block_size;
+    unsigned char *bitmaps = (unsigned char *)malloc(bitmaps_size);
+    if (bitmaps == NULL) {
+        perror("Error allocating memory for bitmaps");
+        free(inode_table);
+        free(fs_padding_data);
+        free(fs_header_data);
+        if (!try_run && fd != -1) close(fd);
+        if (try_run && mem_device != NULL) free(mem_device);
+        return 1;
+    }
+    memset(bitmaps, 0, bitmaps_size);
+
+    // root directory takes inode 0 and data blocks 0 and 1
+    unsigned char *inode_bitmap = bitmaps;
+    unsigned char *block_bitmap = bitmaps + superblock.inode_bitmap_clusters * block_size;
+    inode_bitmap[0] |= 0x01;
+    block_bitmap[0] |= 0x03;
+
+    // Initialize the root directory with an index pointing every hash at one empty leaf
+    unsigned char *root_dir_blocks = (unsigned char *)malloc(block_size * 2);
+    if (root_dir_blocks == NULL) {
+        perror("Error allocating memory for root directory");
+        free(bitmaps);
+        free(inode_table);
+        free(fs_padding_data);
+        free(fs_header_data);
+        if (!try_run && fd != -1) close(fd);
+        if (try_run && mem_device != NULL) free(mem_device);
+        return 1;
+    }
+    memset(root_dir_blocks, 0, block_size * 2);
+
+    struct yukifs_dir_index *root_index = (struct yukifs_dir_index *)(root_dir_blocks + YUKIFS_DIR_INDEX_BLOCK * block_size);
+    root_index->magic = YUKIFS_DIR_INDEX_MAGIC;
+    root_index->count = 1;
+    root_index->levels = 0;
+    root_index->max = (block_size - sizeof(struct yukifs_dir_index)) / sizeof(struct yukifs_dir_index_entry);
+    root_index->entries[0].hash = 0;
+    root_index->entries[0].block = YUKIFS_DIR_FIRST_LEAF;
+
+    struct yukifs_dir_leaf *root_leaf = (struct yukifs_dir_leaf *)(root_dir_blocks + YUKIFS_DIR_FIRST_LEAF * block_size);
+    root_leaf->magic = YUKIFS_DIR_LEAF_MAGIC;
+    root_leaf->count = 0;
+    root_leaf->used = 0;
+
+    root_index->checksum = yukifs_dir_block_csum(root_index, block_size);
+    root_leaf->checksum = yukifs_dir_block_csum(root_leaf, block_size);
+
+    // An empty journal, so a mount never replays a transaction left behind by an earlier filesystem on the device
+    size_t journal_size = (size_t)superblock.journal_clusters * block_size;
+    unsigned char *journal = (unsigned char *)calloc(1, journal_size);
+    if (journal == NULL) {
+        perror("Error allocating memory for journal");
+        free(root_dir_blocks);
+        free(bitmaps);
+        free(inode_table);
+        free(fs_padding_data);
+        free(fs_header_data);
+        if (!try_run && fd != -1) close(fd);
+        if (try_run && mem_device != NULL) free(mem_device);
+        return 1;
+    }
+
 
 
     if (!try_run) {
@@ -556,6 +714,9 @@ int main(int argc, char *argv[]) {
         ssize_t bytes_written_header = write(fd, fs_header_data, actual_header_size);
         if (bytes_written_header == -1) {
             perror("Error writing filesystem header to device/image");
+            free(journal);
+            free(root_dir_blocks);
+            free(bitmaps);
             free(inode_table);
             free(fs_padding_data);
             free(fs_header_data);
@@ -576,6 +737,9 @@ int main(int argc, char *argv[]) {
   
         if (bytes_written_inode_table == -1) {
             perror("Error writing inode table to device/image");
+            free(journal);
+            free(root_dir_blocks);
+            free(bitmaps);
             close(fd);
             return 1;
         }
@@ -584,6 +748,84 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Warning: Only %zd bytes of inode table written, expected %zu.\n", bytes_written_inode_table, inode_table_size);
         }
 
+        printf("Writing bitmaps to the device/image...\n");
+        // Write the bitmaps right after the inode table storage
+        if (lseek(fd, superblock.inode_bitmap_offset, SEEK_SET) == -1) {
+            perror("Error seeking to bitmaps");
+            free(journal);
+            free(root_dir_blocks);
+            free(bitmaps);
+            close(fd);
+            return 1;
+        }
+
+        ssize_t bytes_written_bitmaps = write(fd, bitmaps, bitmaps_size);
+        free(bitmaps);
+
+        if (bytes_written_bitmaps == -1) {
+            perror("Error writing bitmaps to device/image");
+            free(journal);
+            free(root_dir_blocks);
+            close(fd);
+            return 1;
+        }
+
+        if ((size_t)bytes_written_bitmaps < bitmaps_size) {
+            fprintf(stderr, "Warning: Only %zd bytes of bitmaps written, expected %zu.\n", bytes_written_bitmaps, bitmaps_size);
+        }
+
+        printf("Writing journal to the device/image...\n");
+        // Clear the journal right after the bitmaps
+        if (lseek(fd, superblock.journal_offset, SEEK_SET) == -1) {
+            perror("Error seeking to journal");
+            free(journal);
+            free(root_dir_blocks);
+            close(fd);
+            return 1;
+        }
+
+        ssize_t bytes_written_journal = write(fd, journal, journal_size);
+        free(journal);
+
+        if (bytes_written_journal == -1 || (size_t)bytes_written_journal < journal_size) {
+            perror("Error writing journal to device/image");
+            free(root_dir_blocks);
+            close(fd);
+            return 1;
+        }
+
+        printf("Writing root directory to the device/image...\n");
+        // Write the root directory blocks at the start of the data blocks
+        if (lseek(fd, superblock.data_blocks_offset, SEEK_SET) == -1) {
+            perror("Error seeking to data blocks");
+            free(root_dir_blocks);
+            close(fd);
+            return 1;
+        }
+
+        ssize_t bytes_written_root_dir = write(fd, root_dir_blocks, block_size * 2);
+        free(root_dir_blocks);
+
+        if (bytes_written_root_dir == -1) {
+            perror("Error writing root directory to device/image");
+            close(fd);
+            return 1;
+        }
+
+        printf("Writing backup superblock locator to the device/image...\n");
+        // Write the backup locator at the start of the last whole 1 KiB of the device
+        if (lseek(fd, YUKIFS_LOCATOR_BACKUP_OFFSET(device_size), SEEK_SET) == -1) {
+            perror("Error seeking to backup superblock locator");
+            close(fd);
+            return 1;
+        }
+
+        if (write(fd, locator_backup, sizeof(locator_backup)) != sizeof(locator_backup)) {
+            perror("Error writing backup superblock locator to device/image");
+            close(fd);
+            return 1;
+        }
+
         printf("yukifs filesystem created successfully on %s with block size %d, total inodes/blocks: %u\n", effective_device_path, block_size, x);
 
         close(fd);
@@ -596,6 +838,21 @@ int main(int argc, char *argv[]) {
         // Simulate writing inode table to memory
         memcpy(mem_device + actual_header_size, inode_table, inode_table_size);        
 
+        // Simulate writing bitmaps to memory
+        memcpy(mem_device + superblock.inode_bitmap_offset, bitmaps, bitmaps_size);
+
+        // Simulate writing journal to memory
+        memcpy(mem_device + superblock.journal_offset, journal, journal_size);
+
+        // Simulate writing root directory to memory
+        memcpy(mem_device + superblock.data_blocks_offset, root_dir_blocks, block_size * 2);
+
+        // Simulate writing backup superblock locator to memory
+        memcpy(mem_device + YUKIFS_LOCATOR_BACKUP_OFFSET(device_size), locator_backup, sizeof(locator_backup));
+
+        free(journal);
+        free(root_dir_blocks);
+        free(bitmaps);
         free(inode_table);
         free(fs_padding_data);
         free(fs_header_data);
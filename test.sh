@@ -86,6 +86,102 @@ echo "----- Test Case 1 End -----"
 # umount fs > /dev/null 2>&1
 # echo "----- Test Case 4 End -----"
 
+echo "----- Test Case 5 Begin -----"
+echo "Operation: rmdir dir, echo 789 > new.txt, sync (the freed directory block is reused)"
+mount -t yuki -o loop test.img fs > /dev/null 2>&1
+mkdir fs/dir
+touch fs/dir/a.txt
+rm -f fs/dir/a.txt
+rmdir fs/dir
+echo 789 > fs/new.txt
+sync
+umount fs > /dev/null 2>&1
+mount -t yuki -o loop test.img fs > /dev/null 2>&1
+echo "Expected: 789"
+echo -n "Actual: "
+cat fs/new.txt
+ls -alci fs
+umount fs > /dev/null 2>&1
+echo "----- Test Case 5 End -----"
+
+echo "----- Test Case 6 Begin -----"
+echo "Operation: fallocate, buffered and O_DIRECT writes into unwritten blocks and a hole, sync, remount"
+dd if=/dev/zero of=unwritten.img bs=1MiB count=8 > /dev/null 2>&1
+mkfs.yukifs -y unwritten.img > /dev/null 2>&1
+mount -t yuki -o loop unwritten.img fs > /dev/null 2>&1
+fallocate -l 65536 fs/pre.bin
+printf 'abc' | dd of=fs/pre.bin bs=1 seek=4096 conv=notrunc status=none
+truncate -s 131072 fs/pre.bin
+head -c 4096 /dev/zero | tr '\0' 'd' | dd of=fs/pre.bin bs=4096 seek=8 oflag=direct conv=notrunc status=none
+head -c 4096 /dev/zero | tr '\0' 'e' | dd of=fs/pre.bin bs=4096 seek=20 oflag=direct conv=notrunc status=none
+sync
+umount fs > /dev/null 2>&1
+mount -t yuki -o loop unwritten.img fs > /dev/null 2>&1
+echo "Expected: abc ddd eee 8195"
+echo -n "Actual: "
+echo "$(dd if=fs/pre.bin bs=1 skip=4096 count=3 status=none) $(dd if=fs/pre.bin bs=1 skip=32768 count=3 status=none) $(dd if=fs/pre.bin bs=1 skip=81920 count=3 status=none) $(tr -d '\0' < fs/pre.bin | wc -c)"
+umount fs > /dev/null 2>&1
+rm -f unwritten.img > /dev/null 2>&1
+echo "----- Test Case 6 End -----"
+
+echo "----- Test Case 7 Begin -----"
+echo "Operation: create 20500 files in one directory (the index grows a level), remount, look up, list, remove them, rmdir"
+dd if=/dev/zero of=big.img bs=1MiB count=64 > /dev/null 2>&1
+mkfs.yukifs -y -b 1024 big.img > /dev/null 2>&1
+mount -t yuki -o loop big.img fs > /dev/null 2>&1
+mkdir fs/big
+(cd fs/big && seq -f "f%05g" 1 20500 | xargs touch)
+umount fs > /dev/null 2>&1
+mount -t yuki -o loop big.img fs > /dev/null 2>&1
+echo "Expected: 20500 20500 f12345 0"
+echo -n "Actual: "
+echo -n "$(ls fs/big | wc -l) $(ls fs/big | sort -u | wc -l) $(basename "$(ls fs/big/f12345)") "
+(cd fs/big && seq -f "f%05g" 1 20500 | xargs rm -f)
+rmdir fs/big
+echo $?
+umount fs > /dev/null 2>&1
+rm -f big.img > /dev/null 2>&1
+echo "----- Test Case 7 End -----"
+
+echo "----- Test Case 8 Begin -----"
+echo "Operation: mount with compress=zstd, write a file over several clusters, overwrite the middle, truncate mid-cluster, remount, chattr -c"
+dd if=/dev/zero of=compress.img bs=1MiB count=16 > /dev/null 2>&1
+mkfs.yukifs -y compress.img > /dev/null 2>&1
+mount -t yuki -o loop,compress=zstd compress.img fs > /dev/null 2>&1
+head -c 300000 /dev/zero | tr '\0' 'a' > fs/packed.txt
+printf 'xyz' | dd of=fs/packed.txt bs=1 seek=100000 conv=notrunc status=none
+sync
+truncate -s 150000 fs/packed.txt
+umount fs > /dev/null 2>&1
+mount -t yuki -o loop compress.img fs > /dev/null 2>&1
+echo "Expected: xyz 149997 150000 0"
+echo -n "Actual: "
+echo -n "$(dd if=fs/packed.txt bs=1 skip=100000 count=3 status=none) $(tr -cd 'a' < fs/packed.txt | wc -c) $(stat -c %s fs/packed.txt) "
+chattr -c fs/packed.txt
+echo $?
+umount fs > /dev/null 2>&1
+rm -f compress.img > /dev/null 2>&1
+echo "----- Test Case 8 End -----"
+
+echo "----- Test Case 9 Begin -----"
+echo "Operation: mount with compress=zstd, write a 24 MiB file (384 clusters, each its own extent), remount, compare, remove"
+dd if=/dev/zero of=compress.img bs=1MiB count=64 > /dev/null 2>&1
+mkfs.yukifs -y -b 1024 compress.img > /dev/null 2>&1
+mount -t yuki -o loop,compress=zstd compress.img fs > /dev/null 2>&1
+yes yukifs | head -c 25165824 > fs/large.txt
+umount fs > /dev/null 2>&1
+mount -t yuki -o loop compress.img fs > /dev/null 2>&1
+echo "Expected: 25165824 0 0"
+echo -n "Actual: "
+echo -n "$(stat -c %s fs/large.txt) "
+yes yukifs | head -c 25165824 | cmp -s - fs/large.txt
+echo -n "$? "
+rm -f fs/large.txt
+echo $?
+umount fs > /dev/null 2>&1
+rm -f compress.img > /dev/null 2>&1
+echo "----- Test Case 9 End -----"
+
 ls -alci fs > /dev/null 2>&1
 
 df -kh fs > /dev/null 2>&1
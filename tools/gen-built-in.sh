@@ -96,6 +96,8 @@ echo "built-in ELF size after strip: $BUILT_IN_SIZE bytes"
 # get some SIZE from header ../include/file_table.h
 FS_PADDING_SIZE=$(grep -E '^#define FS_PADDING_SIZE' ../include/file_table.h | awk '{print $3}')
 echo "FS_PADDING_SIZE from header: $FS_PADDING_SIZE bytes"
+LOCATOR_SIZE=$(grep -E '^#define YUKIFS_LOCATOR_SIZE' ../include/file_table.h | awk '{print $3}')
+echo "YUKIFS_LOCATOR_SIZE from header: $LOCATOR_SIZE bytes"
 MINIMAL_BLOCK_SIZE=$(grep -E '^#define MINIMAL_BLOCK_SIZE' ../include/file_table.h | awk '{print $3}')
 echo "MINIMAL_BLOCK_SIZE from header: $MINIMAL_BLOCK_SIZE bytes"
 MAXIMUM_BLOCK_SIZE=$(grep -E '^#define MAXIMUM_BLOCK_SIZE' ../include/file_table.h | awk '{print $3}')
@@ -103,7 +105,8 @@ echo "MAXIMUM_BLOCK_SIZE from header: $MAXIMUM_BLOCK_SIZE bytes"
 
 echo "======================================="
 
-if [ $BUILT_IN_SIZE -gt $FS_PADDING_SIZE ]; then
+# the superblock locator takes the last YUKIFS_LOCATOR_SIZE bytes of FS_PADDING_SIZE
+if [ $BUILT_IN_SIZE -gt $((FS_PADDING_SIZE - LOCATOR_SIZE)) ]; then
     echo "There is not enough space in FS_PADDING_HEADER to embed built-in"
     echo "Please increase FS_PADDING_SIZE in ../../include/file_table.h"
     exit 1